@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "flat_hash_map.h"
+
+// Phrase dictionary of adaptive mode, which the encoder and the decoder grow
+// the same way from the codes written so far, so that no dictionary is
+// stored or trained. Codes stand for words, added when they first occur,
+// and for phrases. As in LZW, after each code the phrase before it is
+// extended by the first word of that code, so repeated text is taken in
+// longer and longer steps.
+//
+// Phrases are bounded by max_phrases. When the dictionary is full, the
+// least recently used phrase makes room. A use of a phrase also counts for
+// every phrase it extends, after it, and a new phrase goes in just after the
+// phrase it extends. A phrase is then always used less recently than the
+// one it extends, so the least recently used one is never extended by
+// another and can go without breaking them. Words stay.
+class AdaptiveDictionary {
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    struct Entry {
+        uint32_t parent;  // The code this phrase extends, NONE for a word
+        uint32_t first;   // First and last word, as word numbers
+        uint32_t last;
+        uint32_t length;  // In words
+        uint32_t older;   // Neighbours in the order of use, phrases only
+        uint32_t newer;
+    };
+
+    explicit AdaptiveDictionary(uint32_t max_phrases) : max_phrases(max_phrases) {}
+
+    // Codes in use
+    uint32_t size() const {
+        return static_cast<uint32_t>(entries.size());
+    }
+
+    uint32_t word_count() const {
+        return words;
+    }
+
+    uint64_t evicted() const {
+        return evictions;
+    }
+
+    const Entry& operator[](uint32_t code) const {
+        return entries[code];
+    }
+
+    // Code of the next word, which becomes word number word_count()
+    uint32_t add_word() {
+        entries.push_back({NONE, words, words, 1, NONE, NONE});
+        words++;
+        return size() - 1;
+    }
+
+    // Code of code extended by a word, or NONE
+    uint32_t child(uint32_t code, uint32_t word) const {
+        auto it = children.find(child_key(code, word));
+        if (it == children.end()) {
+            return NONE;
+        }
+        const Entry& entry = entries[it->second];
+        return entry.parent == code && entry.last == word ? it->second : NONE;
+    }
+
+    // Count a use of code and of the phrases it extends
+    void touch(uint32_t code) {
+        for (; entries[code].parent != NONE; code = entries[code].parent) {
+            unlink(code);
+            link_newest(code);
+        }
+    }
+
+    // Extend the code written before the last one by the first word of the
+    // last one, unless that phrase is there already
+    void extend(uint32_t previous, uint32_t word) {
+        if (previous == NONE || child(previous, word) != NONE) {
+            return;
+        }
+        uint32_t code;
+        if (phrases < max_phrases) {
+            code = size();
+            entries.emplace_back();
+            phrases++;
+        } else {
+            code = oldest;
+            if (code == previous) {
+                return;
+            }
+            unlink(code);
+            evictions++;
+        }
+        const Entry& extended = entries[previous];
+        entries[code] = {previous, extended.first, word, extended.length + 1, NONE, NONE};
+        if (extended.parent == NONE) {
+            link_newest(code);
+        } else {
+            link_after(code, previous);
+        }
+
+        // Evicted phrases stay in the map until it is rebuilt from the
+        // phrases there are, at twice their count
+        children[child_key(previous, word)] = code;
+        if (children.size() > 2 * static_cast<size_t>(max_phrases)) {
+            children.clear();
+            for (uint32_t c = 0; c < size(); ++c) {
+                if (entries[c].parent != NONE) {
+                    children[child_key(entries[c].parent, entries[c].last)] = c;
+                }
+            }
+        }
+    }
+
+private:
+    uint32_t max_phrases;
+    uint32_t phrases = 0;
+    uint32_t words = 0;
+    uint64_t evictions = 0;
+    std::vector<Entry> entries;
+    FlatHashMap<uint64_t, uint32_t> children;
+
+    // Ends of the order of use
+    uint32_t newest = NONE;
+    uint32_t oldest = NONE;
+
+    static uint64_t child_key(uint32_t code, uint32_t word) {
+        return static_cast<uint64_t>(code) << 32 | word;
+    }
+
+    void unlink(uint32_t code) {
+        Entry& entry = entries[code];
+        (entry.older != NONE ? entries[entry.older].newer : oldest) = entry.newer;
+        (entry.newer != NONE ? entries[entry.newer].older : newest) = entry.older;
+    }
+
+    void link_newest(uint32_t code) {
+        entries[code].older = newest;
+        entries[code].newer = NONE;
+        (newest != NONE ? entries[newest].newer : oldest) = code;
+        newest = code;
+    }
+
+    // Just older than next
+    void link_after(uint32_t code, uint32_t next) {
+        uint32_t older = entries[next].older;
+        entries[code].older = older;
+        entries[code].newer = next;
+        entries[next].older = code;
+        (older != NONE ? entries[older].newer : oldest) = code;
+    }
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <string_view>
+#include <utility>
+
+// Monotonic arena for data that dies all at once: one phrase trie, or the
+// scratch tables of one mining pass. Objects made here are never destroyed
+// one by one; everything they own must come from the same arena, and reset()
+// (or the arena's destructor) hands all of it back in a few large frees.
+class Arena {
+private:
+    std::pmr::monotonic_buffer_resource resource;
+
+public:
+    explicit Arena(size_t initial_size = 1 << 16) : resource(initial_size) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    std::pmr::memory_resource* get() {
+        return &resource;
+    }
+
+    // Construct an object in the arena; its destructor never runs
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        void* memory = resource.allocate(sizeof(T), alignof(T));
+        return new (memory) T(std::forward<Args>(args)...);
+    }
+
+    // Copy of text that lives as long as the arena
+    std::string_view copy_string(std::string_view text) {
+        char* memory = static_cast<char*>(resource.allocate(text.size() ? text.size() : 1, 1));
+        memcpy(memory, text.data(), text.size());
+        return std::string_view(memory, text.size());
+    }
+
+    void reset() {
+        resource.release();
+    }
+};
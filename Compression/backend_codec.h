@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// General-purpose codecs run as a second stage over the split token
+// streams. Each stream is one kind of value in a fixed layout, where an LZ
+// coder finds the repeats that the packed bitstream hides. A codec is chosen
+// per archive by name and recorded in the file header by id, so ids never
+// change. LZMA and zstd are opt in, so a plain build needs no libraries:
+// build with -DBACKEND_CODEC_LZMA -llzma or -DBACKEND_CODEC_ZSTD -lzstd.
+#ifdef BACKEND_CODEC_LZMA
+#include <lzma.h>
+#endif
+
+#ifdef BACKEND_CODEC_ZSTD
+#include <zstd.h>
+#endif
+
+class BackendCodec {
+public:
+    enum Id : uint8_t {
+        NONE = 0,
+        LZMA = 1,
+        ZSTD = 2
+    };
+
+    virtual ~BackendCodec() = default;
+
+    virtual Id id() const = 0;
+    virtual const char* name() const = 0;
+
+    // Compress data to out; false if the codec fails
+    virtual bool compress(const std::vector<uint8_t>& data, std::vector<uint8_t>& out) const = 0;
+
+    // Decompress size bytes to out; false unless they hold exactly
+    // raw_size bytes
+    virtual bool decompress(const uint8_t* data, size_t size, size_t raw_size,
+                            std::vector<uint8_t>& out) const = 0;
+
+    // Codec by name or by id; nullptr if unknown or not built in
+    static const BackendCodec* find(const std::string& name) {
+        for (const BackendCodec* codec : codecs()) {
+            if (name == codec->name()) {
+                return codec;
+            }
+        }
+        return nullptr;
+    }
+
+    static const BackendCodec* find(uint8_t id) {
+        for (const BackendCodec* codec : codecs()) {
+            if (id == codec->id()) {
+                return codec;
+            }
+        }
+        return nullptr;
+    }
+
+    // Names of the codecs built in, for usage messages
+    static std::string names() {
+        std::string list;
+        for (const BackendCodec* codec : codecs()) {
+            list += list.empty() ? "" : ", ";
+            list += codec->name();
+        }
+        return list;
+    }
+
+private:
+    static const std::vector<const BackendCodec*>& codecs();
+};
+
+// Stored as is; for comparisons and for files written without a codec
+class NullCodec : public BackendCodec {
+public:
+    Id id() const override {
+        return NONE;
+    }
+
+    const char* name() const override {
+        return "none";
+    }
+
+    bool compress(const std::vector<uint8_t>& data, std::vector<uint8_t>& out) const override {
+        out = data;
+        return true;
+    }
+
+    bool decompress(const uint8_t* data, size_t size, size_t raw_size, std::vector<uint8_t>& out) const override {
+        if (size != raw_size) {
+            return false;
+        }
+        out.assign(data, data + size);
+        return true;
+    }
+};
+
+#ifdef BACKEND_CODEC_LZMA
+// Raw LZMA2 with no .xz container: the stream header already holds the
+// sizes, and a container costs dozens of bytes per stream
+class LzmaCodec : public BackendCodec {
+public:
+    static constexpr uint32_t PRESET = 6;
+
+    Id id() const override {
+        return LZMA;
+    }
+
+    const char* name() const override {
+        return "lzma";
+    }
+
+    bool compress(const std::vector<uint8_t>& data, std::vector<uint8_t>& out) const override {
+        lzma_options_lzma options;
+        lzma_filter filters[2];
+        if (!make_filters(options, filters)) {
+            return false;
+        }
+        out.resize(lzma_stream_buffer_bound(data.size()));
+        size_t out_size = 0;
+        if (lzma_raw_buffer_encode(filters, nullptr, data.data(), data.size(),
+                                   out.data(), &out_size, out.size()) != LZMA_OK) {
+            return false;
+        }
+        out.resize(out_size);
+        return true;
+    }
+
+    bool decompress(const uint8_t* data, size_t size, size_t raw_size, std::vector<uint8_t>& out) const override {
+        lzma_options_lzma options;
+        lzma_filter filters[2];
+        if (!make_filters(options, filters)) {
+            return false;
+        }
+        out.resize(raw_size);
+        size_t in_pos = 0, out_pos = 0;
+        lzma_ret result = lzma_raw_buffer_decode(filters, nullptr, data, &in_pos, size,
+                                                 out.data(), &out_pos, out.size());
+        return (result == LZMA_OK || result == LZMA_STREAM_END) && in_pos == size && out_pos == raw_size;
+    }
+
+private:
+    // Encoder and decoder must agree on the options, the dictionary size
+    // above all, so both take them from PRESET
+    static bool make_filters(lzma_options_lzma& options, lzma_filter filters[2]) {
+        if (lzma_lzma_preset(&options, PRESET)) {
+            return false;
+        }
+        filters[0].id = LZMA_FILTER_LZMA2;
+        filters[0].options = &options;
+        filters[1].id = LZMA_VLI_UNKNOWN;
+        filters[1].options = nullptr;
+        return true;
+    }
+};
+#endif
+
+#ifdef BACKEND_CODEC_ZSTD
+class ZstdCodec : public BackendCodec {
+public:
+    static constexpr int LEVEL = 19;
+
+    Id id() const override {
+        return ZSTD;
+    }
+
+    const char* name() const override {
+        return "zstd";
+    }
+
+    bool compress(const std::vector<uint8_t>& data, std::vector<uint8_t>& out) const override {
+        out.resize(ZSTD_compressBound(data.size()));
+        size_t out_size = ZSTD_compress(out.data(), out.size(), data.data(), data.size(), LEVEL);
+        if (ZSTD_isError(out_size)) {
+            return false;
+        }
+        out.resize(out_size);
+        return true;
+    }
+
+    bool decompress(const uint8_t* data, size_t size, size_t raw_size, std::vector<uint8_t>& out) const override {
+        out.resize(raw_size);
+        size_t out_size = ZSTD_decompress(out.data(), out.size(), data, size);
+        return !ZSTD_isError(out_size) && out_size == raw_size;
+    }
+};
+#endif
+
+inline const std::vector<const BackendCodec*>& BackendCodec::codecs() {
+    static const NullCodec null_codec;
+#ifdef BACKEND_CODEC_LZMA
+    static const LzmaCodec lzma_codec;
+#endif
+#ifdef BACKEND_CODEC_ZSTD
+    static const ZstdCodec zstd_codec;
+#endif
+    static const std::vector<const BackendCodec*> all = {
+        &null_codec,
+#ifdef BACKEND_CODEC_LZMA
+        &lzma_codec,
+#endif
+#ifdef BACKEND_CODEC_ZSTD
+        &zstd_codec,
+#endif
+    };
+    return all;
+}
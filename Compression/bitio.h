@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// MSB-first bit packing used by every on-disk stream of the compressor
+class BitWriter {
+private:
+    std::vector<uint8_t> buffer;
+    uint8_t current_byte = 0;
+    uint8_t bits_used = 0;
+
+public:
+    void write_bits(uint32_t value, uint8_t bit_count) {
+        while (bit_count > 0) {
+            uint8_t bits_to_write = std::min(bit_count, static_cast<uint8_t>(8 - bits_used));
+            uint8_t mask = (1 << bits_to_write) - 1;
+            uint8_t bits = (value >> (bit_count - bits_to_write)) & mask;
+
+            current_byte |= bits << (8 - bits_used - bits_to_write);
+            bits_used += bits_to_write;
+            bit_count -= bits_to_write;
+
+            if (bits_used == 8) {
+                buffer.push_back(current_byte);
+                current_byte = 0;
+                bits_used = 0;
+            }
+        }
+    }
+
+    // Elias gamma code for value >= 1: small values take few bits
+    void write_gamma(uint32_t value) {
+        uint8_t bits = 0;
+        while ((value >> bits) > 1) bits++;
+        write_bits(0, bits);
+        write_bits(value, bits + 1);
+    }
+
+    // Append whole bytes, directly when the writer is at a byte boundary
+    void write_bytes(const std::vector<uint8_t>& bytes) {
+        if (bits_used != 0) {
+            for (uint8_t byte : bytes) {
+                write_bits(byte, 8);
+            }
+            return;
+        }
+        buffer.insert(buffer.end(), bytes.begin(), bytes.end());
+    }
+
+    // Bits written so far, including the unfinished byte
+    uint64_t bit_count() const {
+        return buffer.size() * 8 + bits_used;
+    }
+
+    void flush() {
+        if (bits_used > 0) {
+            buffer.push_back(current_byte);
+            current_byte = 0;
+            bits_used = 0;
+        }
+    }
+
+    const std::vector<uint8_t>& get_buffer() const {
+        return buffer;
+    }
+
+    // Write the finished bytes to out and drop them, keeping the unfinished
+    // one; bit_count then counts from there
+    void drain(std::ostream& out) {
+        out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+        buffer.clear();
+    }
+
+    bool write_to_file(const std::string& filename) {
+        flush();
+        std::ofstream outfile(filename, std::ios::binary);
+        if (!outfile) return false;
+        outfile.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+        return outfile.good();
+    }
+};
+
+class BitReader {
+private:
+    const uint8_t* bytes;
+    size_t byte_count;
+    size_t current_byte_idx = 0;
+    uint8_t bits_read = 0;
+    bool overrun = false;  // A read or skip went past the end
+
+public:
+    BitReader(const std::vector<uint8_t>& buf) : bytes(buf.data()), byte_count(buf.size()) {}
+
+    // Reader over a range of bytes that must outlive it
+    BitReader(const uint8_t* data, size_t size) : bytes(data), byte_count(size) {}
+
+    uint32_t read_bits(uint8_t bit_count) {
+        uint32_t result = 0;
+
+        while (bit_count > 0 && current_byte_idx < byte_count) {
+            uint8_t bits_to_read = std::min(bit_count, static_cast<uint8_t>(8 - bits_read));
+            uint8_t mask = ((1 << bits_to_read) - 1) << (8 - bits_read - bits_to_read);
+            uint8_t bits = (bytes[current_byte_idx] & mask) >> (8 - bits_read - bits_to_read);
+
+            result = (result << bits_to_read) | bits;
+            bits_read += bits_to_read;
+            bit_count -= bits_to_read;
+
+            if (bits_read == 8) {
+                current_byte_idx++;
+                bits_read = 0;
+            }
+        }
+        overrun = overrun || bit_count > 0;
+
+        return result;
+    }
+
+    // The next bit_count bits, up to 32, without consuming them; one 8-byte
+    // load wherever 8 bytes are left. Inlined with a constant bit_count every
+    // shift and mask is a constant as well.
+    uint32_t peek_window(uint8_t bit_count) const {
+        if (bit_count == 0) {
+            return 0;
+        }
+        if (current_byte_idx + 8 > byte_count) {
+            // Near the end: missing bits read as zeros
+            size_t available = (byte_count - current_byte_idx) * 8 - bits_read;
+            uint8_t present = static_cast<uint8_t>(std::min<size_t>(bit_count, available));
+            BitReader copy = *this;
+            uint32_t result = copy.read_bits(present);
+            return present == bit_count ? result : result << (bit_count - present);
+        }
+        uint64_t window;
+        memcpy(&window, bytes + current_byte_idx, 8);
+        window = __builtin_bswap64(window);
+        return static_cast<uint32_t>((window << bits_read) >> (64 - bit_count));
+    }
+
+    void skip_bits(uint8_t bit_count) {
+        overrun = overrun || bit_count > bits_left();
+        size_t position = bits_read + bit_count;
+        current_byte_idx = std::min(current_byte_idx + (position >> 3), byte_count);
+        bits_read = current_byte_idx < byte_count ? position & 7 : 0;
+    }
+
+    // Same as read_bits for up to 32 bits, through peek_window
+    uint32_t read_window(uint8_t bit_count) {
+        uint32_t result = peek_window(bit_count);
+        skip_bits(bit_count);
+        return result;
+    }
+
+    template <uint8_t BitCount>
+    uint32_t read_bits() {
+        static_assert(BitCount <= 32, "at most 32 bits at a time");
+        return read_window(BitCount);
+    }
+
+    // Skip to the next byte boundary
+    void align_to_byte() {
+        if (bits_read > 0) {
+            current_byte_idx++;
+            bits_read = 0;
+        }
+    }
+
+    // The next count bytes, consumed, or nullptr if fewer are left; the
+    // reader must be at a byte boundary
+    const uint8_t* read_bytes(size_t count) {
+        if (bits_read != 0 || count > byte_count - current_byte_idx) {
+            return nullptr;
+        }
+        const uint8_t* start = bytes + current_byte_idx;
+        current_byte_idx += count;
+        return start;
+    }
+
+    uint32_t read_gamma() {
+        uint8_t bits = 0;
+        while (read_bits(1) == 0 && bits < 32 && has_more()) bits++;
+        // No value written has 32 leading zeros; only a damaged file does
+        return bits < 32 ? (1u << bits) | read_bits(bits) : 0;
+    }
+
+    bool has_more() const {
+        return current_byte_idx < byte_count;
+    }
+
+    // Bits not read yet
+    uint64_t bits_left() const {
+        return (byte_count - current_byte_idx) * 8 - bits_read;
+    }
+
+    // Whether a read went past the end, where the missing bits read as
+    // zeros: the data was truncated or damaged
+    bool overran() const {
+        return overrun;
+    }
+};
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "bitio.h"
+#include "mapped_file.h"
+
+// Which blocks of a split-stream archive hold each word and phrase, kept in
+// a file of its own next to the archive, so that a search can rule out
+// archives and blocks before it reads them. Keys are word IDs (main codes,
+// then local codes and the number code) and after them phrase IDs, as in
+// the entropy-coded layout. A block holds a word where it codes it as a
+// word or a filler or copies it in a match; the words of a phrase are held
+// through the phrase's key.
+//
+// The file holds one section per segment of the archive, in order, so that
+// appending text appends a section. Layout of a section, MSB first: magic,
+// its length in bytes after that in 32 bits, the byte offset its segment
+// ends at (the size of the archive, unless text was appended after it),
+// the block count in 32 bits, and per block its byte offset in the archive,
+// its word count and its number count; offsets and counts take 64 bits, as
+// two halves. Then the key count in 32 bits and per key, in order, the
+// gamma codes of its distance from the key before plus one, of its block
+// count and of its first block plus one; if it has more blocks, the width
+// of the gaps between them in 5 bits and each gap less one at that width.
+class BlockIndex {
+public:
+    struct Block {
+        uint64_t offset;  // Of its token count in the archive
+        uint64_t words;
+        uint64_t numbers;  // Number tokens, matched ones included
+    };
+
+    // Blocks holding a key, in order, as a range of the posting entries
+    struct Postings {
+        const uint32_t* first = nullptr;
+        const uint32_t* last = nullptr;
+    };
+
+    void clear() {
+        *this = BlockIndex();
+    }
+
+    // Add the next block. keys may repeat and be in any order; they are
+    // sorted in place.
+    void add_block(uint64_t offset, uint64_t words, uint64_t numbers, std::vector<uint32_t>& keys) {
+        uint32_t block = static_cast<uint32_t>(blocks.size());
+        blocks.push_back({offset, words, numbers});
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        for (uint32_t key : keys) {
+            if (key >= building.size()) {
+                building.resize(key + 1);
+            }
+            building[key].push_back(block);
+        }
+    }
+
+    // Write the index of a segment that ends at byte segment_end of its
+    // archive, as the whole file or appended to it; its size in bits, or 0
+    // if it cannot be written
+    uint64_t write(const std::string& filename, uint64_t segment_end, bool append) const {
+        BitWriter writer;
+        write_64(writer, segment_end);
+        writer.write_bits(static_cast<uint32_t>(blocks.size()), 32);
+        for (const auto& block : blocks) {
+            write_64(writer, block.offset);
+            write_64(writer, block.words);
+            write_64(writer, block.numbers);
+        }
+
+        uint32_t key_count = 0;
+        for (const auto& list : building) {
+            key_count += !list.empty();
+        }
+        writer.write_bits(key_count, 32);
+        uint32_t previous = 0;
+        for (uint32_t key = 0; key < building.size(); ++key) {
+            const std::vector<uint32_t>& list = building[key];
+            if (list.empty()) {
+                continue;
+            }
+            writer.write_gamma(key - previous + 1);
+            previous = key;
+            writer.write_gamma(static_cast<uint32_t>(list.size()));
+            writer.write_gamma(list[0] + 1);
+            if (list.size() > 1) {
+                uint32_t widest = 0;
+                for (size_t i = 1; i < list.size(); ++i) {
+                    widest = std::max(widest, list[i] - list[i - 1] - 1);
+                }
+                uint8_t width = bits_needed(widest);
+                writer.write_bits(width, 5);
+                for (size_t i = 1; i < list.size(); ++i) {
+                    writer.write_bits(list[i] - list[i - 1] - 1, width);
+                }
+            }
+        }
+        writer.flush();
+
+        BitWriter section;
+        for (size_t i = 0; i < 4; ++i) {
+            section.write_bits(static_cast<uint8_t>(MAGIC[i]), 8);
+        }
+        section.write_bits(static_cast<uint32_t>(writer.get_buffer().size()), 32);
+        section.write_bytes(writer.get_buffer());
+        std::ofstream outfile(filename, std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+        outfile.write(reinterpret_cast<const char*>(section.get_buffer().data()), section.get_buffer().size());
+        return outfile.good() ? section.bit_count() : 0;
+    }
+
+    // Read the sections of an index file; false if it is missing or malformed
+    static bool read(const std::string& filename, std::vector<BlockIndex>& sections) {
+        sections.clear();
+        MappedFile file;
+        if (!file.open(filename)) {
+            return false;
+        }
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(file.data());
+        size_t offset = 0;
+        while (offset < file.size()) {
+            if (file.size() - offset < 8 || !std::equal(MAGIC, MAGIC + 4, data + offset)) {
+                return false;
+            }
+            BitReader reader(data + offset + 4, 4);
+            size_t length = reader.read_bits(32);
+            offset += 8;
+            sections.emplace_back();
+            if (length > file.size() - offset || !sections.back().parse(data + offset, length)) {
+                return false;
+            }
+            offset += length;
+        }
+        return !sections.empty();
+    }
+
+    uint64_t segment_end() const {
+        return end_offset;
+    }
+
+    const std::vector<Block>& get_blocks() const {
+        return blocks;
+    }
+
+    Postings find(uint32_t key) const {
+        auto it = std::lower_bound(keys.begin(), keys.end(), key);
+        Postings postings;
+        if (it != keys.end() && *it == key) {
+            size_t k = it - keys.begin();
+            postings.first = entries.data() + starts[k];
+            postings.last = entries.data() + starts[k + 1];
+        }
+        return postings;
+    }
+
+    // Blocks in both of two sorted lists
+    static std::vector<uint32_t> intersect(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+        std::vector<uint32_t> result;
+        std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(result));
+        return result;
+    }
+
+private:
+    static constexpr char MAGIC[] = "TTX1";
+
+    std::vector<Block> blocks;
+    uint64_t end_offset = 0;
+
+    // While building: the blocks of each key, indexed by key
+    std::vector<std::vector<uint32_t>> building;
+
+    // As read: the keys that occur, and for each the start of its blocks in
+    // entries, with one more start at the end
+    std::vector<uint32_t> keys;
+    std::vector<size_t> starts;
+    std::vector<uint32_t> entries;
+
+    // Read one section after its length
+    bool parse(const uint8_t* data, size_t size) {
+        BitReader reader(data, size);
+        end_offset = read_64(reader);
+        uint32_t block_count = reader.read_bits(32);
+        if (block_count > size / 24) {
+            return false;
+        }
+        blocks.resize(block_count);
+        for (auto& block : blocks) {
+            block.offset = read_64(reader);
+            block.words = read_64(reader);
+            block.numbers = read_64(reader);
+        }
+
+        uint32_t key_count = reader.read_bits(32);
+        if (key_count > size * 8) {
+            return false;
+        }
+        keys.resize(key_count);
+        starts.resize(key_count + 1);
+        entries.clear();
+        uint64_t key = 0;
+        for (uint32_t k = 0; k < key_count; ++k) {
+            if (!reader.has_more()) {
+                return false;
+            }
+            key += reader.read_gamma() - 1;
+            uint32_t count = reader.read_gamma();
+            uint64_t block = reader.read_gamma() - 1;
+            if (key > UINT32_MAX || count > block_count || block >= block_count) {
+                return false;
+            }
+            keys[k] = static_cast<uint32_t>(key);
+            starts[k] = entries.size();
+            entries.push_back(static_cast<uint32_t>(block));
+            uint8_t width = count > 1 ? reader.read_bits(5) : 0;
+            for (uint32_t i = 1; i < count; ++i) {
+                block += 1 + static_cast<uint64_t>(reader.read_bits(width));
+                if (block >= block_count) {
+                    return false;
+                }
+                entries.push_back(static_cast<uint32_t>(block));
+            }
+        }
+        starts[key_count] = entries.size();
+        return std::is_sorted(keys.begin(), keys.end());
+    }
+
+    static uint8_t bits_needed(uint32_t value) {
+        uint8_t bits = 0;
+        while (value >> bits) {
+            bits++;
+        }
+        return bits;
+    }
+
+    static void write_64(BitWriter& writer, uint64_t value) {
+        writer.write_bits(static_cast<uint32_t>(value >> 32), 32);
+        writer.write_bits(static_cast<uint32_t>(value), 32);
+    }
+
+    static uint64_t read_64(BitReader& reader) {
+        uint64_t high = reader.read_bits(32);
+        return high << 32 | reader.read_bits(32);
+    }
+};
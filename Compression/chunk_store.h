@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "flat_hash_map.h"
+
+// Deduplication across documents. A document's word IDs are cut into chunks
+// where a rolling hash of the last few IDs hits a pattern, so the cuts
+// depend on the text around them and not on where it sits: an edition that
+// adds a preface still cuts its chapters in the same places. Each chunk is
+// keyed by a 128-bit hash of its content, and the store keeps every chunk
+// once, in the order first seen. A key that is already there is checked
+// against the stored content too, so a hash collision only costs a compare.
+class ChunkStore {
+public:
+    // Chunks are at least MIN_TOKENS long unless the document ends, at most
+    // MAX_TOKENS, and past MIN_TOKENS end with a chance of one in
+    // BOUNDARY_MASK + 1 per token
+    static constexpr size_t MIN_TOKENS = 32;
+    static constexpr size_t MAX_TOKENS = 1024;
+    static constexpr uint64_t BOUNDARY_MASK = 127;
+
+    // Bits of the rolling hash that the cut tests. Bit k of the hash only
+    // depends on the last k + 1 IDs, so these see a window of about 24.
+    static constexpr int BOUNDARY_SHIFT = 16;
+
+    struct Key {
+        uint64_t low = 0;
+        uint64_t high = 0;
+
+        bool operator==(const Key& other) const {
+            return low == other.low && high == other.high;
+        }
+    };
+
+    // Where the chunks of a document of these word IDs end, each one past
+    // its last token
+    static std::vector<size_t> chunk_ends(const std::vector<uint32_t>& ids) {
+        std::vector<size_t> ends;
+        uint64_t hash = 0;
+        size_t start = 0;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            hash = (hash << 1) + FlatHash::mix(ids[i] + 0x9E3779B97F4A7C15ULL);
+            size_t length = i + 1 - start;
+            if ((length >= MIN_TOKENS && ((hash >> BOUNDARY_SHIFT) & BOUNDARY_MASK) == 0) ||
+                length == MAX_TOKENS) {
+                ends.push_back(i + 1);
+                start = i + 1;
+            }
+        }
+        if (start < ids.size()) {
+            ends.push_back(ids.size());
+        }
+        return ends;
+    }
+
+    // MurmurHash3 (x64, 128 bits) of a chunk's content
+    static Key key_of(std::string_view content) {
+        const uint64_t c1 = 0x87C37B91114253D5ULL;
+        const uint64_t c2 = 0x4CF5AD432745937FULL;
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(content.data());
+        size_t size = content.size();
+        uint64_t h1 = 0, h2 = 0;
+
+        size_t blocks = size / 16;
+        for (size_t i = 0; i < blocks; ++i) {
+            uint64_t k1, k2;
+            memcpy(&k1, data + i * 16, 8);
+            memcpy(&k2, data + i * 16 + 8, 8);
+            h1 ^= rotl(k1 * c1, 31) * c2;
+            h1 = (rotl(h1, 27) + h2) * 5 + 0x52DCE729;
+            h2 ^= rotl(k2 * c2, 33) * c1;
+            h2 = (rotl(h2, 31) + h1) * 5 + 0x38495AB5;
+        }
+
+        const unsigned char* tail = data + blocks * 16;
+        uint64_t k1 = 0, k2 = 0;
+        for (size_t i = size & 15; i > 8; --i) {
+            k2 |= static_cast<uint64_t>(tail[i - 1]) << ((i - 9) * 8);
+        }
+        for (size_t i = std::min<size_t>(size & 15, 8); i > 0; --i) {
+            k1 |= static_cast<uint64_t>(tail[i - 1]) << ((i - 1) * 8);
+        }
+        h2 ^= rotl(k2 * c2, 33) * c1;
+        h1 ^= rotl(k1 * c1, 31) * c2;
+
+        h1 ^= size;
+        h2 ^= size;
+        h1 += h2;
+        h2 += h1;
+        h1 = fmix(h1);
+        h2 = fmix(h2);
+        h1 += h2;
+        h2 += h1;
+        return {h1, h2};
+    }
+
+    // ID of the chunk with this content, stored first if it is new
+    uint32_t add(const Key& key, std::string_view content, bool& added) {
+        for (auto it = index.find(key); it != index.end(); it = index.find(next_key(it->first))) {
+            if (contents[it->second] == content) {
+                added = false;
+                return it->second;
+            }
+        }
+        // A different chunk under the same key goes under the next free one
+        Key free_key = key;
+        while (index.find(free_key) != index.end()) {
+            free_key = next_key(free_key);
+        }
+        uint32_t id = static_cast<uint32_t>(contents.size());
+        index.emplace(free_key, id);
+        contents.emplace_back(content);
+        added = true;
+        return id;
+    }
+
+    size_t size() const {
+        return contents.size();
+    }
+
+private:
+    struct KeyHash {
+        uint64_t operator()(const Key& key) const {
+            return key.low;
+        }
+    };
+
+    FlatHashMap<Key, uint32_t, KeyHash> index;
+    std::vector<std::string> contents;
+
+    static Key next_key(const Key& key) {
+        return {key.low, key.high + 1};
+    }
+
+    static uint64_t rotl(uint64_t value, int bits) {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    static uint64_t fmix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+};
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "stage_timer.h"
+
+// Token classes of the phrase-mode stream as counted in the statistics
+enum StatsTokenClass {
+    STATS_MAIN_WORD,
+    STATS_LOCAL_WORD,
+    STATS_PHRASE,
+    STATS_FILLER,  // Wildcard filler written after its phrase
+    STATS_MATCH,
+    STATS_CLASS_COUNT
+};
+
+// Counters of one compress or decompress run. They are cheap enough to stay
+// on in production; --stats writes them as a single JSON object.
+struct CompressionStats {
+    static constexpr const char* CLASS_NAMES[STATS_CLASS_COUNT] = {
+        "main_word", "local_word", "phrase", "filler", "match"
+    };
+
+    uint64_t tokens[STATS_CLASS_COUNT] = {};
+    uint64_t bits[STATS_CLASS_COUNT] = {};  // Encoder side only
+    uint64_t total_bits = 0;                // Whole file, headers and tables included
+    uint64_t lossless_bits = 0;             // Case and whitespace forms in lossless mode
+    uint64_t numbers = 0;                   // Number tokens, matched ones included
+    uint64_t number_bits = 0;               // Their values
+    uint64_t index_bits = 0;                // Block index file, with --index
+    uint64_t blocks = 0;                    // Search: blocks in the archives searched
+    uint64_t blocks_read = 0;               // Search: blocks whose streams were decoded
+    uint64_t chunks = 0;                    // With --dedup: distinct chunks stored
+    uint64_t chunk_refs = 0;                // Chunks of all members, repeats included
+    uint64_t chunk_tokens = 0;              // Tokens of all members
+    uint64_t unique_chunk_tokens = 0;       // Tokens of the chunks stored
+
+    uint64_t trie_lookups = 0;        // Positions the phrase trie was searched at
+    uint64_t trie_nodes_visited = 0;
+    uint64_t phrases_mined = 0;
+    uint64_t phrases_kept = 0;
+    uint64_t trie_phrases_built = 0;  // Phrases inserted over all trie rebuilds
+
+    // Histograms. Match lengths are bucketed by floor(log2(length)); chain
+    // probes count LZ candidates tried per position; dictionary probes count
+    // main dictionary keys by the hash table groups their lookup reads.
+    std::vector<uint64_t> match_lengths;
+    std::vector<uint64_t> chain_probes;
+    std::vector<uint64_t> dictionary_probes;
+
+    StageTimer timer;
+
+    void reset() {
+        *this = CompressionStats();
+    }
+
+    void count_token(StatsTokenClass token_class, uint64_t bit_count = 0) {
+        tokens[token_class]++;
+        bits[token_class] += bit_count;
+    }
+
+    void count_match_length(uint32_t length) {
+        size_t bucket = 0;
+        while ((length >> (bucket + 1)) != 0) {
+            bucket++;
+        }
+        add(match_lengths, bucket);
+    }
+
+    static void add(std::vector<uint64_t>& histogram, size_t index, uint64_t count = 1) {
+        if (index >= histogram.size()) {
+            histogram.resize(index + 1, 0);
+        }
+        histogram[index] += count;
+    }
+
+    void write_json(std::ostream& out, const std::string& operation) const {
+        auto write_histogram = [&](const std::vector<uint64_t>& histogram) {
+            out << "[";
+            for (size_t i = 0; i < histogram.size(); ++i) {
+                out << (i > 0 ? "," : "") << histogram[i];
+            }
+            out << "]";
+        };
+
+        // Allocations of the trie rebuilds are all per-phrase costs
+        StageTimer::Stage trie_build = timer.find("trie_build");
+        double per_phrase = trie_phrases_built > 0 ? 1.0 / trie_phrases_built : 0.0;
+        double dedup_ratio = unique_chunk_tokens > 0 ? static_cast<double>(chunk_tokens) / unique_chunk_tokens : 1.0;
+
+        uint64_t allocations = 0, allocated_bytes = 0;
+        for (const auto& stage : timer.get_stages()) {
+            allocations += stage.allocations;
+            allocated_bytes += stage.allocated_bytes;
+        }
+
+        out << std::fixed << std::setprecision(3);
+        out << "{\"operation\":\"" << operation << "\",\"tokens\":{";
+        for (int c = 0; c < STATS_CLASS_COUNT; ++c) {
+            out << (c > 0 ? "," : "") << "\"" << CLASS_NAMES[c] << "\":" << tokens[c];
+        }
+        out << "},\"bits\":{";
+        for (int c = 0; c < STATS_CLASS_COUNT; ++c) {
+            out << (c > 0 ? "," : "") << "\"" << CLASS_NAMES[c] << "\":" << bits[c];
+        }
+        out << "},\"total_bits\":" << total_bits
+            << ",\"lossless_bits\":" << lossless_bits
+            << ",\"numbers\":" << numbers
+            << ",\"number_bits\":" << number_bits
+            << ",\"index_bits\":" << index_bits
+            << ",\"blocks\":" << blocks
+            << ",\"blocks_read\":" << blocks_read
+            << ",\"chunks\":" << chunks
+            << ",\"chunk_refs\":" << chunk_refs
+            << ",\"chunk_tokens\":" << chunk_tokens
+            << ",\"unique_chunk_tokens\":" << unique_chunk_tokens
+            << ",\"dedup_ratio\":" << dedup_ratio
+            << ",\"trie_lookups\":" << trie_lookups
+            << ",\"trie_nodes_visited\":" << trie_nodes_visited
+            << ",\"phrases_mined\":" << phrases_mined
+            << ",\"phrases_kept\":" << phrases_kept
+            << ",\"trie_allocations_per_phrase\":" << trie_build.allocations * per_phrase
+            << ",\"trie_bytes_per_phrase\":" << trie_build.allocated_bytes * per_phrase
+            << ",\"match_length_log2_histogram\":";
+        write_histogram(match_lengths);
+        out << ",\"chain_probe_histogram\":";
+        write_histogram(chain_probes);
+        out << ",\"dictionary_probe_histogram\":";
+        write_histogram(dictionary_probes);
+        out << ",\"allocations\":" << allocations
+            << ",\"allocated_bytes\":" << allocated_bytes
+            << ",\"peak_rss_kb\":" << peak_rss_kb()
+            << ",\"stages\":{";
+        const auto& stages = timer.get_stages();
+        for (size_t i = 0; i < stages.size(); ++i) {
+            out << (i > 0 ? "," : "") << "\"" << stages[i].name << "\":{\"ns\":" << stages[i].nanoseconds
+                << ",\"allocations\":" << stages[i].allocations
+                << ",\"allocated_bytes\":" << stages[i].allocated_bytes << "}";
+        }
+        out << "}}" << std::endl;
+    }
+};
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Synthetic text for scale testing. The generator learns word frequencies,
+// frequent phrases and the rate of once-seen words from sample text, then
+// streams any amount of text built from three kinds of draws:
+//   - words of the learned vocabulary, Zipf distributed by frequency rank
+//     with the exponent fitted to the sample
+//   - learned phrases planted whole, at phrase_rate
+//   - made-up words at rare_word_rate, which land in the local dictionary
+class CorpusGenerator {
+public:
+    static constexpr size_t MIN_PHRASE_LENGTH = 3;
+    static constexpr size_t MAX_PHRASE_LENGTH = 6;
+    static constexpr size_t MAX_PHRASES = 2000;
+    static constexpr uint32_t MIN_PHRASE_COUNT = 3;
+
+private:
+    // Sample statistics, accumulated over every learn() call
+    std::unordered_map<std::string, uint64_t> word_counts;
+    std::unordered_map<std::string, uint64_t> phrase_counts;
+    uint64_t token_count = 0;
+
+    // Model built by finalize()
+    std::vector<std::string> vocabulary;  // Most frequent first
+    std::vector<std::string> phrases;
+    std::vector<uint64_t> phrase_weights;
+    double zipf_exponent = 1.0;
+    double rare_word_rate = 0.0;
+    double phrase_rate = 0.0;
+
+    // Same token rules as the compressor: lowercase words, single punctuation
+    static std::vector<std::string> tokenize(const std::string& text) {
+        std::vector<std::string> tokens;
+        std::string current;
+        for (char c : text) {
+            if (isalnum(static_cast<unsigned char>(c)) || c == '\'') {
+                current += tolower(static_cast<unsigned char>(c));
+            } else {
+                if (!current.empty()) {
+                    tokens.push_back(current);
+                    current.clear();
+                }
+                if (!isspace(static_cast<unsigned char>(c))) {
+                    tokens.push_back(std::string(1, c));
+                }
+            }
+        }
+        if (!current.empty()) {
+            tokens.push_back(current);
+        }
+        return tokens;
+    }
+
+    template <typename Rng>
+    static std::string make_rare_word(Rng& rng) {
+        std::uniform_int_distribution<int> length(4, 12);
+        std::uniform_int_distribution<int> letter('a', 'z');
+        std::string word(length(rng), 'a');
+        for (auto& c : word) {
+            c = static_cast<char>(letter(rng));
+        }
+        return word;
+    }
+
+public:
+    // Count words and n-grams of one sample. N-grams are counted by hash so
+    // that only repeated ones are ever turned into strings.
+    void learn(const std::string& text) {
+        std::vector<std::string> tokens = tokenize(text);
+        token_count += tokens.size();
+
+        std::vector<uint64_t> token_hashes;
+        token_hashes.reserve(tokens.size());
+        for (const auto& token : tokens) {
+            word_counts[token]++;
+            token_hashes.push_back(std::hash<std::string>()(token));
+        }
+
+        struct NgramCount {
+            uint32_t count = 0;
+            size_t first = 0;
+        };
+
+        for (size_t length = MIN_PHRASE_LENGTH; length <= MAX_PHRASE_LENGTH; ++length) {
+            std::unordered_map<uint64_t, NgramCount> counts;
+            for (size_t i = 0; i + length <= tokens.size(); ++i) {
+                uint64_t h = length;
+                for (size_t j = 0; j < length; ++j) {
+                    h = (h ^ token_hashes[i + j]) * 0x100000001B3ULL;
+                }
+                NgramCount& entry = counts[h];
+                if (entry.count++ == 0) {
+                    entry.first = i;
+                }
+            }
+
+            for (const auto& entry : counts) {
+                if (entry.second.count < MIN_PHRASE_COUNT) {
+                    continue;
+                }
+                std::string phrase = tokens[entry.second.first];
+                for (size_t j = 1; j < length; ++j) {
+                    phrase += ' ';
+                    phrase += tokens[entry.second.first + j];
+                }
+                phrase_counts[phrase] += entry.second.count;
+            }
+        }
+    }
+
+    // Build the model from everything learned. Afterwards the setters can
+    // override the learned rates.
+    bool finalize() {
+        if (word_counts.empty()) {
+            return false;
+        }
+
+        // Rank order; ties by word so the model does not depend on hash order
+        std::vector<std::pair<uint64_t, std::string>> ranked;
+        uint64_t once_seen = 0;
+        for (const auto& entry : word_counts) {
+            ranked.push_back({entry.second, entry.first});
+            if (entry.second == 1) {
+                once_seen++;
+            }
+        }
+        sort(ranked.begin(), ranked.end(), [](const std::pair<uint64_t, std::string>& a,
+                                              const std::pair<uint64_t, std::string>& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+
+        vocabulary.clear();
+        for (const auto& entry : ranked) {
+            vocabulary.push_back(entry.second);
+        }
+
+        // Least-squares slope of log frequency over log rank, on the top ranks
+        size_t fit_ranks = std::min<size_t>(ranked.size(), 1000);
+        double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+        for (size_t r = 0; r < fit_ranks; ++r) {
+            double x = std::log(static_cast<double>(r + 1));
+            double y = std::log(static_cast<double>(ranked[r].first));
+            sum_x += x;
+            sum_y += y;
+            sum_xx += x * x;
+            sum_xy += x * y;
+        }
+        double denominator = fit_ranks * sum_xx - sum_x * sum_x;
+        zipf_exponent = denominator > 0 ? -(fit_ranks * sum_xy - sum_x * sum_y) / denominator : 1.0;
+        if (zipf_exponent <= 0) {
+            zipf_exponent = 1.0;
+        }
+
+        // Words seen once in the sample stand in for words never seen before
+        rare_word_rate = static_cast<double>(once_seen) / token_count;
+
+        // Keep the phrases that cover the most tokens
+        std::vector<std::pair<uint64_t, std::string>> ranked_phrases;
+        for (const auto& entry : phrase_counts) {
+            size_t length = std::count(entry.first.begin(), entry.first.end(), ' ') + 1;
+            ranked_phrases.push_back({entry.second * length, entry.first});
+        }
+        sort(ranked_phrases.begin(), ranked_phrases.end(), [](const std::pair<uint64_t, std::string>& a,
+                                                              const std::pair<uint64_t, std::string>& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+        if (ranked_phrases.size() > MAX_PHRASES) {
+            ranked_phrases.resize(MAX_PHRASES);
+        }
+
+        phrases.clear();
+        phrase_weights.clear();
+        uint64_t covered_tokens = 0;
+        uint64_t occurrences = 0;
+        for (const auto& entry : ranked_phrases) {
+            phrases.push_back(entry.second);
+            phrase_weights.push_back(phrase_counts[entry.second]);
+            covered_tokens += entry.first;
+            occurrences += phrase_counts[entry.second];
+        }
+
+        // Overlapping n-grams are counted more than once, so the coverage is
+        // only an estimate; cap it and turn it into a per-draw probability
+        double coverage = std::min(0.3, static_cast<double>(covered_tokens) / token_count);
+        double average_length = occurrences == 0 ? 1.0 : static_cast<double>(covered_tokens) / occurrences;
+        phrase_rate = coverage / (average_length - coverage * (average_length - 1));
+
+        return true;
+    }
+
+    void set_zipf_exponent(double exponent) {
+        zipf_exponent = exponent;
+    }
+
+    void set_rare_word_rate(double rate) {
+        rare_word_rate = rate;
+    }
+
+    void set_phrase_rate(double rate) {
+        phrase_rate = rate;
+    }
+
+    double get_zipf_exponent() const {
+        return zipf_exponent;
+    }
+
+    double get_rare_word_rate() const {
+        return rare_word_rate;
+    }
+
+    double get_phrase_rate() const {
+        return phrase_rate;
+    }
+
+    size_t vocabulary_size() const {
+        return vocabulary.size();
+    }
+
+    size_t phrase_count() const {
+        return phrases.size();
+    }
+
+    // Stream at least bytes of text to out, in 1 MB writes, 16 tokens a line
+    bool generate(std::ostream& out, uint64_t bytes, uint64_t seed) const {
+        if (vocabulary.empty()) {
+            return false;
+        }
+
+        std::mt19937_64 rng(seed);
+        std::vector<double> word_weights(vocabulary.size());
+        for (size_t r = 0; r < vocabulary.size(); ++r) {
+            word_weights[r] = std::pow(static_cast<double>(r + 1), -zipf_exponent);
+        }
+        std::discrete_distribution<size_t> word_draw(word_weights.begin(), word_weights.end());
+        std::discrete_distribution<size_t> phrase_draw(phrase_weights.begin(), phrase_weights.end());
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+        const size_t FLUSH_SIZE = 1 << 20;
+        const size_t TOKENS_PER_LINE = 16;
+        std::string buffer;
+        uint64_t written = 0;
+        size_t line_tokens = 0;
+
+        while (written + buffer.size() < bytes) {
+            double u = unit(rng);
+            if (u < phrase_rate && !phrases.empty()) {
+                buffer += phrases[phrase_draw(rng)];
+            } else if (u < phrase_rate + rare_word_rate) {
+                buffer += make_rare_word(rng);
+            } else {
+                buffer += vocabulary[word_draw(rng)];
+            }
+
+            if (++line_tokens == TOKENS_PER_LINE) {
+                buffer += '\n';
+                line_tokens = 0;
+            } else {
+                buffer += ' ';
+            }
+
+            if (buffer.size() >= FLUSH_SIZE) {
+                out.write(buffer.data(), buffer.size());
+                written += buffer.size();
+                buffer.clear();
+            }
+        }
+
+        out.write(buffer.data(), buffer.size());
+        return out.good();
+    }
+};
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Hash for FlatHashMap. Every string type hashes through string_view, so a
+// map keyed by std::string can be searched with a string_view and the other
+// way round, without building a key string.
+struct FlatHash {
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    uint64_t operator()(std::string_view key) const {
+        return mix(std::hash<std::string_view>()(key));
+    }
+
+    uint64_t operator()(uint64_t key) const {
+        return mix(key);
+    }
+};
+
+// Open-addressing hash map in the SwissTable layout. Entries sit in one flat
+// array next to a control byte each: 7 bits of the entry's hash when the slot
+// is full, EMPTY when it is free. A lookup compares a whole group of 16
+// control bytes with one SSE2 instruction and only touches the entries whose
+// bits match. Each entry also keeps its full hash, so growing never hashes a
+// key again and a mismatch is nearly always rejected without comparing keys.
+//
+// Lookups are heterogeneous: any type Hash and Equal accept will do, so a
+// string_view finds a std::string key. The map only grows; entries are never
+// erased one by one. With a string_view Key the map does not own the text,
+// so keys must be inserted from storage that outlives the map.
+//
+// Against std::unordered_map<string, uint32_t>, best of 5 runs (g++ -O2, one
+// core), on the 475k distinct words and 2-5 word n-grams of
+// prideandprejudice.txt; the string_view column keys the flat map by text
+// the caller keeps alive, as the miners do. Benchmark mode reruns these
+// with `b --microbench FILE...`:
+//
+//                                   unordered_map   FlatHashMap   string_view keys
+//   insert every key                   277 ms          143 ms          71 ms
+//   find every key, 5 times            405 ms          335 ms         227 ms
+//   find absent keys, 5 times          456 ms          117 ms          90 ms
+//   count 674k n-gram occurrences      241 ms          163 ms          80 ms
+//   count 169k words                   5.7 ms          4.4 ms         4.3 ms
+template <typename Key, typename Value, typename Hash = FlatHash,
+          typename Equal = std::equal_to<>, typename Allocator = std::allocator<std::pair<Key, Value>>>
+class FlatHashMap {
+public:
+    typedef std::pair<Key, Value> value_type;
+    static constexpr size_t GROUP_WIDTH = 16;
+
+private:
+    static constexpr int8_t EMPTY = -128;
+    static constexpr int8_t PADDING = -1;  // Control bytes past the end of a small table
+
+    struct Slot {
+        uint64_t hash = 0;
+        value_type entry;
+    };
+
+    typedef std::allocator_traits<Allocator> Traits;
+    typedef typename Traits::template rebind_alloc<int8_t> ControlAllocator;
+    typedef typename Traits::template rebind_alloc<Slot> SlotAllocator;
+
+    // One control byte per slot, padded to a whole number of groups; a table
+    // smaller than a group pads its only group with bytes that match nothing
+    std::vector<int8_t, ControlAllocator> control;
+    std::vector<Slot, SlotAllocator> slots;
+    size_t entry_count = 0;
+
+    static int8_t hash_tag(uint64_t hash) {
+        return static_cast<int8_t>(hash & 0x7F);
+    }
+
+    // Bit i is set where control byte i of the group equals byte
+    static uint32_t match_byte(const int8_t* group, int8_t byte) {
+#ifdef __SSE2__
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(byte))));
+#else
+        uint32_t bits = 0;
+        for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+            bits |= static_cast<uint32_t>(group[i] == byte) << i;
+        }
+        return bits;
+#endif
+    }
+
+    // Groups are probed in triangular steps, which visits every group once
+    // when the group count is a power of two
+    template <typename Visit>
+    size_t probe(uint64_t hash, Visit visit) const {
+        size_t group_mask = control.size() / GROUP_WIDTH - 1;
+        size_t group = (hash >> 7) & group_mask;
+        for (size_t step = 1;; ++step) {
+            size_t index = visit(group * GROUP_WIDTH);
+            if (index != SIZE_MAX) {
+                return index;
+            }
+            group = (group + step) & group_mask;
+        }
+    }
+
+    // Slot of key, or SIZE_MAX; every group up to the first with a free slot
+    // is searched, since an insert would have used that free slot
+    template <typename K>
+    size_t find_index(const K& key, uint64_t hash) const {
+        if (entry_count == 0) {
+            return SIZE_MAX;
+        }
+        int8_t tag = hash_tag(hash);
+        size_t found = SIZE_MAX;
+        probe(hash, [&](size_t first) {
+            const int8_t* group = &control[first];
+            for (uint32_t bits = match_byte(group, tag); bits != 0; bits &= bits - 1) {
+                size_t index = first + __builtin_ctz(bits);
+                if (slots[index].hash == hash && Equal()(slots[index].entry.first, key)) {
+                    found = index;
+                    return index;
+                }
+            }
+            return match_byte(group, EMPTY) != 0 ? first : SIZE_MAX;
+        });
+        return found;
+    }
+
+    // First free slot on the probe sequence of hash
+    size_t free_index(uint64_t hash) const {
+        return probe(hash, [&](size_t first) {
+            uint32_t bits = match_byte(&control[first], EMPTY);
+            return bits != 0 ? first + __builtin_ctz(bits) : SIZE_MAX;
+        });
+    }
+
+    // Full tables keep at least one slot in eight free
+    static size_t capacity_for(size_t count) {
+        size_t capacity = 2;
+        while (capacity * 7 / 8 < count) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<int8_t, ControlAllocator> old_control(std::move(control), control.get_allocator());
+        std::vector<Slot, SlotAllocator> old_slots(std::move(slots), slots.get_allocator());
+
+        control.assign(std::max(capacity, GROUP_WIDTH), PADDING);
+        std::fill(control.begin(), control.begin() + capacity, EMPTY);
+        slots.clear();
+        slots.resize(capacity);
+
+        for (size_t i = 0; i < old_slots.size(); ++i) {
+            if (old_control[i] >= 0) {
+                size_t index = free_index(old_slots[i].hash);
+                control[index] = old_control[i];
+                slots[index] = std::move(old_slots[i]);
+            }
+        }
+    }
+
+    template <typename K, typename... Args>
+    std::pair<size_t, bool> insert_index(K&& key, Args&&... value_args) {
+        uint64_t hash = Hash()(key);
+        size_t index = find_index(key, hash);
+        if (index != SIZE_MAX) {
+            return {index, false};
+        }
+        if (slots.size() * 7 / 8 < entry_count + 1) {
+            rehash(capacity_for(entry_count + 1));
+        }
+        index = free_index(hash);
+        control[index] = hash_tag(hash);
+        slots[index].hash = hash;
+        slots[index].entry.first = Key(std::forward<K>(key));
+        slots[index].entry.second = Value(std::forward<Args>(value_args)...);
+        entry_count++;
+        return {index, true};
+    }
+
+public:
+    template <bool Const>
+    class Iterator {
+    private:
+        typedef std::conditional_t<Const, const FlatHashMap, FlatHashMap> Map;
+        typedef std::conditional_t<Const, const value_type, value_type> Entry;
+
+        Map* map = nullptr;
+        size_t index = 0;
+
+    public:
+        Iterator() = default;
+
+        // Starts at index, or the first full slot after it
+        Iterator(Map* map, size_t index) : map(map), index(index) {
+            while (this->index < map->slots.size() && map->control[this->index] < 0) {
+                this->index++;
+            }
+        }
+
+        template <bool C = Const, typename = std::enable_if_t<!C>>
+        operator Iterator<true>() const {
+            return Iterator<true>(map, index);
+        }
+
+        Entry& operator*() const {
+            return map->slots[index].entry;
+        }
+
+        Entry* operator->() const {
+            return &map->slots[index].entry;
+        }
+
+        Iterator& operator++() {
+            *this = Iterator(map, index + 1);
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const {
+            return index == other.index;
+        }
+
+        bool operator!=(const Iterator& other) const {
+            return index != other.index;
+        }
+    };
+
+    typedef Iterator<false> iterator;
+    typedef Iterator<true> const_iterator;
+
+    FlatHashMap() = default;
+
+    explicit FlatHashMap(const Allocator& allocator)
+        : control(ControlAllocator(allocator)), slots(SlotAllocator(allocator)) {}
+
+    size_t size() const {
+        return entry_count;
+    }
+
+    bool empty() const {
+        return entry_count == 0;
+    }
+
+    // Make room for count entries without growing again
+    void reserve(size_t count) {
+        if (slots.size() * 7 / 8 < count) {
+            rehash(capacity_for(count));
+        }
+    }
+
+    // Drop every entry but keep the table
+    void clear() {
+        for (size_t i = 0; i < slots.size(); ++i) {
+            if (control[i] >= 0) {
+                control[i] = EMPTY;
+                slots[i].entry = value_type();
+            }
+        }
+        entry_count = 0;
+    }
+
+    iterator begin() {
+        return iterator(this, 0);
+    }
+
+    iterator end() {
+        return iterator(this, slots.size());
+    }
+
+    const_iterator begin() const {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, slots.size());
+    }
+
+    template <typename K>
+    iterator find(const K& key) {
+        size_t index = find_index(key, Hash()(key));
+        return index != SIZE_MAX ? iterator(this, index) : end();
+    }
+
+    template <typename K>
+    const_iterator find(const K& key) const {
+        size_t index = find_index(key, Hash()(key));
+        return index != SIZE_MAX ? const_iterator(this, index) : end();
+    }
+
+    template <typename K>
+    size_t count(const K& key) const {
+        return find_index(key, Hash()(key)) != SIZE_MAX ? 1 : 0;
+    }
+
+    // Insert key with a value built from value_args unless it is present
+    template <typename K, typename... Args>
+    std::pair<iterator, bool> emplace(K&& key, Args&&... value_args) {
+        auto result = insert_index(std::forward<K>(key), std::forward<Args>(value_args)...);
+        return {iterator(this, result.first), result.second};
+    }
+
+    template <typename K>
+    Value& operator[](K&& key) {
+        return slots[insert_index(std::forward<K>(key)).first].entry.second;
+    }
+
+    // Control groups a lookup of key reads, hit or miss
+    template <typename K>
+    size_t probe_length(const K& key) const {
+        if (slots.empty()) {
+            return 0;
+        }
+        uint64_t hash = Hash()(key);
+        size_t index = find_index(key, hash);
+        size_t groups = 0;
+        probe(hash, [&](size_t first) {
+            groups++;
+            bool done = index != SIZE_MAX ? (index >= first && index < first + GROUP_WIDTH)
+                                          : match_byte(&control[first], EMPTY) != 0;
+            return done ? first : SIZE_MAX;
+        });
+        return groups;
+    }
+};
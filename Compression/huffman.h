@@ -0,0 +1,248 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "bitio.h"
+
+// Canonical, length-limited Huffman code over a sparse uint32 alphabet.
+// Only symbols that actually occur are stored in the table, so word codes
+// and nonterminal IDs can be coded directly without remapping.
+class HuffmanCoder {
+public:
+    static constexpr uint8_t MAX_CODE_LENGTH = 24;
+
+    // Codes up to this long decode with one table lookup
+    static constexpr uint8_t LOOKUP_BITS = 10;
+
+private:
+    struct Code {
+        uint32_t bits = 0;
+        uint8_t length = 0;
+    };
+
+    std::unordered_map<uint32_t, Code> encode_table;
+
+    // Symbol and code length for every LOOKUP_BITS-bit prefix; length 0
+    // where the code is longer
+    struct LookupEntry {
+        uint32_t symbol = 0;
+        uint8_t length = 0;
+    };
+    std::vector<LookupEntry> lookup;
+
+    // Canonical decoding tables, indexed by code length
+    std::vector<uint32_t> sorted_symbols;
+    uint32_t first_code[MAX_CODE_LENGTH + 1] = {};
+    uint32_t first_index[MAX_CODE_LENGTH + 1] = {};
+    uint32_t length_count[MAX_CODE_LENGTH + 1] = {};
+
+    // Assign canonical codes from (symbol, length) pairs
+    void assign_codes(std::vector<std::pair<uint8_t, uint32_t>> lengths) {
+        sort(lengths.begin(), lengths.end());
+
+        encode_table.clear();
+        sorted_symbols.clear();
+        std::fill(std::begin(length_count), std::end(length_count), 0);
+
+        for (const auto& entry : lengths) {
+            length_count[entry.first]++;
+            sorted_symbols.push_back(entry.second);
+        }
+
+        uint32_t code = 0;
+        uint32_t index = 0;
+        for (uint8_t len = 1; len <= MAX_CODE_LENGTH; ++len) {
+            code = (code + length_count[len - 1]) << 1;
+            first_code[len] = code;
+            first_index[len] = index;
+            index += length_count[len];
+        }
+
+        // Codes within one length are consecutive in sorted order
+        uint32_t next_code[MAX_CODE_LENGTH + 1];
+        std::copy(std::begin(first_code), std::end(first_code), std::begin(next_code));
+        lookup.assign(1u << LOOKUP_BITS, LookupEntry());
+        for (const auto& entry : lengths) {
+            Code c;
+            c.length = entry.first;
+            c.bits = next_code[entry.first]++;
+            encode_table[entry.second] = c;
+
+            if (c.length <= LOOKUP_BITS) {
+                uint32_t shift = LOOKUP_BITS - c.length;
+                for (uint32_t prefix = c.bits << shift; prefix < (c.bits + 1) << shift; ++prefix) {
+                    lookup[prefix] = {entry.second, c.length};
+                }
+            }
+        }
+    }
+
+public:
+    void build(const std::vector<uint32_t>& symbols) {
+        std::unordered_map<uint32_t, uint64_t> frequencies;
+        for (uint32_t s : symbols) {
+            frequencies[s]++;
+        }
+        build_from_frequencies(frequencies);
+    }
+
+    void build_from_frequencies(const std::unordered_map<uint32_t, uint64_t>& frequencies) {
+        std::vector<std::pair<uint32_t, uint64_t>> symbols(frequencies.begin(), frequencies.end());
+        sort(symbols.begin(), symbols.end());
+
+        std::vector<std::pair<uint8_t, uint32_t>> lengths;
+        if (symbols.size() == 1) {
+            lengths.push_back({1, symbols[0].first});
+            assign_codes(lengths);
+            return;
+        }
+
+        std::vector<uint64_t> weights;
+        for (const auto& s : symbols) {
+            weights.push_back(std::max<uint64_t>(s.second, 1));
+        }
+
+        // Halve the weights until the tree fits into MAX_CODE_LENGTH
+        while (true) {
+            std::vector<uint8_t> depth = code_lengths(weights);
+            uint8_t max_depth = symbols.empty() ? 0 : *std::max_element(depth.begin(), depth.end());
+
+            if (max_depth <= MAX_CODE_LENGTH) {
+                for (size_t i = 0; i < symbols.size(); ++i) {
+                    lengths.push_back({depth[i], symbols[i].first});
+                }
+                break;
+            }
+
+            for (auto& w : weights) {
+                w = (w >> 1) | 1;
+            }
+        }
+
+        assign_codes(lengths);
+    }
+
+    // Plain Huffman tree construction; returns the depth of every leaf
+    static std::vector<uint8_t> code_lengths(const std::vector<uint64_t>& weights) {
+        size_t n = weights.size();
+        std::vector<int32_t> parent(2 * n, -1);
+
+        typedef std::pair<uint64_t, int32_t> Node;
+        std::priority_queue<Node, std::vector<Node>, std::greater<Node>> heap;
+        for (size_t i = 0; i < n; ++i) {
+            heap.push({weights[i], static_cast<int32_t>(i)});
+        }
+
+        int32_t next_node = n;
+        while (heap.size() > 1) {
+            Node a = heap.top(); heap.pop();
+            Node b = heap.top(); heap.pop();
+            parent[a.second] = next_node;
+            parent[b.second] = next_node;
+            heap.push({a.first + b.first, next_node});
+            next_node++;
+        }
+
+        // Parents always have higher indices, so walk from the root down
+        std::vector<uint32_t> node_depth(2 * n, 0);
+        for (int32_t i = next_node - 2; i >= 0; --i) {
+            node_depth[i] = node_depth[parent[i]] + 1;
+        }
+
+        std::vector<uint8_t> depth(n);
+        for (size_t i = 0; i < n; ++i) {
+            depth[i] = static_cast<uint8_t>(std::min<uint32_t>(node_depth[i], 255));
+        }
+        return depth;
+    }
+
+    size_t symbol_count() const {
+        return sorted_symbols.size();
+    }
+
+    // Code length of a symbol, 0 if the symbol is not in the table
+    uint8_t code_length(uint32_t symbol) const {
+        auto it = encode_table.find(symbol);
+        return it == encode_table.end() ? 0 : it->second.length;
+    }
+
+    // Table layout: symbol count, then ascending symbols as gamma-coded gaps
+    // each followed by a 5-bit code length
+    void write_table(BitWriter& writer) const {
+        std::vector<std::pair<uint32_t, uint8_t>> entries;
+        for (const auto& entry : encode_table) {
+            entries.push_back({entry.first, entry.second.length});
+        }
+        sort(entries.begin(), entries.end());
+
+        writer.write_gamma(entries.size() + 1);
+        uint32_t previous = 0;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            uint32_t gap = i == 0 ? entries[i].first : entries[i].first - previous - 1;
+            writer.write_gamma(gap + 1);
+            writer.write_bits(entries[i].second, 5);
+            previous = entries[i].first;
+        }
+    }
+
+    bool read_table(BitReader& reader) {
+        uint32_t count = reader.read_gamma() - 1;
+
+        std::vector<std::pair<uint8_t, uint32_t>> lengths;
+        uint32_t previous = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t gap = reader.read_gamma() - 1;
+            uint32_t symbol = i == 0 ? gap : previous + gap + 1;
+            uint8_t length = reader.read_bits(5);
+            if (length == 0 || length > MAX_CODE_LENGTH) {
+                return false;
+            }
+            lengths.push_back({length, symbol});
+            previous = symbol;
+        }
+
+        assign_codes(lengths);
+        return true;
+    }
+
+    void encode(BitWriter& writer, uint32_t symbol) const {
+        const Code& c = encode_table.at(symbol);
+        writer.write_bits(c.bits, c.length);
+    }
+
+    // Decode from the next MAX_CODE_LENGTH bits, peeked at once: short codes
+    // through the lookup table, longer ones canonically. Only the bits of
+    // the code found are consumed. A code that runs past the end of the
+    // data, as in a truncated file, is invalid.
+    uint32_t decode(BitReader& reader) const {
+        if (lookup.empty()) {
+            return UINT32_MAX;
+        }
+        uint32_t window = reader.peek_window(MAX_CODE_LENGTH);
+        const LookupEntry& entry = lookup[window >> (MAX_CODE_LENGTH - LOOKUP_BITS)];
+        if (entry.length != 0) {
+            if (entry.length > reader.bits_left()) {
+                return UINT32_MAX;
+            }
+            reader.skip_bits(entry.length);
+            return entry.symbol;
+        }
+        for (uint8_t len = LOOKUP_BITS + 1; len <= MAX_CODE_LENGTH; ++len) {
+            uint32_t code = window >> (MAX_CODE_LENGTH - len);
+            if (code - first_code[len] < length_count[len]) {
+                if (len > reader.bits_left()) {
+                    return UINT32_MAX;
+                }
+                reader.skip_bits(len);
+                return sorted_symbols[first_index[len] + code - first_code[len]];
+            }
+        }
+        reader.skip_bits(MAX_CODE_LENGTH);
+        return UINT32_MAX;
+    }
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ID_SCAN_X86 1
+#endif
+
+// Finds a word ID or code in an array of them, as search does over decoded
+// streams and word IDs. The vector kernels compare 8 or 4 values at once and
+// test the whole register for a match, so a scan costs about a load and a
+// compare per register where nothing matches, which is nearly everywhere.
+class IdScan {
+public:
+    // Index of the first of count values equal to target, or count if none is
+    static size_t find(const uint32_t* values, size_t count, uint32_t target) {
+        static const FindKernel kernel = select_kernel().find;
+        return kernel(values, count, target);
+    }
+
+    // Name of the kernel find runs on this CPU
+    static const char* kernel_name() {
+        return select_kernel().name;
+    }
+
+private:
+    typedef size_t (*FindKernel)(const uint32_t* values, size_t count, uint32_t target);
+
+    struct Kernel {
+        const char* name;
+        FindKernel find;
+    };
+
+    static size_t find_tail(const uint32_t* values, size_t first, size_t count, uint32_t target) {
+        for (size_t i = first; i < count; ++i) {
+            if (values[i] == target) {
+                return i;
+            }
+        }
+        return count;
+    }
+
+    static size_t find_scalar(const uint32_t* values, size_t count, uint32_t target) {
+        return find_tail(values, 0, count, target);
+    }
+
+#ifdef ID_SCAN_X86
+    __attribute__((target("sse2"))) static size_t find_sse2(const uint32_t* values, size_t count, uint32_t target) {
+        const __m128i wanted = _mm_set1_epi32(static_cast<int>(target));
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(block, wanted)) != 0) {
+                break;
+            }
+        }
+        return find_tail(values, i, count, target);
+    }
+
+    // Two registers per step; the match within them is found by find_tail
+    __attribute__((target("avx2"))) static size_t find_avx2(const uint32_t* values, size_t count, uint32_t target) {
+        const __m256i wanted = _mm256_set1_epi32(static_cast<int>(target));
+        size_t i = 0;
+        for (; i + 16 <= count; i += 16) {
+            __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i));
+            __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i + 8));
+            __m256i equal = _mm256_or_si256(_mm256_cmpeq_epi32(low, wanted), _mm256_cmpeq_epi32(high, wanted));
+            if (!_mm256_testz_si256(equal, equal)) {
+                break;
+            }
+        }
+        return find_tail(values, i, count, target);
+    }
+#endif
+
+    static Kernel select_kernel() {
+#ifdef ID_SCAN_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return {"avx2", &find_avx2};
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return {"sse2", &find_sse2};
+        }
+#endif
+        return {"scalar", &find_scalar};
+    }
+};
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LANE_PACKING_X86 1
+#endif
+
+// Vertical bit packing in the SIMD-BP128 style, widened to 8 lanes. Values
+// come in blocks of 256; value i of a block goes to lane i % 8, and each lane
+// packs its 32 values LSB first into 32-bit words, the lanes' words
+// interleaved. A block of width w is thus w groups of 8 words (32 bytes), and
+// unpacking it is the same constant shifts and masks on all lanes: one AVX2
+// register or two SSE2 registers per group. The layout is the same whichever
+// kernel runs, so files do not depend on the CPU that wrote them.
+//
+// Words are little-endian. The last block is padded with zeros.
+class LanePacker {
+public:
+    static constexpr size_t LANES = 8;
+    static constexpr size_t BLOCK_VALUES = 32 * LANES;
+    static constexpr uint8_t MAX_WIDTH = 32;
+
+    // Packed size of count values of width bits
+    static size_t packed_bytes(size_t count, uint8_t width) {
+        return block_count(count) * width * LANES * sizeof(uint32_t);
+    }
+
+    // Values unpack in whole blocks, so the output needs room for this many
+    static size_t unpacked_capacity(size_t count) {
+        return block_count(count) * BLOCK_VALUES;
+    }
+
+    // Pack count values, each below 2^width, to packed_bytes(count, width) bytes
+    static std::vector<uint8_t> pack(const std::vector<uint32_t>& values, uint8_t width) {
+        std::vector<uint8_t> packed(packed_bytes(values.size(), width), 0);
+        uint8_t* block = packed.data();
+        for (size_t first = 0; first < values.size(); first += BLOCK_VALUES) {
+            for (size_t i = first; i < values.size() && i < first + BLOCK_VALUES; ++i) {
+                size_t lane = (i - first) % LANES;
+                size_t bit = (i - first) / LANES * width;
+                uint64_t value = values[i];
+                for (size_t written = 0; written < width; written += 32 - (bit + written) % 32) {
+                    size_t word = (bit + written) / 32;
+                    uint32_t shifted = static_cast<uint32_t>((value >> written) << ((bit + written) % 32));
+                    uint8_t* target = block + (word * LANES + lane) * sizeof(uint32_t);
+                    uint32_t current;
+                    memcpy(&current, target, sizeof(current));
+                    current |= shifted;
+                    memcpy(target, &current, sizeof(current));
+                }
+            }
+            block += static_cast<size_t>(width) * LANES * sizeof(uint32_t);
+        }
+        return packed;
+    }
+
+    // Unpack count values of width bits from packed_bytes(count, width)
+    // bytes; out needs room for unpacked_capacity(count) values
+    static void unpack(const uint8_t* packed, size_t count, uint8_t width, uint32_t* out) {
+        static const Kernels kernels = select_kernels();
+        UnpackBlock kernel = kernels.unpack[width];
+        size_t block_bytes = static_cast<size_t>(width) * LANES * sizeof(uint32_t);
+        for (size_t block = 0; block < block_count(count); ++block) {
+            kernel(packed + block * block_bytes, out + block * BLOCK_VALUES);
+        }
+    }
+
+    // Name of the kernels unpack runs on this CPU
+    static const char* kernel_name() {
+        return select_kernels().name;
+    }
+
+private:
+    typedef void (*UnpackBlock)(const uint8_t* packed, uint32_t* out);
+
+    struct Kernels {
+        const char* name;
+        UnpackBlock unpack[MAX_WIDTH + 1];
+    };
+
+    static size_t block_count(size_t count) {
+        return (count + BLOCK_VALUES - 1) / BLOCK_VALUES;
+    }
+
+    // Bit position of value t of a lane, and what reading it takes
+    template <uint8_t Width, size_t T>
+    struct Slot {
+        static constexpr size_t WORD = T * Width / 32;
+        static constexpr uint32_t SHIFT = T * Width % 32;
+        static constexpr bool SPLIT = SHIFT + Width > 32;  // Runs into the next word
+        static constexpr uint32_t MASK = Width == 32 ? UINT32_MAX : (1u << Width) - 1;
+    };
+
+    template <uint8_t Width, size_t T>
+    static void unpack_scalar_value(const uint8_t* packed, uint32_t* out) {
+        typedef Slot<Width, T> S;
+        for (size_t lane = 0; lane < LANES; ++lane) {
+            uint32_t low, high = 0;
+            memcpy(&low, packed + (S::WORD * LANES + lane) * 4, 4);
+            uint32_t value = low >> S::SHIFT;
+            if constexpr (S::SPLIT) {
+                memcpy(&high, packed + ((S::WORD + 1) * LANES + lane) * 4, 4);
+                value |= high << (32 - S::SHIFT);
+            }
+            out[T * LANES + lane] = value & S::MASK;
+        }
+    }
+
+    template <uint8_t Width, size_t... T>
+    static void unpack_scalar(const uint8_t* packed, uint32_t* out, std::index_sequence<T...>) {
+        (unpack_scalar_value<Width, T>(packed, out), ...);
+    }
+
+    template <uint8_t Width>
+    static void unpack_scalar_block(const uint8_t* packed, uint32_t* out) {
+        if constexpr (Width == 0) {
+            memset(out, 0, BLOCK_VALUES * sizeof(uint32_t));
+        } else {
+            unpack_scalar<Width>(packed, out, std::make_index_sequence<32>());
+        }
+    }
+
+#ifdef LANE_PACKING_X86
+    // The same per value, on 4 lanes at a time
+    template <uint8_t Width, size_t T>
+    static void unpack_sse2_value(const uint8_t* packed, uint32_t* out) {
+        typedef Slot<Width, T> S;
+        for (size_t half = 0; half < LANES; half += 4) {
+            const __m128i* low = reinterpret_cast<const __m128i*>(packed + (S::WORD * LANES + half) * 4);
+            __m128i value = _mm_srli_epi32(_mm_loadu_si128(low), S::SHIFT);
+            if constexpr (S::SPLIT) {
+                const __m128i* high = reinterpret_cast<const __m128i*>(packed + ((S::WORD + 1) * LANES + half) * 4);
+                value = _mm_or_si128(value, _mm_slli_epi32(_mm_loadu_si128(high), 32 - S::SHIFT));
+            }
+            if constexpr (Width < 32) {
+                value = _mm_and_si128(value, _mm_set1_epi32(static_cast<int>(S::MASK)));
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + T * LANES + half), value);
+        }
+    }
+
+    template <uint8_t Width, size_t... T>
+    static void unpack_sse2(const uint8_t* packed, uint32_t* out, std::index_sequence<T...>) {
+        (unpack_sse2_value<Width, T>(packed, out), ...);
+    }
+
+    template <uint8_t Width>
+    static void unpack_sse2_block(const uint8_t* packed, uint32_t* out) {
+        if constexpr (Width == 0) {
+            memset(out, 0, BLOCK_VALUES * sizeof(uint32_t));
+        } else {
+            unpack_sse2<Width>(packed, out, std::make_index_sequence<32>());
+        }
+    }
+
+    // And on all 8 lanes at a time
+    template <uint8_t Width, size_t T>
+    __attribute__((target("avx2"))) static void unpack_avx2_value(const uint8_t* packed, uint32_t* out) {
+        typedef Slot<Width, T> S;
+        const __m256i* low = reinterpret_cast<const __m256i*>(packed + S::WORD * LANES * 4);
+        __m256i value = _mm256_srli_epi32(_mm256_loadu_si256(low), S::SHIFT);
+        if constexpr (S::SPLIT) {
+            const __m256i* high = reinterpret_cast<const __m256i*>(packed + (S::WORD + 1) * LANES * 4);
+            value = _mm256_or_si256(value, _mm256_slli_epi32(_mm256_loadu_si256(high), 32 - S::SHIFT));
+        }
+        if constexpr (Width < 32) {
+            value = _mm256_and_si256(value, _mm256_set1_epi32(static_cast<int>(S::MASK)));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + T * LANES), value);
+    }
+
+    template <uint8_t Width, size_t... T>
+    __attribute__((target("avx2"))) static void unpack_avx2(const uint8_t* packed, uint32_t* out,
+                                                              std::index_sequence<T...>) {
+        (unpack_avx2_value<Width, T>(packed, out), ...);
+    }
+
+    template <uint8_t Width>
+    __attribute__((target("avx2"))) static void unpack_avx2_block(const uint8_t* packed, uint32_t* out) {
+        if constexpr (Width == 0) {
+            memset(out, 0, BLOCK_VALUES * sizeof(uint32_t));
+        } else {
+            unpack_avx2<Width>(packed, out, std::make_index_sequence<32>());
+        }
+    }
+#endif
+
+    template <size_t... Widths>
+    static Kernels scalar_kernels(std::index_sequence<Widths...>) {
+        return {"scalar", {&unpack_scalar_block<Widths>...}};
+    }
+
+#ifdef LANE_PACKING_X86
+    template <size_t... Widths>
+    static Kernels sse2_kernels(std::index_sequence<Widths...>) {
+        return {"sse2", {&unpack_sse2_block<Widths>...}};
+    }
+
+    template <size_t... Widths>
+    static Kernels avx2_kernels(std::index_sequence<Widths...>) {
+        return {"avx2", {&unpack_avx2_block<Widths>...}};
+    }
+#endif
+
+    // Best kernels for this CPU, picked once
+    static Kernels select_kernels() {
+        auto widths = std::make_index_sequence<MAX_WIDTH + 1>();
+#ifdef LANE_PACKING_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return avx2_kernels(widths);
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return sse2_kernels(widths);
+        }
+#endif
+        return scalar_kernels(widths);
+    }
+};
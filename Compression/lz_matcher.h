@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// A back-reference: the tokens at [position, position + length) repeat the
+// tokens that start distance tokens earlier
+struct TokenMatch {
+    uint32_t position;
+    uint32_t distance;
+    uint32_t length;
+};
+
+// Greedy LZ77 parse of a word-ID stream. Candidates come from hash chains
+// keyed on the next ANCHOR_LENGTH tokens; matches may be of any length and
+// reach back at most window tokens.
+class TokenMatchFinder {
+public:
+    static constexpr uint32_t ANCHOR_LENGTH = 4;
+
+private:
+    uint32_t window;
+    uint32_t min_length;
+    uint32_t max_chain;
+
+    static uint32_t anchor_hash(const uint32_t* ids, uint8_t hash_bits) {
+        uint64_t h = 0;
+        for (uint32_t i = 0; i < ANCHOR_LENGTH; ++i) {
+            h = (h + ids[i]) * 0x9E3779B97F4A7C15ULL;
+        }
+        return static_cast<uint32_t>(h >> (64 - hash_bits));
+    }
+
+public:
+    TokenMatchFinder(uint32_t window, uint32_t min_length = 8, uint32_t max_chain = 32)
+        : window(window), min_length(min_length < ANCHOR_LENGTH ? ANCHOR_LENGTH : min_length),
+          max_chain(max_chain) {}
+
+    // chain_probes, if given, gets a histogram of candidates tried per position
+    std::vector<TokenMatch> find_matches(const std::vector<uint32_t>& ids,
+                                         std::vector<uint64_t>* chain_probes = nullptr) const {
+        std::vector<TokenMatch> matches;
+        size_t n = ids.size();
+        if (window == 0 || n < min_length) {
+            return matches;
+        }
+
+        // Size the head table to the input, between 2^12 and 2^22 buckets
+        uint8_t hash_bits = 12;
+        while (hash_bits < 22 && (1ULL << hash_bits) < n) {
+            hash_bits++;
+        }
+
+        std::vector<int32_t> head(1u << hash_bits, -1);
+        std::vector<int32_t> chain(n, -1);
+
+        auto insert = [&](size_t pos) {
+            uint32_t h = anchor_hash(&ids[pos], hash_bits);
+            chain[pos] = head[h];
+            head[h] = static_cast<int32_t>(pos);
+        };
+
+        size_t last_anchor = n - ANCHOR_LENGTH;
+        size_t i = 0;
+        while (i <= last_anchor) {
+            uint32_t best_length = 0;
+            uint32_t best_distance = 0;
+
+            int32_t candidate = head[anchor_hash(&ids[i], hash_bits)];
+            uint32_t depth = 0;
+            for (; candidate >= 0 && depth < max_chain; ++depth) {
+                size_t distance = i - candidate;
+                if (distance > window) {
+                    break;
+                }
+
+                // Cheap reject: a longer match must also agree one past the best
+                if (best_length == 0 || (i + best_length < n && ids[candidate + best_length] == ids[i + best_length])) {
+                    uint32_t length = 0;
+                    while (i + length < n && ids[candidate + length] == ids[i + length]) {
+                        length++;
+                    }
+                    if (length > best_length) {
+                        best_length = length;
+                        best_distance = distance;
+                    }
+                }
+
+                candidate = chain[candidate];
+            }
+
+            if (chain_probes) {
+                if (depth >= chain_probes->size()) {
+                    chain_probes->resize(depth + 1, 0);
+                }
+                (*chain_probes)[depth]++;
+            }
+
+            if (best_length >= min_length) {
+                matches.push_back({static_cast<uint32_t>(i), best_distance, best_length});
+                size_t end = i + best_length;
+                for (; i < end && i <= last_anchor; ++i) {
+                    insert(i);
+                }
+                i = end;
+            } else {
+                insert(i);
+                i++;
+            }
+        }
+
+        return matches;
+    }
+};
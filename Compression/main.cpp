@@ -1,6 +1,5 @@
 #include <iostream>
 #include <fstream>
-#include <unordered_map>
 #include <vector>
 #include <string>
 #include <algorithm>
@@ -10,105 +9,258 @@
 #include <functional>
 #include <sstream>
 #include <iomanip>
+#include <memory_resource>
+#include <string_view>
+#include <cstdio>
+#include <utility>
+#include <thread>
+#include <numeric>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+
+#include "adaptive_dictionary.h"
+#include "arena.h"
+#include "backend_codec.h"
+#include "bitio.h"
+#include "block_index.h"
+#include "chunk_store.h"
+#include "corpus_generator.h"
+#include "flat_hash_map.h"
+#include "huffman.h"
+#include "id_scan.h"
+#include "lane_packing.h"
+#include "lz_matcher.h"
+#include "mapped_file.h"
+#include "perfect_hash.h"
+#include "repair.h"
+#include "stream_vbyte.h"
+#include "string_pool.h"
+#include "text_forms.h"
+#include "compression_stats.h"
+
+#include <cerrno>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using namespace std;
 
-// Trie structure for phrase detection and storage
+// Count every heap allocation of the process for the statistics. Kept out of
+// line so the optimizer never pairs an inlined free() with a new expression.
+// Every form of new that operator delete may free is replaced, nothrow ones
+// included, so that all of them come from malloc.
+[[gnu::noinline]] void* operator new(size_t size, const nothrow_t&) noexcept {
+    HeapCounters::count(size);
+    return malloc(size ? size : 1);
+}
+
+[[gnu::noinline]] void* operator new(size_t size) {
+    void* p = operator new(size, nothrow);
+    if (!p) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+[[gnu::noinline]] void operator delete(void* p) noexcept {
+    free(p);
+}
+
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+[[gnu::noinline]] void operator delete(void* p, const nothrow_t&) noexcept {
+    free(p);
+}
+
+// Over-aligned allocations, such as the arena chunks of std::pmr
+[[gnu::noinline]] void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept {
+    HeapCounters::count(size);
+    size_t align = static_cast<size_t>(alignment);
+    return aligned_alloc(align, (size + align - 1) / align * align);
+}
+
+[[gnu::noinline]] void* operator new(size_t size, align_val_t alignment) {
+    void* p = operator new(size, alignment, nothrow);
+    if (!p) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+[[gnu::noinline]] void operator delete(void* p, align_val_t) noexcept {
+    free(p);
+}
+
+[[gnu::noinline]] void operator delete(void* p, size_t, align_val_t) noexcept {
+    free(p);
+}
+
+[[gnu::noinline]] void operator delete(void* p, align_val_t, const nothrow_t&) noexcept {
+    free(p);
+}
+
+// Leading bytes of a phrase-mode, a Re-Pair and an adaptive compressed file
+static const char PHRASE_MAGIC[] = "TTC1";
+static const char REPAIR_MAGIC[] = "RPG1";
+static const char ADAPTIVE_MAGIC[] = "LZW1";
+
+// Adaptive mode (adaptive_dictionary.h) needs no dictionary file: after the
+// magic come the log2 of the phrase bound in 5 bits and one code per step,
+// at the width of the codes there can be. Code ADAPTIVE_END ends the file,
+// ADAPTIVE_NEW_WORD is followed by a word not seen before, its length in
+// gamma code and its bytes, and the other codes less ADAPTIVE_CODE_BASE are
+// dictionary codes.
+static const uint32_t ADAPTIVE_END = 0;
+static const uint32_t ADAPTIVE_NEW_WORD = 1;
+static const uint32_t ADAPTIVE_CODE_BASE = 2;
+static const uint32_t ADAPTIVE_PHRASE_BITS = 20;
+
+// Phrase-mode header flags
+static const uint8_t FLAG_ENTROPY_CODED = 1;
+static const uint8_t FLAG_SPLIT_STREAMS = 2;
+static const uint8_t FLAG_BACKEND = 4;         // A backend id byte follows the flags
+static const uint8_t FLAG_LOSSLESS = 8;        // Text forms follow the token stream
+static const uint8_t FLAG_NUMBERS = 16;        // Number values follow the token stream
+static const uint8_t FLAG_SEGMENTS = 32;       // Text was appended: a segment table ends the file
+static const uint8_t FLAG_MEMBERS = 64;        // Several inputs: a member table ends the file
+static const uint8_t FLAG_DEDUP = 128;         // Members are lists of chunks stored once
+
+// Appended archives: what follows the header, from the local dictionary to
+// the text forms, is a segment, and each append adds one for its input
+// against the same dictionaries, from the next byte boundary. The file then
+// ends in a table of where each segment starts, in 64 bits as two halves,
+// the segment count in 32 bits and SEGMENT_MAGIC. A segment decodes on its
+// own, with its own local words, numbers and matches, and its text follows
+// the text of the one before.
+static const char SEGMENT_MAGIC[] = "TTS1";
+
+// Member archives hold several inputs, each as a segment of its own, coded
+// against dictionaries shared by all of them. The file ends in a member
+// table: per member the byte offset and size of its segment and the size
+// of its input, in 64 bits as two halves, and its name, a length in 16 bits
+// and the bytes. Then the offset of the table in 64 bits, the member count
+// in 32 bits and MEMBER_MAGIC. A member decodes without reading the others.
+//
+// With FLAG_DEDUP the inputs are cut into chunks (chunk_store.h) and a
+// segment only holds the chunks not seen in an earlier member, back to
+// back. The member entries are then followed by the chunk table, in the
+// order chunks were first seen: their count in 32 bits, and per chunk the
+// gamma codes of how many members on from the one before its owner is,
+// plus one, and of its token count. Then per member the count of chunks it
+// is made of in 32 bits and per chunk the gamma code of its ID less the one
+// after the chunk before, zigzag-coded, plus one; padded to a byte. A
+// member then decodes the segments its chunks are in, and no others.
+static const char MEMBER_MAGIC[] = "TTM1";
+
+// Split-stream layout: the tokens are cut into blocks, and each block keeps
+// one stream per kind of value, in this order. The class stream tells which
+// kind of token comes next; a phrase's filler comes from the filler stream,
+// and an escaped filler takes a class and a code like a word token does.
+enum SplitStream {
+    STREAM_CLASS,
+    STREAM_MAIN,
+    STREAM_LOCAL,
+    STREAM_PHRASE,
+    STREAM_FILLER,
+    STREAM_MATCH,   // Distance and length of each match
+    STREAM_COUNT
+};
+
+enum SplitTokenClass {
+    SPLIT_MAIN_WORD,
+    SPLIT_LOCAL_WORD,
+    SPLIT_PHRASE,
+    SPLIT_MATCH
+};
+
+// Each stream is coded on its own: in fixed-width lanes, unless a coding the
+// level allows is smaller, or all in Stream VByte when decode speed matters more
+enum StreamCoding {
+    CODING_GAMMA,          // Elias gamma of value + 1
+    CODING_HUFFMAN,        // Code table, then codes
+    CODING_FILLER_WIDTHS,  // Filler stream only: each value at its phrase's filler width
+    CODING_LANES,          // Fixed-width values in the SIMD lane layout of lane_packing.h
+    CODING_STREAM_VBYTE    // Byte-aligned values with 2-bit lengths, as in stream_vbyte.h
+};
+
+// Set in the coding byte of a stream whose bytes went through the archive's
+// backend codec; its stored length follows the raw length
+static const uint8_t CODING_BACKEND_BIT = 0x80;
+
+static const uint32_t SPLIT_BLOCK_TOKENS = 1u << 20;
+
+// With --index, the blocks of a split-stream archive are indexed in a file
+// named after it with this suffix; see block_index.h
+static const char* const INDEX_SUFFIX = ".idx";
+
+// Numbers: a token of digits that is not a main word takes the local code
+// one past the local dictionary. After the token stream, from the next byte
+// boundary, come the count of such tokens and one split stream of bytes with
+// their values in text order: each a varint (7 bits a byte, low bits first)
+// of value * 2, plus 1 if it has leading zeros, and if so a varint of their
+// count less one.
+
+// Lossless mode: after the numbers, from the next byte boundary, the
+// forms of the tokens in blocks of SPLIT_BLOCK_TOKENS, each block the number
+// of tokens, the width its lines wrap at (0 if they do not) and these split
+// streams, and then the whitespace after the last token. The predictor of
+// text_forms.h guesses each form, so a block only keeps its misses, as runs
+// of right guesses and the classes that broke them.
+enum FormStream {
+    FORM_CASE_RUNS,          // Right guesses before each miss, and after the last one
+    FORM_CASE_MISSES,        // Case class of each miss
+    FORM_SPACING_RUNS,
+    FORM_SPACING_MISSES,
+    FORM_SEPARATOR_LENGTHS,  // Length of each other separator
+    FORM_TEXT,               // Bytes of other separators and case exceptions, in token order
+    FORM_STREAM_COUNT
+};
+
+// The phrase stream is decoded before the tokens are rebuilt, so the decoder
+// prefetches the tables of the phrases this many phrases ahead, and their
+// words and fillers half as far ahead
+static const size_t PHRASE_PREFETCH_DISTANCE = 16;
+
+// Token classes are 2 bits; the class stream codes them three at a time,
+// first class in the high bits, so a Huffman code is not held to a whole
+// bit per class
+static const uint32_t CLASSES_PER_SYMBOL = 3;
+static const uint8_t CLASS_SYMBOL_BITS = 2 * CLASSES_PER_SYMBOL;
+
+// Where a phrase's words and filler codes sit in the packed phrase tables
+struct PhraseExpansion {
+    uint32_t word_start;
+    uint32_t filler_start;
+    uint16_t word_count;
+    uint16_t filler_count;
+    uint16_t wildcard_pos;  // NO_WILDCARD if the phrase has none
+    uint8_t filler_bit_length;
+    
+    static constexpr uint16_t NO_WILDCARD = UINT16_MAX;
+};
+
+// Trie structure for phrase detection. Nodes, their child tables and the
+// child key text all live in the trie arena; the phrases themselves are
+// described by phrase_decode_dict.
 class PhraseNode {
 public:
-    unordered_map<string, shared_ptr<PhraseNode>> children;
+    typedef pmr::polymorphic_allocator<pair<string_view, PhraseNode*>> ChildAllocator;
+    
+    FlatHashMap<string_view, PhraseNode*, FlatHash, equal_to<>, ChildAllocator> children;
+    PhraseNode* wildcard_child = nullptr;  // Edge matching any single word
     bool is_end = false;
     uint32_t phrase_id = 0;
     uint32_t frequency = 0;
-    vector<uint32_t> word_codes;
     
     // Check if this node contains a wildcard position
     bool has_wildcard = false;
     size_t wildcard_pos = 0;
     
-    // For phrases with wildcards, store all encountered wildcards and their frequencies
-    unordered_map<uint32_t, uint32_t> wildcard_codes;
-};
-
-class BitWriter {
-private:
-    vector<uint8_t> buffer;
-    uint8_t current_byte = 0;
-    uint8_t bits_used = 0;
-    
-public:
-    void write_bits(uint32_t value, uint8_t bit_count) {
-        while (bit_count > 0) {
-            uint8_t bits_to_write = min(bit_count, static_cast<uint8_t>(8 - bits_used));
-            uint8_t mask = (1 << bits_to_write) - 1;
-            uint8_t bits = (value >> (bit_count - bits_to_write)) & mask;
-            
-            current_byte |= bits << (8 - bits_used - bits_to_write);
-            bits_used += bits_to_write;
-            bit_count -= bits_to_write;
-            
-            if (bits_used == 8) {
-                buffer.push_back(current_byte);
-                current_byte = 0;
-                bits_used = 0;
-            }
-        }
-    }
-    
-    void flush() {
-        if (bits_used > 0) {
-            buffer.push_back(current_byte);
-            current_byte = 0;
-            bits_used = 0;
-        }
-    }
-    
-    const vector<uint8_t>& get_buffer() const {
-        return buffer;
-    }
-    
-    bool write_to_file(const string& filename) {
-        flush();
-        ofstream outfile(filename, ios::binary);
-        if (!outfile) return false;
-        outfile.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
-        return outfile.good();
-    }
-};
-
-class BitReader {
-private:
-    const vector<uint8_t>& buffer;
-    size_t current_byte_idx = 0;
-    uint8_t bits_read = 0;
-    
-public:
-    BitReader(const vector<uint8_t>& buf) : buffer(buf) {}
-    
-    uint32_t read_bits(uint8_t bit_count) {
-        uint32_t result = 0;
-        
-        while (bit_count > 0 && current_byte_idx < buffer.size()) {
-            uint8_t bits_to_read = min(bit_count, static_cast<uint8_t>(8 - bits_read));
-            uint8_t mask = ((1 << bits_to_read) - 1) << (8 - bits_read - bits_to_read);
-            uint8_t bits = (buffer[current_byte_idx] & mask) >> (8 - bits_read - bits_to_read);
-            
-            result = (result << bits_to_read) | bits;
-            bits_read += bits_to_read;
-            bit_count -= bits_to_read;
-            
-            if (bits_read == 8) {
-                current_byte_idx++;
-                bits_read = 0;
-            }
-        }
-        
-        return result;
-    }
-    
-    bool has_more() const {
-        return current_byte_idx < buffer.size() || bits_read < 8;
-    }
+    explicit PhraseNode(pmr::memory_resource* arena) : children(arena) {}
 };
 
 struct WordFreq {
@@ -128,8 +280,14 @@ struct PhraseInfo {
     bool has_wildcard = false;
     size_t wildcard_pos = 0;
     
+    // Main codes of the usual wildcard fillers, most frequent first. A filler
+    // is written as its index here; index filler_codes.size() escapes to a
+    // full word code.
+    vector<uint32_t> filler_codes;
+    uint8_t filler_bit_length = 0;
+    
     // For pretty printing
-    string to_string(const vector<string>& word_dict) const {
+    string to_string(const StringPool& word_dict) const {
         stringstream ss;
         for (size_t i = 0; i < word_codes.size(); ++i) {
             if (has_wildcard && i == wildcard_pos) {
@@ -146,262 +304,414 @@ struct PhraseInfo {
 enum TokenType {
     WORD,       // Regular word
     PHRASE,     // Complete phrase
-    WILDCARD    // Wildcard within a phrase
+    WILDCARD,   // Wildcard within a phrase
+    MATCH       // Back-reference to earlier tokens
 };
 
 struct Token {
     TokenType type;
     string word;       // Single word or wildcard word
     uint32_t phrase_id;     // ID of the phrase (if type is PHRASE or WILDCARD)
+    uint32_t distance = 0;  // Tokens back to the copy source (if type is MATCH)
+    uint32_t length = 0;    // Number of tokens copied (if type is MATCH)
     
     Token(TokenType t, const string& w, uint32_t id = 0)
         : type(t), word(w), phrase_id(id) {}
 };
 
+// What each compression level spends effort on. Levels 1-3 skip mining and
+// reuse the phrases of a trained dictionary (eng.dict from an earlier run)
+// with greedy matching; given a plain word list they code words only. Levels
+// 4-9 mine phrases from the input and write a new eng.dict.
+//
+// Bundled books, 2.6k-word list; ratio = compressed / input, dictionary
+// file not included; trained dictionary = eng.dict from level 6 on the book:
+//
+//   level  prideandprejudice.txt      warandpeace.txt
+//     1     8.0 MB/s  0.272           9.2 MB/s  0.273
+//     2     7.1 MB/s  0.272           8.5 MB/s  0.272
+//     3     6.5 MB/s  0.271           6.3 MB/s  0.272
+//     4     1.7 MB/s  0.272           1.6 MB/s  0.280
+//     5     1.6 MB/s  0.272           1.1 MB/s  0.264
+//     6     0.6 MB/s  0.271           0.4 MB/s  0.272
+//     7     0.6 MB/s  0.229           0.5 MB/s  0.228
+//     8     0.5 MB/s  0.219           0.4 MB/s  0.216
+//     9     0.4 MB/s  0.217           0.4 MB/s  0.214
+struct LevelSettings {
+    bool use_trained_phrases;    // Reuse phrases from a trained dictionary instead of mining
+    bool mine_wildcards;         // Run the wildcard pattern miner
+    uint32_t max_phrase_length;  // Longest phrase mined and matched, in tokens
+    uint32_t match_window;       // Long-range match window in tokens (0 disables)
+    uint32_t match_chain;        // Hash chain candidates tried per position
+    bool optimal_parse;          // Minimum-cost parse instead of greedy longest match
+    bool entropy_code;           // Huffman-code the token stream
+    bool split_streams = false;  // Split-stream layout instead of one interleaved stream
+    bool stream_vbyte = false;   // Code every split stream in Stream VByte, for decode speed
+    const BackendCodec* backend = nullptr;  // Second-stage codec over the split streams
+    bool lossless = false;       // Keep case and whitespace for a byte-identical restore
+    bool block_index = false;    // Write the blocks each word and phrase is in next to the archive
+    bool dedup = false;          // Keep chunks repeated across members of an archive once
+};
+
+static const int DEFAULT_LEVEL = 6;
+static const LevelSettings COMPRESSION_LEVELS[10] = {
+    {},                                                 // unused
+    {true,  false, 5, 0,         0,   false, false},    // 1
+    {true,  false, 5, 1u << 16,  8,   false, false},    // 2
+    {true,  false, 5, 1u << 20,  32,  false, false},    // 3
+    {false, false, 3, 1u << 20,  32,  false, false},    // 4
+    {false, false, 5, 1u << 20,  32,  false, false},    // 5
+    {false, true,  5, 1u << 20,  32,  false, false},    // 6
+    {false, true,  5, 1u << 20,  32,  false, true},     // 7
+    {false, true,  6, 1u << 20,  64,  true,  true},     // 8
+    {false, true,  8, 1u << 22,  256, true,  true},     // 9
+};
+
+// Where a search query occurs: the archive, as an index into the files
+// searched, the position of its first word, and the words around it
+struct SearchHit {
+    size_t file;
+    uint64_t position;
+    string context;
+};
+
 class TwoTierTextCompressor {
 private:
-    // Main dictionary
-    unordered_map<string, uint32_t> main_encode_dict;
-    vector<string> main_decode_dict;
+    // Main dictionary. The map serves while mining still adds words; the
+    // perfect hash index replaces it once the dictionary is final.
+    FlatHashMap<string, uint32_t> main_encode_dict;
+    PerfectHash main_index;
+    StringPool main_decode_dict;
+    MappedFile dictionary_file;  // Text of a loaded dictionary, viewed by main_decode_dict
     uint8_t main_max_bit_length = 0;
     
     // Local dictionary (for rare words)
-    unordered_map<string, uint32_t> local_encode_dict;
+    FlatHashMap<string, uint32_t> local_encode_dict;
     vector<string> local_decode_dict;
     uint8_t local_max_bit_length = 0;
     
     // Phrase dictionary 
-    shared_ptr<PhraseNode> phrase_trie_root;
+    Arena trie_arena;
+    PhraseNode* phrase_trie_root = nullptr;
     vector<PhraseInfo> phrase_decode_dict;
+    
+    // The loaded phrases again, packed for the decoders: a small record per
+    // phrase, and the word codes and filler codes of all phrases back to
+    // back. A phrase is then copied in one go from memory that stays in cache.
+    vector<PhraseExpansion> phrase_expansions;
+    vector<uint32_t> phrase_words;    // Wildcard slots included
+    vector<uint32_t> phrase_fillers;
     uint8_t phrase_max_bit_length = 0;
     
+    // Case and whitespace of the input tokens, in lossless mode
+    TextForms text_forms;
+    
+    // Blocks of the split streams each word and phrase is in, with --index
+    BlockIndex block_index;
+    
+    // Where in the archive the segment being written starts, as the index
+    // gives block offsets from the start of the file
+    uint64_t segment_offset = 0;
+    
+    // No progress output, for the compressors that code members in parallel
+    bool quiet = false;
+    
     // Statistics tracking
     uint32_t non_repeated_phrases = 0;
     
     // Frequency tracking
-    unordered_map<string, uint32_t> word_frequencies;
+    FlatHashMap<string, uint32_t> word_frequencies;
+    
+    // Shortest long-range match worth coding, in tokens
+    static constexpr uint32_t MIN_MATCH_LENGTH = 12;
     
-    // Preprocessing and tokenization
-    vector<string> tokenize_raw(const string& text) {
+    // Wildcard filler tables hold at most this many words; in the entropy-coded
+    // stream the same value escapes to a full word symbol
+    static constexpr uint32_t MAX_FILLER_TABLE = 255;
+    static constexpr uint32_t FILLER_ESCAPE = MAX_FILLER_TABLE;
+    
+    // Tokens of up to this many digits are numbers: they stay out of the
+    // dictionaries and code their value instead, which fits in 64 bits
+    static constexpr size_t MAX_NUMBER_DIGITS = 18;
+    
+    // Search shows this many words before and after a hit, and keeps a
+    // place to resume a block walk from every so many tokens
+    static constexpr uint64_t SEARCH_CONTEXT_WORDS = 8;
+    static constexpr uint32_t SEARCH_CHECKPOINT_TOKENS = 64;
+    
+    // Matches that copy matches are read through this many at most in one
+    // go; past that each word is looked up on its own
+    static constexpr int SEARCH_MATCH_DEPTH = 16;
+    
+    // Decompressed text is written out in pieces of this size
+    static constexpr size_t TEXT_BUFFER_BYTES = 1 << 16;
+    
+    // Adaptive mode reads its input in pieces of this size
+    static constexpr size_t ADAPTIVE_READ_BYTES = 1 << 20;
+    
+    LevelSettings settings = COMPRESSION_LEVELS[DEFAULT_LEVEL];
+    
+    // Counters and stage timers of the last compress or decompress call
+    CompressionStats stats;
+    
+    // Preprocessing and tokenization. With forms, also record each token as
+    // written and the whitespace before it, for lossless mode.
+    vector<string> tokenize_raw(const string& text, TextForms* forms = nullptr) {
         vector<string> tokens;
         string current_token;
+        size_t token_start = 0;     // Of current_token in text
+        size_t separator_start = 0; // Of the whitespace before the next token
         
-        for (char c : text) {
-            if (isalnum(c) || c == '\'') {
+        auto add_token = [&](const string& token, size_t start) {
+            if (forms != nullptr) {
+                forms->add(text.data() + start, token.size(), text.data() + separator_start, start - separator_start);
+                separator_start = start + token.size();
+            }
+            tokens.push_back(token);
+        };
+        
+        if (forms != nullptr) {
+            forms->clear();
+        }
+        for (size_t i = 0; i < text.size(); ++i) {
+            char c = text[i];
+            if (isalnum(static_cast<unsigned char>(c)) || c == '\'') {
+                if (current_token.empty()) {
+                    token_start = i;
+                }
                 current_token += tolower(c);
             } else {
                 if (!current_token.empty()) {
-                    tokens.push_back(current_token);
+                    add_token(current_token, token_start);
                     current_token.clear();
                 }
-                if (!isspace(c)) {
-                    tokens.push_back(string(1, c));
+                if (!isspace(static_cast<unsigned char>(c))) {
+                    add_token(string(1, c), i);
                 }
             }
         }
         
         if (!current_token.empty()) {
-            tokens.push_back(current_token);
+            add_token(current_token, token_start);
+        }
+        if (forms != nullptr) {
+            forms->trailing = text.substr(separator_start);
         }
         
         return tokens;
     }
     
-    // Build ngrams from token list
-    vector<vector<string>> build_ngrams(const vector<string>& tokens, int min_size, int max_size) {
-        vector<vector<string>> ngrams;
-        
-        for (size_t i = 0; i < tokens.size(); ++i) {
-            for (int size = min_size; size <= max_size && i + size <= tokens.size(); ++size) {
-                vector<string> ngram;
-                for (int j = 0; j < size; ++j) {
-                    ngram.push_back(tokens[i + j]);
-                }
-                ngrams.push_back(ngram);
-            }
+    // Give every distinct token an ID: the position where it first occurs.
+    // Mining keys its tables by runs of these IDs instead of by joined text,
+    // and tokens[id] turns an ID back into its word.
+    static vector<uint32_t> first_occurrence_ids(const vector<string>& tokens) {
+        FlatHashMap<string_view, uint32_t> first_seen;
+        first_seen.reserve(tokens.size() / 8);
+        vector<uint32_t> ids;
+        ids.reserve(tokens.size());
+        for (uint32_t i = 0; i < tokens.size(); ++i) {
+            ids.push_back(first_seen.emplace(tokens[i], i).first->second);
         }
-        
-        return ngrams;
+        return ids;
+    }
+    
+    static void append_id(string& key, uint32_t id) {
+        key.append(reinterpret_cast<const char*>(&id), sizeof(id));
     }
     
     // Find phrases with wildcards
     void find_wildcard_phrases(const vector<string>& tokens) {
-        // Looking for patterns like "in the * of the" where * is any word
-        unordered_map<string, unordered_map<size_t, unordered_map<string, uint32_t>>> wildcard_patterns;
+        // Looking for patterns like "in the * of the" where * is any word. A
+        // pattern is keyed by the IDs of its words with a marker in place of
+        // the wildcard; the key text is scratch data in its own arena,
+        // dropped in one go.
+        struct PatternCount {
+            uint32_t start;         // First occurrence
+            uint32_t length;
+            uint32_t wildcard_pos;
+            uint32_t count;
+        };
+        const uint32_t WILDCARD_ID = UINT32_MAX;
+        vector<uint32_t> ids = first_occurrence_ids(tokens);
+        Arena scratch(1 << 20);
+        FlatHashMap<string_view, uint32_t> pattern_index;
+        vector<PatternCount> patterns;
+        FlatHashMap<uint64_t, uint32_t> filler_counts;  // (pattern << 32 | filler ID) -> count
+        string pattern_key;
         
         // Minimum frequency for phrase consideration
         const uint32_t MIN_PHRASE_FREQ = 2;
         
-        // For each possible phrase length (2-5 words)
-        for (int phrase_len = 2; phrase_len <= 5; ++phrase_len) {
+        // For each possible phrase length (3-5 words; longer patterns cost too much to mine)
+        int max_len = min<int>(5, settings.max_phrase_length);
+        for (int phrase_len = 3; phrase_len <= max_len; ++phrase_len) {
             // For each possible starting position in tokens
             for (size_t start = 0; start + phrase_len <= tokens.size(); ++start) {
-                // For each possible wildcard position within the phrase
-                for (size_t wildcard_pos = 0; wildcard_pos < phrase_len; ++wildcard_pos) {
-                    // Create pattern key by joining all words except wildcard
-                    string pattern_key;
-                    string wildcard_word = tokens[start + wildcard_pos];
-                    
+                // For each interior wildcard position; a wildcard at either end is
+                // just a neighbouring word and saves nothing over a plain phrase
+                for (size_t wildcard_pos = 1; wildcard_pos + 1 < phrase_len; ++wildcard_pos) {
+                    pattern_key.clear();
                     for (size_t i = 0; i < phrase_len; ++i) {
-                        if (i == wildcard_pos) {
-                            pattern_key += "*";
-                        } else {
-                            pattern_key += tokens[start + i];
-                        }
-                        
-                        if (i < phrase_len - 1) {
-                            pattern_key += " ";
-                        }
+                        append_id(pattern_key, i == wildcard_pos ? WILDCARD_ID : ids[start + i]);
                     }
                     
                     // Record this occurrence
-                    wildcard_patterns[pattern_key][wildcard_pos][wildcard_word]++;
+                    uint32_t pattern;
+                    auto it = pattern_index.find(pattern_key);
+                    if (it != pattern_index.end()) {
+                        pattern = it->second;
+                        patterns[pattern].count++;
+                    } else {
+                        pattern = patterns.size();
+                        pattern_index.emplace(scratch.copy_string(pattern_key), pattern);
+                        patterns.push_back({static_cast<uint32_t>(start), static_cast<uint32_t>(phrase_len),
+                                            static_cast<uint32_t>(wildcard_pos), 1});
+                    }
+                    filler_counts[static_cast<uint64_t>(pattern) << 32 | ids[start + wildcard_pos]]++;
                 }
             }
         }
         
-        // Now analyze patterns to find frequently occurring ones
-        for (const auto& pattern_entry : wildcard_patterns) {
-            const string& pattern = pattern_entry.first;
+        // Filler keys sorted so that each pattern's fillers sit together
+        vector<uint64_t> fillers;
+        fillers.reserve(filler_counts.size());
+        for (const auto& entry : filler_counts) {
+            fillers.push_back(entry.first);
+        }
+        sort(fillers.begin(), fillers.end());
+        size_t next_filler = 0;
+        
+        // Now analyze patterns to find frequently occurring ones, in order of
+        // first appearance
+        for (uint32_t p = 0; p < patterns.size(); ++p) {
+            const PatternCount& pattern = patterns[p];
             
-            for (const auto& pos_entry : pattern_entry.second) {
-                size_t wildcard_pos = pos_entry.first;
-                uint32_t total_occurrences = 0;
-                
-                // Count total occurrences across all wildcard words
-                for (const auto& word_entry : pos_entry.second) {
-                    total_occurrences += word_entry.second;
-                }
-                
-                // If pattern occurs frequently enough, add to phrase trie
-                if (total_occurrences >= MIN_PHRASE_FREQ) {
-                    // Parse pattern into words
-                    vector<string> phrase_words;
-                    stringstream ss(pattern);
-                    string word;
-                    
-                    while (ss >> word) {
-                        phrase_words.push_back(word);
-                    }
-                    
-                    // Convert words to word codes
-                    vector<uint32_t> word_codes;
-                    for (size_t i = 0; i < phrase_words.size(); ++i) {
-                        const string& next_word = phrase_words[i];
-                        if (next_word != "*") {
-                            // Get word code from main dictionary
-                            auto it = main_encode_dict.find(next_word);
-                            if (it != main_encode_dict.end()) {
-                                word_codes.push_back(it->second);
-                            } else {
-                                // Add to main dictionary if not present
-                                uint32_t new_code = main_decode_dict.size();
-                                main_decode_dict.push_back(next_word);
-                                main_encode_dict[next_word] = new_code;
-                                word_codes.push_back(new_code);
-                            }
-                        } else {
-                            // For wildcards, add a placeholder code (will be replaced during tokenization)
-                            word_codes.push_back(UINT32_MAX); // Special value to indicate wildcard
-                        }
-                    }
-                    
-                    // Add the phrase pattern to trie
-                    shared_ptr<PhraseNode> current = phrase_trie_root;
-                    
-                    for (size_t i = 0; i < phrase_words.size(); ++i) {
-                        const string& next_word = phrase_words[i];
-                        
-                        if (next_word == "*") {
-                            // Skip the wildcard in the trie traversal
-                            continue;
-                        }
-                        
-                        if (current->children.find(next_word) == current->children.end()) {
-                            current->children[next_word] = make_shared<PhraseNode>();
-                        }
-                        
-                        current = current->children[next_word];
-                    }
-                    
-                    // Mark wildcard information
-                    current->has_wildcard = true;
-                    current->wildcard_pos = wildcard_pos;
-                    current->is_end = true;
-                    current->frequency = total_occurrences;
-                    current->word_codes = word_codes;
-                    
-                    // Store all wildcard words encountered, using their codes
-                    for (const auto& word_entry : pos_entry.second) {
-                        const string& wildcard_word = word_entry.first;
-                        uint32_t wildcard_code;
-                        
-                        auto it = main_encode_dict.find(wildcard_word);
-                        if (it != main_encode_dict.end()) {
-                            wildcard_code = it->second;
-                        } else {
-                            // Add to main dictionary if not present
-                            wildcard_code = main_decode_dict.size();
-                            main_decode_dict.push_back(wildcard_word);
-                            main_encode_dict[wildcard_word] = wildcard_code;
-                        }
-                        
-                        current->wildcard_codes[wildcard_code] = word_entry.second;
-                    }
-                    
-                    // Add to phrase dictionary
-                    PhraseInfo phrase_info;
-                    phrase_info.word_codes = word_codes;
-                    phrase_info.frequency = total_occurrences;
-                    phrase_info.has_wildcard = true;
-                    phrase_info.wildcard_pos = wildcard_pos;
-                    
-                    if (total_occurrences == 1) {
-                        non_repeated_phrases++;
+            // If pattern occurs frequently enough, add to phrase trie
+            if (pattern.count < MIN_PHRASE_FREQ) {
+                continue;
+            }
+            
+            // Convert words to word codes
+            vector<uint32_t> word_codes;
+            for (size_t i = 0; i < pattern.length; ++i) {
+                if (i != pattern.wildcard_pos) {
+                    // Get word code from main dictionary
+                    auto it = main_encode_dict.find(tokens[pattern.start + i]);
+                    if (it == main_encode_dict.end()) {
+                        break;
                     }
-                    
-                    phrase_decode_dict.push_back(phrase_info);
-                    current->phrase_id = phrase_decode_dict.size() - 1;
+                    word_codes.push_back(it->second);
+                } else {
+                    // For wildcards, add a placeholder code (will be replaced during tokenization)
+                    word_codes.push_back(UINT32_MAX); // Special value to indicate wildcard
+                }
+            }
+            
+            // Patterns around rare words would widen every main code
+            if (word_codes.size() != pattern.length) {
+                continue;
+            }
+            
+            // Add the phrase pattern to trie
+            PhraseNode* current = phrase_trie_root;
+            
+            for (size_t i = 0; i < pattern.length; ++i) {
+                if (i == pattern.wildcard_pos) {
+                    // The wildcard gets its own edge so any word can fill it
+                    current = trie_wildcard_child(current);
+                } else {
+                    current = trie_child(current, tokens[pattern.start + i]);
+                }
+            }
+            
+            // Mark wildcard information
+            current->has_wildcard = true;
+            current->wildcard_pos = pattern.wildcard_pos;
+            current->is_end = true;
+            current->frequency = pattern.count;
+            
+            // Every word seen as a filler gets a main code, numbers aside.
+            // Later patterns may then use these words as fixed words.
+            while (next_filler < fillers.size() && (fillers[next_filler] >> 32) < p) {
+                next_filler++;
+            }
+            for (; next_filler < fillers.size() && (fillers[next_filler] >> 32) == p; ++next_filler) {
+                const string& filler = tokens[static_cast<uint32_t>(fillers[next_filler])];
+                if (!is_number(filler) && main_encode_dict.find(filler) == main_encode_dict.end()) {
+                    main_encode_dict[filler] = main_decode_dict.size();
+                    main_decode_dict.push_back(filler);
                 }
             }
+            
+            // Add to phrase dictionary
+            PhraseInfo phrase_info;
+            phrase_info.word_codes = word_codes;
+            phrase_info.frequency = pattern.count;
+            phrase_info.has_wildcard = true;
+            phrase_info.wildcard_pos = pattern.wildcard_pos;
+            
+            if (pattern.count == 1) {
+                non_repeated_phrases++;
+            }
+            
+            phrase_decode_dict.push_back(phrase_info);
+            current->phrase_id = phrase_decode_dict.size() - 1;
         }
     }
     
     // Find and add regular phrases to trie
     void find_regular_phrases(const vector<string>& tokens) {
-        // Count ngram frequencies
-        unordered_map<string, uint32_t> ngram_freqs;
+        // Count ngram frequencies. An ngram is keyed by the IDs of its words;
+        // the key text is scratch data in its own arena, dropped in one go.
+        struct NgramCount {
+            uint32_t start;   // First occurrence
+            uint32_t length;
+            uint32_t count;
+        };
+        vector<uint32_t> ids = first_occurrence_ids(tokens);
+        Arena scratch(1 << 20);
+        FlatHashMap<string_view, uint32_t> ngram_index;
+        vector<NgramCount> ngram_freqs;
+        string ngram;
         
         // Minimum frequency for phrase consideration
         const uint32_t MIN_PHRASE_FREQ = 2;
         
-        // Build ngrams and count frequencies
-        auto ngrams = build_ngrams(tokens, 2, 5);  // 2-5 word phrases
-        
-        for (const auto& ngram : ngrams) {
-            string ngram_str;
-            for (size_t i = 0; i < ngram.size(); ++i) {
-                ngram_str += ngram[i];
-                if (i < ngram.size() - 1) ngram_str += " ";
+        // Extend the ngram at each position one word at a time and count
+        // every length from 2 words up. Numbers never get a main code, so
+        // an ngram stops short of them.
+        vector<bool> numeric(tokens.size());
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            numeric[i] = is_number(tokens[i]);
+        }
+        size_t max_size = settings.max_phrase_length;
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            if (numeric[i]) {
+                continue;
+            }
+            ngram.clear();
+            append_id(ngram, ids[i]);
+            for (size_t size = 2; size <= max_size && i + size <= tokens.size() && !numeric[i + size - 1]; ++size) {
+                append_id(ngram, ids[i + size - 1]);
+                auto it = ngram_index.find(ngram);
+                if (it != ngram_index.end()) {
+                    ngram_freqs[it->second].count++;
+                } else {
+                    ngram_index.emplace(scratch.copy_string(ngram), ngram_freqs.size());
+                    ngram_freqs.push_back({static_cast<uint32_t>(i), static_cast<uint32_t>(size), 1});
+                }
             }
-            ngram_freqs[ngram_str]++;
         }
         
-        // Add frequent ngrams to phrase dictionary
+        // Add frequent ngrams to phrase dictionary, in order of first appearance
         for (const auto& entry : ngram_freqs) {
-            if (entry.second >= MIN_PHRASE_FREQ || (entry.second == 1 && ngram_freqs.size() < 1000)) {
-                // Parse ngram string back to vector of words
-                vector<string> phrase_words;
-                stringstream ss(entry.first);
-                string word;
-                
-                while (ss >> word) {
-                    phrase_words.push_back(word);
-                }
-                
-                // Convert words to word codes
+            if (entry.count >= MIN_PHRASE_FREQ || (entry.count == 1 && ngram_freqs.size() < 1000)) {
+                // Convert words to word codes and add the phrase to trie
                 vector<uint32_t> word_codes;
-                for (const string& word : phrase_words) {
+                PhraseNode* current = phrase_trie_root;
+                for (size_t i = entry.start; i < entry.start + entry.length; ++i) {
+                    const string& word = tokens[i];
+                    
                     // Get word code from main dictionary
                     auto it = main_encode_dict.find(word);
                     if (it != main_encode_dict.end()) {
@@ -413,30 +723,20 @@ private:
                         main_encode_dict[word] = new_code;
                         word_codes.push_back(new_code);
                     }
-                }
-                
-                // Add the phrase to trie
-                shared_ptr<PhraseNode> current = phrase_trie_root;
-                
-                for (const string& next_word : phrase_words) {
-                    if (current->children.find(next_word) == current->children.end()) {
-                        current->children[next_word] = make_shared<PhraseNode>();
-                    }
                     
-                    current = current->children[next_word];
+                    current = trie_child(current, word);
                 }
                 
                 // Mark as end of phrase
                 current->is_end = true;
-                current->frequency = entry.second;
-                current->word_codes = word_codes;
+                current->frequency = entry.count;
                 
                 // Add to phrase dictionary
                 PhraseInfo phrase_info;
                 phrase_info.word_codes = word_codes;
-                phrase_info.frequency = entry.second;
+                phrase_info.frequency = entry.count;
                 
-                if (entry.second == 1) {
+                if (entry.count == 1) {
                     non_repeated_phrases++;
                 }
                 
@@ -446,52 +746,114 @@ private:
         }
     }
     
-    // Process tokens with phrase recognition
-    vector<Token> process_with_phrases(const vector<string>& raw_tokens) {
+    // A phrase matching the tokens at some position
+    struct PhraseCandidate {
+        PhraseNode* node;
+        size_t length;
+    };
+    
+    // A live trie path while matching, and whether it crossed a wildcard edge
+    struct TrieState {
+        PhraseNode* node;
+        bool used_wildcard;
+    };
+    
+    // Reused between lookups so that matching does not allocate
+    vector<TrieState> trie_states;
+    vector<TrieState> trie_next_states;
+    
+    // Collect every phrase that matches at position i within limit tokens,
+    // shortest first. Every pattern has at most one wildcard, so at most one
+    // trie path per wildcard offset is live.
+    void find_phrase_candidates(const vector<string>& raw_tokens, size_t i, size_t limit,
+                                vector<PhraseCandidate>& candidates) {
+        vector<TrieState>& states = trie_states;
+        vector<TrieState>& next_states = trie_next_states;
+        states.assign(1, {phrase_trie_root, false});
+        candidates.clear();
+        stats.trie_lookups++;
+        
+        for (size_t j = 0; j < limit && i + j < raw_tokens.size() && !states.empty(); ++j) {
+            const string& token = raw_tokens[i + j];
+            next_states.clear();
+            
+            for (const auto& state : states) {
+                auto it = state.node->children.find(token);
+                if (it != state.node->children.end()) {
+                    next_states.push_back({it->second, state.used_wildcard});
+                }
+                if (!state.used_wildcard && state.node->wildcard_child) {
+                    next_states.push_back({state.node->wildcard_child, true});
+                }
+            }
+            
+            stats.trie_nodes_visited += next_states.size();
+            for (const auto& state : next_states) {
+                if (state.node->is_end && state.node->has_wildcard == state.used_wildcard) {
+                    candidates.push_back({state.node, j + 1});
+                }
+            }
+            
+            states.swap(next_states);
+        }
+    }
+    
+    // Append the tokens for one phrase occurrence at position i
+    void emit_phrase(const vector<string>& raw_tokens, size_t i, const PhraseNode* node,
+                     vector<Token>& processed_tokens) const {
+        processed_tokens.push_back(Token(PHRASE, "", node->phrase_id));
+        if (node->has_wildcard) {
+            // Wildcard word travels as a separate token right after its phrase
+            processed_tokens.push_back(Token(WILDCARD, raw_tokens[i + node->wildcard_pos], node->phrase_id));
+        }
+    }
+    
+    static Token match_token(const TokenMatch& match) {
+        Token token(MATCH, "");
+        token.distance = match.distance;
+        token.length = match.length;
+        return token;
+    }
+    
+    // Process tokens with phrase recognition: greedy longest match, or a
+    // minimum-cost parse when the level asks for it
+    vector<Token> process_with_phrases(const vector<string>& raw_tokens,
+                                       const vector<TokenMatch>& matches = {}) {
+        if (settings.optimal_parse) {
+            return process_with_phrases_optimal(raw_tokens, matches);
+        }
+        
         vector<Token> processed_tokens;
+        processed_tokens.reserve(raw_tokens.size());
+        vector<PhraseCandidate> candidates;
         size_t i = 0;
+        size_t next_match = 0;
         
         while (i < raw_tokens.size()) {
-            // Try to match a phrase starting at position i
-            shared_ptr<PhraseNode> current = phrase_trie_root;
-            shared_ptr<PhraseNode> last_match = nullptr;
-            size_t match_length = 0;
-            size_t wildcard_pos = 0;
-            string wildcard_word;
-            
-            for (size_t j = 0; j < 5 && i + j < raw_tokens.size(); ++j) {
-                const string& token = raw_tokens[i + j];
-                
-                if (current->children.find(token) != current->children.end()) {
-                    current = current->children[token];
-                    
-                    if (current->is_end) {
-                        last_match = current;
-                        match_length = j + 1;
-                        
-                        // Check for wildcard
-                        if (current->has_wildcard && i + current->wildcard_pos < raw_tokens.size()) {
-                            wildcard_pos = current->wildcard_pos;
-                            wildcard_word = raw_tokens[i + wildcard_pos];
-                        }
-                    }
-                } else {
-                    break;
-                }
+            // Long-range matches take precedence over phrases
+            if (next_match < matches.size() && matches[next_match].position == i) {
+                processed_tokens.push_back(match_token(matches[next_match]));
+                i += matches[next_match].length;
+                next_match++;
+                continue;
+            }
+            size_t limit = settings.max_phrase_length;
+            if (next_match < matches.size()) {
+                limit = min<size_t>(limit, matches[next_match].position - i);
             }
             
-            // If we found a phrase match
-            if (last_match != nullptr) {
-                if (last_match->has_wildcard) {
-                    // Add phrase token with separate wildcard token
-                    processed_tokens.push_back(Token(PHRASE, "", last_match->phrase_id));
-                    processed_tokens.push_back(Token(WILDCARD, wildcard_word, last_match->phrase_id));
-                } else {
-                    // Add regular phrase token
-                    processed_tokens.push_back(Token(PHRASE, "", last_match->phrase_id));
+            // Take the longest phrase starting at position i
+            find_phrase_candidates(raw_tokens, i, limit, candidates);
+            const PhraseCandidate* best = nullptr;
+            for (const auto& candidate : candidates) {
+                if (best == nullptr || candidate.length > best->length) {
+                    best = &candidate;
                 }
-                
-                i += match_length;
+            }
+            
+            if (best != nullptr) {
+                emit_phrase(raw_tokens, i, best->node, processed_tokens);
+                i += best->length;
             } else {
                 // No phrase match, add as regular word
                 processed_tokens.push_back(Token(WORD, raw_tokens[i]));
@@ -502,34 +864,305 @@ private:
         return processed_tokens;
     }
     
-    // Load dictionary words from file (just the list of words)
-    vector<string> load_dictionary_words(const string& dict_file) {
-        ifstream infile(dict_file);
-        if (!infile) {
-            cerr << "Error opening dictionary file: " << dict_file << endl;
-            return {};
+    // Minimum-bit parse under the fixed-width code model. Dynamic programming
+    // from the end of the input tries a single word and every matching phrase
+    // at each position; long-range matches stay fixed as in the greedy parse.
+    vector<Token> process_with_phrases_optimal(const vector<string>& raw_tokens,
+                                               const vector<TokenMatch>& matches) {
+        const uint64_t UNREACHABLE = UINT64_MAX;
+        size_t n = raw_tokens.size();
+        
+        // The local dictionary does not exist yet; estimate its code width
+        // from the distinct words outside the main dictionary
+        FlatHashMap<string_view, uint32_t> rare_words;
+        for (const auto& token : raw_tokens) {
+            uint32_t code;
+            if (!find_main_code(token, code) && !is_number(token)) {
+                rare_words.emplace(token, 0);
+            }
         }
+        uint64_t main_word_bits = 1 + main_max_bit_length;
+        uint64_t local_word_bits = 2 + bits_needed(rare_words.size() + 1);
+        uint64_t phrase_bits = 2 + phrase_max_bit_length;
         
-        vector<string> dict_words;
-        string word;
+        auto word_bits = [&](const string& word) {
+            uint32_t code;
+            return find_main_code(word, code) ? main_word_bits : local_word_bits;
+        };
+        auto filler_bits = [&](const PhraseInfo& phrase, const string& word) {
+            uint32_t code;
+            if (find_main_code(word, code) &&
+                find(phrase.filler_codes.begin(), phrase.filler_codes.end(), code) != phrase.filler_codes.end()) {
+                return static_cast<uint64_t>(phrase.filler_bit_length);
+            }
+            return phrase.filler_bit_length + word_bits(word) - 1;
+        };
+        auto gamma_bits = [](uint32_t value) {
+            return static_cast<uint64_t>(2 * bits_needed(static_cast<size_t>(value) + 1) - 1);
+        };
         
-        while (getline(infile, word)) {
-            if (!word.empty()) {
-                // Convert to lowercase for consistency
-                transform(word.begin(), word.end(), word.begin(), ::tolower);
-                dict_words.push_back(word);
+        vector<int32_t> match_at(n, -1);
+        vector<bool> covered(n, false);
+        for (size_t m = 0; m < matches.size(); ++m) {
+            match_at[matches[m].position] = m;
+            for (uint32_t k = 1; k < matches[m].length; ++k) {
+                covered[matches[m].position + k] = true;
             }
         }
         
-        return dict_words;
-    }
-    
-    // Load main dictionary and phrase dictionary for decompression
-    bool load_dictionaries(const string& dict_file) {
-        ifstream infile(dict_file);
-        if (!infile) {
-            cerr << "Error opening dictionary file: " << dict_file << endl;
-            return false;
+        vector<uint64_t> cost(n + 1, UNREACHABLE);
+        vector<PhraseNode*> choice(n, nullptr);
+        vector<uint32_t> choice_length(n, 1);
+        vector<PhraseCandidate> candidates;
+        cost[n] = 0;
+        size_t next_match_start = n;
+        
+        for (size_t i = n; i-- > 0;) {
+            if (match_at[i] >= 0) {
+                const TokenMatch& match = matches[match_at[i]];
+                cost[i] = phrase_bits + gamma_bits(match.distance) +
+                          gamma_bits(match.length - MIN_MATCH_LENGTH + 1) + cost[i + match.length];
+                choice_length[i] = match.length;
+                next_match_start = i;
+                continue;
+            }
+            if (covered[i]) {
+                continue;
+            }
+            
+            cost[i] = word_bits(raw_tokens[i]) + cost[i + 1];
+            
+            size_t limit = min<size_t>(settings.max_phrase_length, next_match_start - i);
+            find_phrase_candidates(raw_tokens, i, limit, candidates);
+            for (const auto& candidate : candidates) {
+                if (cost[i + candidate.length] == UNREACHABLE) {
+                    continue;
+                }
+                uint64_t total = phrase_bits + cost[i + candidate.length];
+                if (candidate.node->has_wildcard) {
+                    total += filler_bits(phrase_decode_dict[candidate.node->phrase_id],
+                                         raw_tokens[i + candidate.node->wildcard_pos]);
+                }
+                if (total < cost[i]) {
+                    cost[i] = total;
+                    choice[i] = candidate.node;
+                    choice_length[i] = candidate.length;
+                }
+            }
+        }
+        
+        // Walk the chosen path forward
+        vector<Token> processed_tokens;
+        processed_tokens.reserve(n);
+        for (size_t i = 0; i < n; i += choice_length[i]) {
+            if (match_at[i] >= 0) {
+                processed_tokens.push_back(match_token(matches[match_at[i]]));
+            } else if (choice[i] != nullptr) {
+                emit_phrase(raw_tokens, i, choice[i], processed_tokens);
+            } else {
+                processed_tokens.push_back(Token(WORD, raw_tokens[i]));
+            }
+        }
+        
+        return processed_tokens;
+    }
+    
+    // Drop the whole trie at once and start an empty one
+    void reset_phrase_trie() {
+        trie_arena.reset();
+        phrase_trie_root = trie_arena.make<PhraseNode>(trie_arena.get());
+    }
+    
+    // Child of node for word, created if missing
+    PhraseNode* trie_child(PhraseNode* node, string_view word) {
+        auto it = node->children.find(word);
+        if (it != node->children.end()) {
+            return it->second;
+        }
+        PhraseNode* child = trie_arena.make<PhraseNode>(trie_arena.get());
+        node->children.emplace(trie_arena.copy_string(word), child);
+        return child;
+    }
+    
+    PhraseNode* trie_wildcard_child(PhraseNode* node) {
+        if (!node->wildcard_child) {
+            node->wildcard_child = trie_arena.make<PhraseNode>(trie_arena.get());
+        }
+        return node->wildcard_child;
+    }
+    
+    // Rebuild the phrase trie from phrase_decode_dict
+    void rebuild_phrase_trie() {
+        StageTimer::Scope stage(stats.timer, "trie_build");
+        reset_phrase_trie();
+        
+        for (uint32_t id = 0; id < phrase_decode_dict.size(); ++id) {
+            const auto& phrase = phrase_decode_dict[id];
+            PhraseNode* current = phrase_trie_root;
+            
+            for (size_t i = 0; i < phrase.word_codes.size(); ++i) {
+                if (phrase.has_wildcard && i == phrase.wildcard_pos) {
+                    current = trie_wildcard_child(current);
+                } else {
+                    current = trie_child(current, main_decode_dict[phrase.word_codes[i]]);
+                }
+            }
+            
+            current->is_end = true;
+            current->has_wildcard = phrase.has_wildcard;
+            current->wildcard_pos = phrase.wildcard_pos;
+            current->frequency = phrase.frequency;
+            current->phrase_id = id;
+        }
+        stats.trie_phrases_built += phrase_decode_dict.size();
+    }
+    
+    // Mining keeps every repeated n-gram, but most never survive greedy
+    // parsing. Parse, count actual uses, drop phrases whose uses do not pay
+    // for their dictionary entry, renumber the rest by use and parse again,
+    // until nothing is dropped. Returns the parse of the final dictionary.
+    vector<Token> compact_phrase_dictionary(const vector<string>& raw_tokens,
+                                            const vector<TokenMatch>& matches) {
+        const int MAX_COMPACTION_ROUNDS = 8;
+        vector<Token> parsed = process_with_phrases(raw_tokens, matches);
+        
+        for (int round = 1; round <= MAX_COMPACTION_ROUNDS; ++round) {
+            vector<uint32_t> uses(phrase_decode_dict.size(), 0);
+            for (const auto& token : parsed) {
+                if (token.type == PHRASE) {
+                    uses[token.phrase_id]++;
+                }
+            }
+            
+            // Each use replaces the fixed words' codes with one phrase code;
+            // the entry itself costs one main code per word
+            vector<uint32_t> kept;
+            for (uint32_t id = 0; id < phrase_decode_dict.size(); ++id) {
+                const auto& phrase = phrase_decode_dict[id];
+                int64_t fixed_words = phrase.word_codes.size() - (phrase.has_wildcard ? 1 : 0);
+                int64_t saving_per_use = fixed_words * (1 + main_max_bit_length) - (2 + phrase_max_bit_length);
+                int64_t entry_bits = static_cast<int64_t>(phrase.word_codes.size()) * main_max_bit_length;
+                
+                if (uses[id] > 0 && uses[id] * saving_per_use > entry_bits) {
+                    kept.push_back(id);
+                }
+            }
+            
+            // Most used phrases get the smallest IDs
+            stable_sort(kept.begin(), kept.end(),
+                        [&uses](uint32_t a, uint32_t b) { return uses[a] > uses[b]; });
+            
+            bool dropped = kept.size() < phrase_decode_dict.size();
+            cout << "Compaction round " << round << ": kept " << kept.size()
+                 << " of " << phrase_decode_dict.size() << " phrases" << endl;
+            
+            vector<PhraseInfo> compacted;
+            vector<uint32_t> new_id(phrase_decode_dict.size(), UINT32_MAX);
+            non_repeated_phrases = 0;
+            for (uint32_t id : kept) {
+                new_id[id] = compacted.size();
+                compacted.push_back(phrase_decode_dict[id]);
+                compacted.back().frequency = uses[id];
+                if (uses[id] == 1) {
+                    non_repeated_phrases++;
+                }
+            }
+            
+            phrase_decode_dict.swap(compacted);
+            rebuild_phrase_trie();
+            phrase_max_bit_length = bits_needed(phrase_decode_dict.size() + 1);
+            
+            // Fixed point: the parse is unchanged apart from the new numbering
+            if (!dropped) {
+                for (auto& token : parsed) {
+                    if (token.type == PHRASE || token.type == WILDCARD) {
+                        token.phrase_id = new_id[token.phrase_id];
+                    }
+                }
+                return parsed;
+            }
+            
+            parsed = process_with_phrases(raw_tokens, matches);
+        }
+        
+        return parsed;
+    }
+    
+    // Give every wildcard phrase a table of its fillers ranked by use in the
+    // final parse. Fillers seen once stay out: an entry costs a main code in
+    // the dictionary and saves little on a single use.
+    void build_filler_tables(const vector<Token>& parsed) {
+        vector<FlatHashMap<uint32_t, uint32_t>> filler_counts(phrase_decode_dict.size());
+        
+        for (const auto& token : parsed) {
+            uint32_t code;
+            if (token.type == WILDCARD && find_main_code(token.word, code)) {
+                filler_counts[token.phrase_id][code]++;
+            }
+        }
+        
+        for (uint32_t id = 0; id < phrase_decode_dict.size(); ++id) {
+            auto& phrase = phrase_decode_dict[id];
+            if (!phrase.has_wildcard) {
+                continue;
+            }
+            
+            vector<pair<uint32_t, uint32_t>> ranked;
+            for (const auto& entry : filler_counts[id]) {
+                if (entry.second >= 2) {
+                    ranked.push_back({entry.second, entry.first});
+                }
+            }
+            sort(ranked.begin(), ranked.end(),
+                 [](const auto& a, const auto& b) { return a.first > b.first || (a.first == b.first && a.second < b.second); });
+            if (ranked.size() > MAX_FILLER_TABLE) {
+                ranked.resize(MAX_FILLER_TABLE);
+            }
+            
+            phrase.filler_codes.clear();
+            for (const auto& entry : ranked) {
+                phrase.filler_codes.push_back(entry.second);
+            }
+            phrase.filler_bit_length = bits_needed(phrase.filler_codes.size() + 1);
+        }
+    }
+    
+    // Load dictionary words from file (just the list of words)
+    vector<string> load_dictionary_words(const string& dict_file) {
+        ifstream infile(dict_file);
+        if (!infile) {
+            cerr << "Error opening dictionary file: " << dict_file << endl;
+            return {};
+        }
+        
+        vector<string> dict_words;
+        string word;
+        
+        // A trained dictionary lists its words right after the header line
+        uint64_t word_limit = UINT64_MAX;
+        if (is_trained_dictionary(dict_file)) {
+            infile >> word_limit;
+            getline(infile, word);
+        }
+        
+        while (dict_words.size() < word_limit && getline(infile, word)) {
+            if (!word.empty()) {
+                // Convert to lowercase for consistency
+                transform(word.begin(), word.end(), word.begin(), ::tolower);
+                dict_words.push_back(word);
+            }
+        }
+        
+        return dict_words;
+    }
+    
+    // Load main dictionary and phrase dictionary for decompression
+    bool load_dictionaries(const string& dict_file) {
+        StageTimer::Scope stage(stats.timer, "dictionary_load");
+        ifstream infile(dict_file);
+        if (!infile) {
+            cerr << "Error opening dictionary file: " << dict_file << endl;
+            return false;
         }
         
         // Read dictionary header
@@ -540,23 +1173,25 @@ private:
         string dummy;
         getline(infile, dummy);
         
-        // Read words
+        // Read words: view the word lines of the mapped file in place, or copy
+        // them word by word if the file cannot be mapped or has empty lines
         main_decode_dict.clear();
-        main_encode_dict.clear();
-        
-        for (uint32_t i = 0; i < word_count; ++i) {
-            string word;
-            getline(infile, word);
-            if (!word.empty()) {
-                main_decode_dict.push_back(word);
+        size_t words_end = 0;
+        if (infile && dictionary_file.open(dict_file) &&
+            main_decode_dict.view_lines(dictionary_file.data(), dictionary_file.size(),
+                                        static_cast<size_t>(infile.tellg()), word_count, words_end)) {
+            infile.seekg(words_end);
+        } else {
+            dictionary_file.close();
+            for (uint32_t i = 0; i < word_count; ++i) {
+                string word;
+                getline(infile, word);
+                if (!word.empty()) {
+                    main_decode_dict.push_back(word);
+                }
             }
         }
         
-        // Build encoding dictionary
-        for (uint32_t i = 0; i < main_decode_dict.size(); ++i) {
-            main_encode_dict[main_decode_dict[i]] = i;
-        }
-        
         // Calculate bits needed for main dictionary
         main_max_bit_length = 0;
         while ((1ULL << main_max_bit_length) < main_decode_dict.size()) {
@@ -595,20 +1230,87 @@ private:
                 phrase.word_codes.push_back(code);
             }
             
+            // Read filler table
+            if (phrase.has_wildcard) {
+                uint32_t filler_count = 0;
+                ss >> filler_count;
+                for (uint32_t j = 0; j < filler_count; ++j) {
+                    uint32_t code;
+                    ss >> code;
+                    phrase.filler_codes.push_back(code);
+                }
+                phrase.filler_bit_length = bits_needed(phrase.filler_codes.size() + 1);
+            }
+            
             phrase_decode_dict.push_back(phrase);
         }
         
-        // Calculate bits needed for phrase dictionary
+        // Pack the phrases, checking their codes once here instead of at
+        // every use
+        phrase_expansions.clear();
+        phrase_words.clear();
+        phrase_fillers.clear();
+        for (const auto& phrase : phrase_decode_dict) {
+            if (phrase.word_codes.size() >= PhraseExpansion::NO_WILDCARD ||
+                phrase.filler_codes.size() >= PhraseExpansion::NO_WILDCARD ||
+                (phrase.has_wildcard && phrase.wildcard_pos >= phrase.word_codes.size())) {
+                cerr << "Invalid phrase in dictionary: " << phrase_expansions.size() << endl;
+                return false;
+            }
+            PhraseExpansion expansion;
+            expansion.word_start = phrase_words.size();
+            expansion.filler_start = phrase_fillers.size();
+            expansion.word_count = phrase.word_codes.size();
+            expansion.filler_count = phrase.filler_codes.size();
+            expansion.wildcard_pos = phrase.has_wildcard ? phrase.wildcard_pos : PhraseExpansion::NO_WILDCARD;
+            expansion.filler_bit_length = phrase.filler_bit_length;
+            
+            for (size_t i = 0; i < phrase.word_codes.size(); ++i) {
+                bool wildcard = i == expansion.wildcard_pos;
+                if (!wildcard && phrase.word_codes[i] >= main_decode_dict.size()) {
+                    cerr << "Invalid word code in phrase: " << phrase.word_codes[i] << endl;
+                    return false;
+                }
+                phrase_words.push_back(wildcard ? 0 : phrase.word_codes[i]);
+            }
+            for (uint32_t code : phrase.filler_codes) {
+                if (code >= main_decode_dict.size()) {
+                    cerr << "Invalid filler code in phrase: " << code << endl;
+                    return false;
+                }
+                phrase_fillers.push_back(code);
+            }
+            phrase_expansions.push_back(expansion);
+        }
+        
+        // Calculate bits needed for phrase dictionary (one extra ID escapes matches)
         phrase_max_bit_length = 0;
-        while ((1ULL << phrase_max_bit_length) < phrase_decode_dict.size()) {
+        while ((1ULL << phrase_max_bit_length) < phrase_decode_dict.size() + 1) {
             phrase_max_bit_length++;
         }
         
+        // Use the stored word index if there is one and it still fits the
+        // words; dictionaries from before it existed get a new one
+        string section;
+        uint64_t seed = 0, pilot_count = 0;
+        vector<uint32_t> pilots;
+        if (infile >> section >> seed >> pilot_count && section == "perfect_hash") {
+            pilots.resize(pilot_count);
+            for (auto& pilot : pilots) {
+                infile >> pilot;
+            }
+        }
+        if (!infile || pilots.empty() || !main_index.assign(main_decode_dict, seed, move(pilots))) {
+            main_index.build(main_decode_dict);
+        }
+        main_encode_dict = FlatHashMap<string, uint32_t>();
+        
         return true;
     }
     
     // Write main dictionary and phrase dictionary to a file
     bool write_dictionaries(const string& dict_file) {
+        StageTimer::Scope stage(stats.timer, "dictionary_write");
         ofstream outfile(dict_file);
         if (!outfile) {
             cerr << "Error opening dictionary file for writing: " << dict_file << endl;
@@ -640,9 +1342,24 @@ private:
                 outfile << code << " ";
             }
             
+            // Write filler table
+            if (phrase.has_wildcard) {
+                outfile << phrase.filler_codes.size() << " ";
+                for (uint32_t code : phrase.filler_codes) {
+                    outfile << code << " ";
+                }
+            }
+            
             outfile << endl;
         }
         
+        // Write the perfect hash of the words
+        outfile << "perfect_hash " << main_index.get_seed() << " " << main_index.get_pilots().size() << endl;
+        for (uint32_t pilot : main_index.get_pilots()) {
+            outfile << pilot << " ";
+        }
+        outfile << endl;
+        
         return true;
     }
     
@@ -651,77 +1368,110 @@ private:
         local_decode_dict.clear();
         local_encode_dict.clear();
         
+        // Build both directions in one pass, in order of first appearance
         for (const auto& word : rare_words) {
-            if (find(local_decode_dict.begin(), local_decode_dict.end(), word) == local_decode_dict.end()) {
+            if (local_encode_dict.find(word) == local_encode_dict.end()) {
+                local_encode_dict[word] = local_decode_dict.size();
                 local_decode_dict.push_back(word);
             }
         }
         
-        // Build encoding dictionary
-        for (uint32_t i = 0; i < local_decode_dict.size(); ++i) {
-            local_encode_dict[local_decode_dict[i]] = i;
-        }
-        
-        // Calculate bits needed for local dictionary
+        // Calculate bits needed for local dictionary and the number code after it
         local_max_bit_length = 0;
-        while ((1ULL << local_max_bit_length) < local_decode_dict.size()) {
+        while ((1ULL << local_max_bit_length) < local_decode_dict.size() + 1) {
             local_max_bit_length++;
         }
     }
-public:
-    TwoTierTextCompressor() {
-        // Initialize phrase trie root
-        phrase_trie_root = make_shared<PhraseNode>();
-        non_repeated_phrases = 0;
+    static uint64_t file_size(const string& file) {
+        ifstream stream(file, ios::binary | ios::ate);
+        return stream ? static_cast<uint64_t>(stream.tellg()) : 0;
     }
     
-    // Print statistics about phrases
-    void print_phrase_stats() const {
-        cout << "\nPhrase Statistics:" << endl;
-        cout << "-----------------" << endl;
-        cout << "Total phrases found: " << phrase_decode_dict.size() << endl;
-        cout << "Non-repeated phrases: " << non_repeated_phrases << endl;
-        
-        uint32_t wildcard_phrases = 0;
-        uint32_t regular_phrases = 0;
+    static string json_string(const string& value) {
+        string quoted = "\"";
+        for (char c : value) {
+            if (c == '"' || c == '\\') quoted += '\\';
+            quoted += c;
+        }
+        return quoted + "\"";
+    }
+    
+    // {"stage":{"seconds":s,"mb_per_s":r},...,"total":{...}}
+    static void write_stage_json(ostream& out, const StageTimer& stage_timer, double input_mb) {
+        auto write_stage = [&](const string& name, uint64_t nanoseconds) {
+            double seconds = nanoseconds / 1e9;
+            out << json_string(name) << ":{\"seconds\":" << seconds
+                << ",\"mb_per_s\":" << (seconds > 0 ? input_mb / seconds : 0.0) << "}";
+        };
         
-        for (const auto& phrase : phrase_decode_dict) {
-            if (phrase.has_wildcard) {
-                wildcard_phrases++;
-            } else {
-                regular_phrases++;
+        out << "{";
+        for (const auto& stage : stage_timer.get_stages()) {
+            write_stage(stage.name, stage.nanoseconds);
+            out << ",";
+        }
+        write_stage("total", stage_timer.total_nanoseconds());
+        out << "}";
+    }
+    
+    // Every main word is found with one read of the perfect hash table
+    void count_dictionary_probes() {
+        CompressionStats::add(stats.dictionary_probes, 1, main_index.size());
+    }
+    
+    // Main code of word; false if it is not a main word. Short words are
+    // settled by the index alone, longer ones by comparing the word.
+    bool find_main_code(const string& word, uint32_t& code) const {
+        code = main_index.find(word);
+        return code != PerfectHash::NOT_FOUND &&
+               (word.size() <= PerfectHash::INLINE_BYTES || main_decode_dict[code] == word);
+    }
+    
+    static bool is_number(const string& token) {
+        if (token.empty() || token.size() > MAX_NUMBER_DIGITS) {
+            return false;
+        }
+        for (char c : token) {
+            if (c < '0' || c > '9') {
+                return false;
             }
         }
-        
-        cout << "Regular phrases: " << regular_phrases << endl;
-        cout << "Wildcard phrases: " << wildcard_phrases << endl;
-        
-        // Print top phrases by frequency
-        cout << "\nTop 10 phrases by frequency:" << endl;
-        vector<pair<uint32_t, size_t>> sorted_phrases;
-        for (size_t i = 0; i < phrase_decode_dict.size(); ++i) {
-            sorted_phrases.push_back({phrase_decode_dict[i].frequency, i});
+        return true;
+    }
+    
+    // Local code of a word that is not a main word; false if it has none.
+    // Numbers share the code one past the local dictionary.
+    bool find_local_code(const string& word, uint32_t& code) const {
+        if (is_number(word)) {
+            code = local_decode_dict.size();
+            return true;
         }
-        
-        sort(sorted_phrases.begin(), sorted_phrases.end(), 
-                 [](const auto& a, const auto& b) { return a.first > b.first; });
-        
-        size_t count = min(size_t(10), sorted_phrases.size());
-        for (size_t i = 0; i < count; ++i) {
-            const auto& phrase = phrase_decode_dict[sorted_phrases[i].second];
-            cout << setw(5) << phrase.frequency << " | " 
-                      << phrase.to_string(main_decode_dict) << endl;
+        auto local_it = local_encode_dict.find(word);
+        if (local_it == local_encode_dict.end()) {
+            return false;
         }
+        code = local_it->second;
+        return true;
     }
     
-    // Compression method
-    bool compress(const string& dict_file, 
-                  const string& input_file, 
-                  const string& output_file) {
-        // Reset phrase structures
-        phrase_trie_root = make_shared<PhraseNode>();
-        phrase_decode_dict.clear();
-        non_repeated_phrases = 0;
+    // The main dictionary is final: index it with a perfect hash and drop the
+    // map it was built in
+    void freeze_main_dictionary() {
+        StageTimer::Scope stage(stats.timer, "main_index");
+        main_index.build(main_decode_dict);
+        main_encode_dict = FlatHashMap<string, uint32_t>();
+    }
+    
+    // Number of bits needed to address count entries
+    static uint8_t bits_needed(size_t count) {
+        uint8_t bits = 0;
+        while ((1ULL << bits) < count) {
+            bits++;
+        }
+        return bits;
+    }
+    
+    bool read_input_tokens(const string& input_file, vector<string>& raw_tokens) {
+        StageTimer::Scope stage(stats.timer, "tokenize");
         
         // Step 1: Read input file
         ifstream infile(input_file);
@@ -734,14 +1484,46 @@ public:
         infile.close();
         
         // Step 2: Tokenize input text
-        auto raw_tokens = tokenize_raw(text);
+        raw_tokens = tokenize_raw(text, settings.lossless ? &text_forms : nullptr);
+        return true;
+    }
+    
+    // A trained dictionary (eng.dict from an earlier run) starts with
+    // "<word count> <phrase count>"; a plain word list has one word per line
+    static bool is_trained_dictionary(const string& dict_file) {
+        ifstream infile(dict_file);
+        string line;
+        if (!getline(infile, line)) {
+            return false;
+        }
         
+        stringstream ss(line);
+        uint64_t word_count, phrase_count;
+        string rest;
+        return (ss >> word_count >> phrase_count) && !(ss >> rest);
+    }
+    
+    // Steps shared by every compression mode: read and tokenize the input,
+    // count word frequencies and build the frequency-ordered main dictionary
+    bool prepare_input(const string& dict_file, const string& input_file, vector<string>& raw_tokens) {
+        // Steps 1-2: Read and tokenize input file
+        return read_input_tokens(input_file, raw_tokens) && build_main_dictionary(dict_file, raw_tokens);
+    }
+    
+    // Steps 3-5: Order the words of the word list by their frequency in the
+    // tokens and build the main dictionary of them
+    bool build_main_dictionary(const string& dict_file, const vector<string>& raw_tokens) {
         // Step 3: Calculate word frequencies
-        word_frequencies.clear();
-        for (const auto& token : raw_tokens) {
-            word_frequencies[token]++;
+        {
+            StageTimer::Scope stage(stats.timer, "frequency_count");
+            word_frequencies.clear();
+            for (const auto& token : raw_tokens) {
+                word_frequencies[token]++;
+            }
         }
         
+        StageTimer::Scope stage(stats.timer, "main_dictionary");
+        
         // Step 4: Load dictionary word list
         auto dict_words = load_dictionary_words(dict_file);
         if (dict_words.empty()) {
@@ -749,9 +1531,13 @@ public:
             return false;
         }
         
-        // Step 5: Build frequency-ordered main dictionary from dict_words
+        // Step 5: Build frequency-ordered main dictionary from dict_words;
+        // numbers code their value instead
         vector<WordFreq> word_freq_list;
         for (const auto& word : dict_words) {
+            if (is_number(word)) {
+                continue;
+            }
             // If word appears in input, use its actual frequency; otherwise use 1
             uint32_t freq = 1; // Default frequency
             auto it = word_frequencies.find(word);
@@ -769,6 +1555,7 @@ public:
         
         // Build main dictionary
         main_decode_dict.clear();
+        dictionary_file.close();
         main_encode_dict.clear();
         
         for (const auto& wf : word_freq_list) {
@@ -782,307 +1569,4666 @@ public:
         
         // Calculate bits needed for main dictionary
         main_max_bit_length = 0;
-
         while ((1ULL << main_max_bit_length) < main_decode_dict.size()) {
             main_max_bit_length++;
         }
         
-        // Step 6: Find phrases with wildcards
-        find_wildcard_phrases(raw_tokens);
-        
-        // Step 7: Find regular phrases
-        find_regular_phrases(raw_tokens);
-        
-        // Print phrase statistics
-        print_phrase_stats();
-        
-        // Step 8: Process tokens with phrase recognition
-        auto processed_tokens = process_with_phrases(raw_tokens);
+        return true;
+    }
+    
+    // Local dictionary travels inside the compressed file. Word lengths are
+    // gamma coded, so they have no upper bound but must not be 0.
+    bool write_local_dictionary(BitWriter& writer) const {
+        // Write local dictionary size
+        writer.write_bits(local_decode_dict.size(), 32);
         
-        // Step 9: Collect rare words (words not in the main dictionary)
-        vector<string> rare_words;
-        for (const auto& token : processed_tokens) {
-            if (token.type == WORD && main_encode_dict.find(token.word) == main_encode_dict.end()) {
-                rare_words.push_back(token.word);
+        for (const auto& word : local_decode_dict) {
+            if (word.empty() || word.size() > UINT32_MAX) {
+                cerr << "Local dictionary word of unsupported length: " << word.size() << endl;
+                return false;
+            }
+            writer.write_gamma(word.size());
+            for (char c : word) {
+                writer.write_bits(static_cast<uint8_t>(c), 8);
             }
         }
-        
-        // Step 10: Build local dictionary for rare words
-        build_local_dictionary(rare_words);
-        
-        // Step 11: Write dictionaries to file
-        if (!write_dictionaries("eng.dict")) {
-            cerr << "Failed to write dictionaries to file: eng.dict" << endl;
+        return true;
+    }
+    
+    // False if the data ends before the count or before the words it
+    // counts, as in a truncated file or a damaged segment table
+    bool read_local_dictionary(BitReader& reader, vector<string>& words) const {
+        words.clear();
+        if (reader.bits_left() < 32) {
+            cerr << "Compressed data ends before the local dictionary" << endl;
             return false;
         }
+        uint32_t local_dict_size = reader.read_bits(32);
         
-        // Step 12: Write compressed data
-        BitWriter writer;
-        
-        // Write local dictionary size
-        writer.write_bits(local_decode_dict.size(), 16);
-        
-        // Write local dictionary
-        for (const auto& word : local_decode_dict) {
-            writer.write_bits(word.size(), 8);  // Word length (up to 255 chars)
-            for (char c : word) {
-                writer.write_bits(static_cast<uint8_t>(c), 8);
+        for (uint32_t i = 0; i < local_dict_size; ++i) {
+            uint32_t word_len = reader.has_more() ? reader.read_gamma() : 0;
+            if (word_len == 0 || reader.bits_left() < static_cast<uint64_t>(word_len) * 8) {
+                cerr << "Compressed data ends inside the local dictionary" << endl;
+                return false;
             }
+            string word(word_len, ' ');
+            for (uint32_t j = 0; j < word_len; ++j) {
+                word[j] = static_cast<char>(reader.read_bits(8));
+            }
+            words.push_back(word);
         }
         
-        // Process tokens and write compressed data
-        for (size_t i = 0; i < processed_tokens.size(); ++i) {
-            const auto& token = processed_tokens[i];
-            
-            if (token.type == WORD) {
-                // Check if word is in main dictionary
-                auto it = main_encode_dict.find(token.word);
-                if (it != main_encode_dict.end()) {
-                    // Word in main dictionary
-                    writer.write_bits(0, 1);  // Type bit: 0 = main dictionary word
-                    writer.write_bits(it->second, main_max_bit_length);
-                } else {
-                    // Word in local dictionary
-                    auto local_it = local_encode_dict.find(token.word);
-                    if (local_it != local_encode_dict.end()) {
-                        writer.write_bits(1, 1);  // Type bit: 1 = local dictionary word
-                        writer.write_bits(local_it->second, local_max_bit_length);
-                    } else {
-                        cerr << "Error: Word not found in either dictionary: " << token.word << endl;
-                        return false;
-                    }
+        return true;
+    }
+    
+    // Width of the next code of an adaptive stream
+    static uint8_t adaptive_code_bits(const AdaptiveDictionary& dictionary) {
+        return bits_needed(static_cast<size_t>(dictionary.size()) + ADAPTIVE_CODE_BASE);
+    }
+    
+    // Adaptive decoding: grow the dictionary as the encoder did, code by
+    // code, and write the words of each code as it is read
+    bool decompress_adaptive(BitReader& reader, ofstream& outfile) {
+        StageTimer::Scope stage(stats.timer, "bit_decode");
+        uint32_t phrase_bits = reader.read_bits(5);
+        if (phrase_bits == 0 || phrase_bits > 24) {
+            cerr << "Invalid adaptive stream header" << endl;
+            return false;
+        }
+        AdaptiveDictionary dictionary(1u << phrase_bits);
+        vector<string> words;
+        vector<uint32_t> phrase;
+        TextSink sink(outfile);
+        bool words_before = false;
+        uint32_t previous = AdaptiveDictionary::NONE;
+        while (true) {
+            if (!reader.has_more()) {
+                cerr << "Adaptive stream ends without an end code" << endl;
+                return false;
+            }
+            uint32_t value = reader.read_bits(adaptive_code_bits(dictionary));
+            if (value == ADAPTIVE_END) {
+                break;
+            }
+            uint32_t code;
+            if (value == ADAPTIVE_NEW_WORD) {
+                uint32_t length = reader.read_gamma();
+                string word;
+                for (uint32_t i = 0; i < length; ++i) {
+                    if (!reader.has_more()) {
+                        cerr << "Adaptive stream ends inside a word" << endl;
+                        return false;
+                    }
+                    word.push_back(static_cast<char>(reader.read_bits(8)));
+                }
+                words.push_back(move(word));
+                code = dictionary.add_word();
+            } else if (value - ADAPTIVE_CODE_BASE < dictionary.size()) {
+                code = value - ADAPTIVE_CODE_BASE;
+            } else {
+                cerr << "Invalid code in adaptive stream: " << value << endl;
+                return false;
+            }
+            
+            // The words of a phrase are found from its last one back
+            uint32_t first = dictionary[code].first;
+            phrase.resize(dictionary[code].length);
+            uint32_t c = code;
+            for (size_t i = phrase.size(); i-- > 0; c = dictionary[c].parent) {
+                phrase[i] = dictionary[c].last;
+            }
+            for (uint32_t word : phrase) {
+                const string& text = words[word];
+                sink.reserve(text.size() + 1);
+                if (words_before) {
+                    *sink.out++ = ' ';
+                }
+                words_before = true;
+                memcpy(sink.out, text.data(), text.size());
+                sink.out += text.size();
+            }
+            dictionary.touch(code);
+            dictionary.extend(previous, first);
+            previous = code;
+        }
+        sink.flush();
+        return outfile.good();
+    }
+    
+    // Re-Pair decoding: expand the grammar and emit the final sequence
+    bool decompress_repair(BitReader& reader, ofstream& outfile) {
+        stats.timer.begin("bit_decode");
+        vector<string> local_words;
+        if (!read_local_dictionary(reader, local_words)) {
+            return false;
+        }
+        uint32_t main_size = main_decode_dict.size();
+        uint32_t terminal_count = main_size + local_words.size();
+        
+        // Read grammar rules. Each takes two codes of a bit or more, which
+        // bounds the count by the data left.
+        if (reader.bits_left() < 32) {
+            cerr << "Compressed data ends before the grammar rules" << endl;
+            return false;
+        }
+        uint32_t rule_count = reader.read_bits(32);
+        HuffmanCoder rule_coder;
+        if (!rule_coder.read_table(reader)) {
+            cerr << "Invalid rule code table" << endl;
+            return false;
+        }
+        if (static_cast<uint64_t>(rule_count) * 2 > reader.bits_left()) {
+            cerr << "Compressed data ends inside the grammar rules" << endl;
+            return false;
+        }
+        
+        vector<pair<uint32_t, uint32_t>> rules(rule_count);
+        for (uint32_t i = 0; i < rule_count; ++i) {
+            rules[i].first = rule_coder.decode(reader);
+            rules[i].second = rule_coder.decode(reader);
+            if (rules[i].first >= terminal_count + i || rules[i].second >= terminal_count + i) {
+                cerr << "Invalid symbol in rule " << i << endl;
+                return false;
+            }
+        }
+        
+        // Expand short rules into one text pool once, so emitting them is a
+        // single copy. Long rules are expanded through their children.
+        const uint32_t MAX_FRAGMENT_LENGTH = 256;
+        const uint32_t NOT_MATERIALIZED = UINT32_MAX;
+        string pool;
+        vector<uint32_t> fragment_offset(rule_count, NOT_MATERIALIZED);
+        vector<uint32_t> fragment_length(rule_count, 0);
+        
+        auto symbol_text = [&](uint32_t symbol, const char*& data, uint32_t& length) {
+            if (symbol < main_size) {
+                data = main_decode_dict[symbol].data();
+                length = main_decode_dict[symbol].size();
+            } else if (symbol < terminal_count) {
+                data = local_words[symbol - main_size].data();
+                length = local_words[symbol - main_size].size();
+            } else if (fragment_offset[symbol - terminal_count] != NOT_MATERIALIZED) {
+                data = pool.data() + fragment_offset[symbol - terminal_count];
+                length = fragment_length[symbol - terminal_count];
+            } else {
+                return false;
+            }
+            return true;
+        };
+        
+        for (uint32_t i = 0; i < rule_count; ++i) {
+            const char* left_data;
+            const char* right_data;
+            uint32_t left_length, right_length;
+            if (!symbol_text(rules[i].first, left_data, left_length) ||
+                !symbol_text(rules[i].second, right_data, right_length) ||
+                left_length + right_length + 1 > MAX_FRAGMENT_LENGTH) {
+                continue;
+            }
+            
+            fragment_offset[i] = pool.size();
+            fragment_length[i] = left_length + right_length + 1;
+            
+            // Copy pool fragments by offset since the pool may reallocate
+            if (rules[i].first >= terminal_count) {
+                pool.append(pool, fragment_offset[rules[i].first - terminal_count], left_length);
+            } else {
+                pool.append(left_data, left_length);
+            }
+            pool += ' ';
+            if (rules[i].second >= terminal_count) {
+                pool.append(pool, fragment_offset[rules[i].second - terminal_count], right_length);
+            } else {
+                pool.append(right_data, right_length);
+            }
+        }
+        
+        // Read and emit the final sequence
+        if (reader.bits_left() < 32) {
+            cerr << "Compressed data ends before the final sequence" << endl;
+            return false;
+        }
+        uint32_t sequence_length = reader.read_bits(32);
+        HuffmanCoder sequence_coder;
+        if (!sequence_coder.read_table(reader)) {
+            cerr << "Invalid sequence code table" << endl;
+            return false;
+        }
+        
+        string output;
+        vector<uint32_t> stack;
+        for (uint32_t i = 0; i < sequence_length; ++i) {
+            uint32_t symbol = sequence_coder.decode(reader);
+            if (symbol >= terminal_count + rule_count) {
+                cerr << "Invalid symbol in sequence: " << symbol << endl;
+                return false;
+            }
+            if (i > 0) output += ' ';
+            
+            stack.push_back(symbol);
+            bool first = true;
+            while (!stack.empty()) {
+                uint32_t top = stack.back();
+                stack.pop_back();
+                
+                const char* data;
+                uint32_t length;
+                if (symbol_text(top, data, length)) {
+                    if (!first) output += ' ';
+                    output.append(data, length);
+                    first = false;
+                } else {
+                    stack.push_back(rules[top - terminal_count].second);
+                    stack.push_back(rules[top - terminal_count].first);
+                }
+            }
+        }
+        
+        stats.timer.end();
+        
+        StageTimer::Scope stage(stats.timer, "text_emit");
+        outfile << output;
+        return outfile.good();
+    }
+    
+    // Position of a wildcard filler in its phrase's filler table, or -1
+    static int32_t filler_index(const PhraseInfo& phrase, uint32_t word_code) {
+        auto it = find(phrase.filler_codes.begin(), phrase.filler_codes.end(), word_code);
+        return it == phrase.filler_codes.end() ? -1 : static_cast<int32_t>(it - phrase.filler_codes.begin());
+    }
+    
+    // Write the token count and the tokens. Plain layout: 0 main word, 10 local
+    // word, 11 phrase (the ID one past the dictionary escapes a match), and a
+    // wildcard filler right after its phrase.
+    bool write_token_stream(BitWriter& writer, const vector<Token>& processed_tokens) {
+        // Write number of top-level tokens (wildcard words travel with their phrase)
+        uint32_t token_count = 0;
+        for (const auto& token : processed_tokens) {
+            if (token.type != WILDCARD) {
+                token_count++;
+            }
+        }
+        writer.write_bits(token_count, 32);
+        
+        if (settings.split_streams) {
+            return write_split_streams(writer, processed_tokens);
+        }
+        if (settings.entropy_code) {
+            return write_entropy_tokens(writer, processed_tokens);
+        }
+        
+        // Process tokens and write compressed data
+        for (size_t i = 0; i < processed_tokens.size(); ++i) {
+            const auto& token = processed_tokens[i];
+            uint64_t start_bits = writer.bit_count();
+            StatsTokenClass token_class = STATS_FILLER;
+            
+            if (token.type == WORD) {
+                // Check if word is in main dictionary
+                uint32_t code;
+                if (find_main_code(token.word, code)) {
+                    // Word in main dictionary
+                    writer.write_bits(0, 1);  // Type bit: 0 = main dictionary word
+                    writer.write_bits(code, main_max_bit_length);
+                    token_class = STATS_MAIN_WORD;
+                } else {
+                    // Word in local dictionary, or a number
+                    if (find_local_code(token.word, code)) {
+                        writer.write_bits(2, 2);  // Type bits: 10 = local dictionary word
+                        writer.write_bits(code, local_max_bit_length);
+                        token_class = STATS_LOCAL_WORD;
+                    } else {
+                        cerr << "Error: Word not found in either dictionary: " << token.word << endl;
+                        return false;
+                    }
+                }
+            } else if (token.type == PHRASE) {
+                // Phrase reference
+                writer.write_bits(3, 2);  // Type bits: 11 = phrase reference
+                writer.write_bits(token.phrase_id, phrase_max_bit_length);
+                token_class = STATS_PHRASE;
+            } else if (token.type == MATCH) {
+                // Back-reference: escape phrase ID, then distance and length
+                writer.write_bits(3, 2);
+                writer.write_bits(phrase_decode_dict.size(), phrase_max_bit_length);
+                writer.write_gamma(token.distance);
+                writer.write_gamma(token.length - MIN_MATCH_LENGTH + 1);
+                token_class = STATS_MATCH;
+                stats.count_match_length(token.length);
+            } else if (token.type == WILDCARD) {
+                // Wildcard word in phrase: index into the phrase's filler table
+                const auto& phrase = phrase_decode_dict[token.phrase_id];
+                uint32_t code;
+                bool main_word = find_main_code(token.word, code);
+                int32_t index = main_word ? filler_index(phrase, code) : -1;
+                if (index >= 0) {
+                    writer.write_bits(index, phrase.filler_bit_length);
+                    stats.count_token(STATS_FILLER, writer.bit_count() - start_bits);
+                    continue;
+                }
+                writer.write_bits(phrase.filler_codes.size(), phrase.filler_bit_length);
+                
+                // Unseen filler: check if wildcard word is in main dictionary
+                if (main_word) {
+                    // Word in main dictionary
+                    writer.write_bits(0, 1);  // Word type bit: 0 = main dictionary word
+                    writer.write_bits(code, main_max_bit_length);
+                } else {
+                    // Word in local dictionary, or a number
+                    if (find_local_code(token.word, code)) {
+                        writer.write_bits(1, 1);  // Word type bit: 1 = local dictionary word
+                        writer.write_bits(code, local_max_bit_length);
+                    } else {
+                        cerr << "Error: Wildcard word not found in either dictionary: " << token.word << endl;
+                        return false;
+                    }
+                }
+            }
+            
+            stats.count_token(token_class, writer.bit_count() - start_bits);
+        }
+        
+        return true;
+    }
+    
+    // Entropy-coded layout: one Huffman code over word IDs (main codes, then
+    // local codes and the number code), phrase IDs after them and one match
+    // escape symbol, plus a second code over filler table indices where
+    // FILLER_ESCAPE is followed by the filler's word symbol
+    bool write_entropy_tokens(BitWriter& writer, const vector<Token>& processed_tokens) {
+        uint32_t main_size = main_decode_dict.size();
+        uint32_t phrase_base = main_size + local_decode_dict.size() + 1;
+        uint32_t match_symbol = phrase_base + phrase_decode_dict.size();
+        
+        auto word_symbol = [&](const string& word, uint32_t& symbol) {
+            if (find_main_code(word, symbol)) {
+                return true;
+            }
+            if (find_local_code(word, symbol)) {
+                symbol += main_size;
+                return true;
+            }
+            cerr << "Error: Word not found in either dictionary: " << word << endl;
+            return false;
+        };
+        
+        // First pass: symbols in stream order, for the code tables
+        vector<uint32_t> token_symbols, filler_symbols;
+        for (const auto& token : processed_tokens) {
+            uint32_t symbol = 0;
+            if (token.type == WORD) {
+                if (!word_symbol(token.word, symbol)) return false;
+                token_symbols.push_back(symbol);
+            } else if (token.type == PHRASE) {
+                token_symbols.push_back(phrase_base + token.phrase_id);
+            } else if (token.type == MATCH) {
+                token_symbols.push_back(match_symbol);
+            } else if (token.type == WILDCARD) {
+                if (!word_symbol(token.word, symbol)) return false;
+                int32_t index = symbol < main_size ? filler_index(phrase_decode_dict[token.phrase_id], symbol) : -1;
+                if (index >= 0) {
+                    filler_symbols.push_back(index);
+                } else {
+                    filler_symbols.push_back(FILLER_ESCAPE);
+                    token_symbols.push_back(symbol);
+                }
+            }
+        }
+        
+        HuffmanCoder token_coder, filler_coder;
+        token_coder.build(token_symbols);
+        filler_coder.build(filler_symbols);
+        token_coder.write_table(writer);
+        filler_coder.write_table(writer);
+        
+        // Second pass: same order, matches add their distance and length
+        size_t next_token = 0, next_filler = 0;
+        for (const auto& token : processed_tokens) {
+            uint64_t start_bits = writer.bit_count();
+            if (token.type == WILDCARD) {
+                uint32_t filler = filler_symbols[next_filler++];
+                filler_coder.encode(writer, filler);
+                if (filler == FILLER_ESCAPE) {
+                    token_coder.encode(writer, token_symbols[next_token++]);
+                }
+                stats.count_token(STATS_FILLER, writer.bit_count() - start_bits);
+                continue;
+            }
+            
+            uint32_t symbol = token_symbols[next_token++];
+            token_coder.encode(writer, symbol);
+            if (token.type == MATCH) {
+                writer.write_gamma(token.distance);
+                writer.write_gamma(token.length - MIN_MATCH_LENGTH + 1);
+                stats.count_match_length(token.length);
+            }
+            
+            StatsTokenClass token_class = token.type == MATCH ? STATS_MATCH :
+                                          token.type == PHRASE ? STATS_PHRASE :
+                                          symbol < main_size ? STATS_MAIN_WORD : STATS_LOCAL_WORD;
+            stats.count_token(token_class, writer.bit_count() - start_bits);
+        }
+        
+        return true;
+    }
+    
+    // Split-stream layout: from the next byte boundary, per block, the number
+    // of tokens and then each stream as a coding byte, its length in bytes
+    // and its bits. So every stream starts on a byte of its own.
+    bool write_split_streams(BitWriter& writer, const vector<Token>& processed_tokens) {
+        writer.flush();
+        vector<uint32_t> streams[STREAM_COUNT];
+        vector<uint8_t> filler_widths;
+        uint32_t block_tokens = 0;
+        
+        // For the block index: the word IDs of the text so far, as the
+        // decoder rebuilds them, so that the words a match copies are known,
+        // and the keys, words and numbers of the block. Phrase keys follow
+        // the word IDs, numbers included.
+        bool indexing = settings.block_index;
+        uint32_t main_size = static_cast<uint32_t>(main_decode_dict.size());
+        uint32_t number_id = main_size + static_cast<uint32_t>(local_decode_dict.size());
+        uint32_t phrase_base = number_id + 1;
+        vector<uint32_t> history;
+        vector<uint32_t> block_keys;
+        uint64_t block_words = 0, block_numbers = 0;
+        size_t wildcard_slot = 0;
+        
+        auto write_block = [&]() {
+            uint64_t block_offset = segment_offset + writer.bit_count() / 8;
+            writer.write_bits(block_tokens, 32);
+            vector<uint32_t>& classes = streams[STREAM_CLASS];
+            size_t class_count = classes.size();
+            classes.resize((class_count + CLASSES_PER_SYMBOL - 1) / CLASSES_PER_SYMBOL * CLASSES_PER_SYMBOL, 0);
+            for (size_t i = 0; i < classes.size(); i += CLASSES_PER_SYMBOL) {
+                uint32_t symbol = 0;
+                for (size_t k = 0; k < CLASSES_PER_SYMBOL; ++k) {
+                    symbol = (symbol << 2) | classes[i + k];
+                }
+                classes[i / CLASSES_PER_SYMBOL] = symbol;
+            }
+            classes.resize(classes.size() / CLASSES_PER_SYMBOL);
+            
+            static const StatsTokenClass stream_classes[STREAM_COUNT] = {
+                STATS_CLASS_COUNT, STATS_MAIN_WORD, STATS_LOCAL_WORD, STATS_PHRASE, STATS_FILLER, STATS_MATCH
+            };
+            for (int s = 0; s < STREAM_COUNT; ++s) {
+                uint64_t start_bits = writer.bit_count();
+                // Class symbols may always take a Huffman code: it has a few
+                // dozen symbols, so each decodes with a single table lookup
+                write_split_stream(writer, streams[s], s == STREAM_FILLER ? &filler_widths : nullptr,
+                                   settings.entropy_code || s == STREAM_CLASS, settings.stream_vbyte,
+                                   settings.backend);
+                // The class stream is shared by all tokens and only counts in the total
+                if (stream_classes[s] != STATS_CLASS_COUNT) {
+                    stats.bits[stream_classes[s]] += writer.bit_count() - start_bits;
+                }
+                streams[s].clear();
+            }
+            filler_widths.clear();
+            block_tokens = 0;
+            
+            if (indexing) {
+                block_index.add_block(block_offset, block_words, block_numbers, block_keys);
+                block_keys.clear();
+                block_words = 0;
+                block_numbers = 0;
+            }
+        };
+        
+        // Word ID of the word add_word last added
+        auto last_word_id = [&]() {
+            return streams[STREAM_CLASS].back() == SPLIT_MAIN_WORD ? streams[STREAM_MAIN].back()
+                                                                   : main_size + streams[STREAM_LOCAL].back();
+        };
+        
+        // A word as a class and a code
+        auto add_word = [&](const string& word) {
+            uint32_t code;
+            if (find_main_code(word, code)) {
+                streams[STREAM_CLASS].push_back(SPLIT_MAIN_WORD);
+                streams[STREAM_MAIN].push_back(code);
+                return true;
+            }
+            if (find_local_code(word, code)) {
+                streams[STREAM_CLASS].push_back(SPLIT_LOCAL_WORD);
+                streams[STREAM_LOCAL].push_back(code);
+                return true;
+            }
+            cerr << "Error: Word not found in either dictionary: " << word << endl;
+            return false;
+        };
+        
+        for (const auto& token : processed_tokens) {
+            if (token.type == WILDCARD) {
+                // Filler table index, or the table size to escape to a word
+                const auto& phrase = phrase_decode_dict[token.phrase_id];
+                uint32_t code;
+                int32_t index = find_main_code(token.word, code) ? filler_index(phrase, code) : -1;
+                streams[STREAM_FILLER].push_back(index >= 0 ? index : phrase.filler_codes.size());
+                filler_widths.push_back(phrase.filler_bit_length);
+                if (index < 0 && !add_word(token.word)) {
+                    return false;
+                }
+                if (indexing) {
+                    history[wildcard_slot] = index >= 0 ? code : last_word_id();
+                    block_keys.push_back(history[wildcard_slot]);
+                    block_numbers += history[wildcard_slot] == number_id;
+                }
+                stats.count_token(STATS_FILLER);
+                continue;
+            }
+            
+            if (block_tokens == SPLIT_BLOCK_TOKENS) {
+                write_block();
+            }
+            block_tokens++;
+            
+            if (token.type == WORD) {
+                if (!add_word(token.word)) {
+                    return false;
+                }
+                stats.count_token(streams[STREAM_CLASS].back() == SPLIT_MAIN_WORD ? STATS_MAIN_WORD : STATS_LOCAL_WORD);
+                if (indexing) {
+                    history.push_back(last_word_id());
+                    block_keys.push_back(history.back());
+                    block_words++;
+                    block_numbers += history.back() == number_id;
+                }
+            } else if (token.type == PHRASE) {
+                streams[STREAM_CLASS].push_back(SPLIT_PHRASE);
+                streams[STREAM_PHRASE].push_back(token.phrase_id);
+                stats.count_token(STATS_PHRASE);
+                if (indexing) {
+                    // The wildcard slot, if any, is filled in by the WILDCARD token after it
+                    const auto& codes = phrase_decode_dict[token.phrase_id].word_codes;
+                    for (size_t i = 0; i < codes.size(); ++i) {
+                        if (codes[i] == UINT32_MAX) {
+                            wildcard_slot = history.size();
+                        }
+                        history.push_back(codes[i]);
+                    }
+                    block_keys.push_back(phrase_base + token.phrase_id);
+                    block_words += codes.size();
+                }
+            } else if (token.type == MATCH) {
+                streams[STREAM_CLASS].push_back(SPLIT_MATCH);
+                streams[STREAM_MATCH].push_back(token.distance);
+                streams[STREAM_MATCH].push_back(token.length - MIN_MATCH_LENGTH + 1);
+                stats.count_token(STATS_MATCH);
+                stats.count_match_length(token.length);
+                if (indexing) {
+                    // Copied one at a time, as the source may overlap the copy
+                    for (uint32_t i = 0; i < token.length; ++i) {
+                        history.push_back(history[history.size() - token.distance]);
+                        block_keys.push_back(history.back());
+                        block_numbers += history.back() == number_id;
+                    }
+                    block_words += token.length;
+                }
+            }
+        }
+        if (block_tokens > 0) {
+            write_block();
+        }
+        
+        return true;
+    }
+    
+    // Steps 6-7 of compress after the main dictionary is built. Levels that
+    // expect a trained dictionary but got a word list code words only.
+    void mine_phrases(const vector<string>& raw_tokens) {
+        if (!settings.use_trained_phrases) {
+            // Step 6: Find phrases with wildcards
+            if (settings.mine_wildcards) {
+                StageTimer::Scope stage(stats.timer, "wildcard_mining");
+                find_wildcard_phrases(raw_tokens);
+            }
+            
+            // Step 7: Find regular phrases
+            StageTimer::Scope stage(stats.timer, "regular_mining");
+            find_regular_phrases(raw_tokens);
+        }
+        
+        // Phrase mining may have added words to the main dictionary
+        main_max_bit_length = bits_needed(main_decode_dict.size());
+        phrase_max_bit_length = bits_needed(phrase_decode_dict.size() + 1);
+        freeze_main_dictionary();
+    }
+    
+    // Long-range repeats over word IDs. Words outside the main dictionary
+    // only need an ID that is distinct, not their final code. Numbers all
+    // share one ID, as they share one code.
+    vector<TokenMatch> find_long_range_matches(const vector<string>& raw_tokens) {
+        vector<TokenMatch> matches;
+        if (settings.match_window > 0) {
+            StageTimer::Scope stage(stats.timer, "match_find");
+            const uint32_t NUMBER_ID = UINT32_MAX;
+            FlatHashMap<string_view, uint32_t> extra_ids;
+            vector<uint32_t> word_ids;
+            word_ids.reserve(raw_tokens.size());
+            for (const auto& token : raw_tokens) {
+                uint32_t code;
+                if (find_main_code(token, code)) {
+                    word_ids.push_back(code);
+                } else if (is_number(token)) {
+                    word_ids.push_back(NUMBER_ID);
+                } else {
+                    auto extra = extra_ids.emplace(token, main_decode_dict.size() + extra_ids.size());
+                    word_ids.push_back(extra.first->second);
+                }
+            }
+            
+            TokenMatchFinder finder(settings.match_window, MIN_MATCH_LENGTH, settings.match_chain);
+            matches = finder.find_matches(word_ids, &stats.chain_probes);
+            
+            size_t matched_tokens = 0;
+            for (const auto& m : matches) {
+                matched_tokens += m.length;
+            }
+            if (!quiet) {
+                cout << "Long-range matches: " << matches.size() << " covering " << matched_tokens << " tokens" << endl;
+            }
+        }
+        return matches;
+    }
+    
+    // Build the local dictionary from the rare words of the parse: those
+    // not in the main dictionary, numbers aside
+    void collect_local_dictionary(const vector<Token>& processed_tokens) {
+        StageTimer::Scope stage(stats.timer, "encode");
+        vector<string> rare_words;
+        for (const auto& token : processed_tokens) {
+            uint32_t code;
+            if ((token.type == WORD || token.type == WILDCARD) && !find_main_code(token.word, code) &&
+                !is_number(token.word)) {
+                rare_words.push_back(token.word);
+            }
+        }
+        build_local_dictionary(rare_words);
+    }
+    
+    // Everything after the header: the local dictionary, the tokens, the
+    // values of their numbers, and in lossless mode their forms
+    bool write_segment(BitWriter& writer, const vector<Token>& processed_tokens, const vector<string>& raw_tokens) {
+        if (!write_local_dictionary(writer) || !write_token_stream(writer, processed_tokens)) {
+            return false;
+        }
+        write_numbers(writer, raw_tokens);
+        return !settings.lossless || write_text_forms(writer, raw_tokens);
+    }
+    
+    // Values of the number tokens, as the layout at FLAG_NUMBERS describes.
+    // They are taken from the input tokens rather than the parse, so that
+    // numbers inside matches keep their order.
+    void write_numbers(BitWriter& writer, const vector<string>& raw_tokens) {
+        writer.flush();
+        uint64_t start_bits = writer.bit_count();
+        vector<uint32_t> bytes;
+        auto write_varint = [&](uint64_t value) {
+            for (; value >= 0x80; value >>= 7) {
+                bytes.push_back((value & 0x7F) | 0x80);
+            }
+            bytes.push_back(value);
+        };
+        
+        uint32_t count = 0;
+        for (const auto& token : raw_tokens) {
+            uint32_t code;
+            if (!is_number(token) || find_main_code(token, code)) {
+                continue;
+            }
+            size_t zeros = 0;
+            while (zeros + 1 < token.size() && token[zeros] == '0') {
+                zeros++;
+            }
+            uint64_t value = stoull(token);
+            write_varint(value * 2 + (zeros > 0));
+            if (zeros > 0) {
+                write_varint(zeros - 1);
+            }
+            count++;
+        }
+        
+        writer.write_bits(count, 32);
+        write_split_stream(writer, bytes, nullptr, true, false, settings.backend);
+        stats.numbers = count;
+        stats.number_bits = writer.bit_count() - start_bits;
+    }
+    
+    // Lossless mode: the forms of the input tokens as blocks of split
+    // streams, always entropy-coded, as the layout at FormStream describes.
+    // The predictor sees each token by its word ID, as the decoder does.
+    bool write_text_forms(BitWriter& writer, const vector<string>& raw_tokens) {
+        writer.flush();
+        uint64_t start_bits = writer.bit_count();
+        uint32_t main_size = main_decode_dict.size();
+        TextForms::Predictor predictor(main_size + local_decode_dict.size() + 1);
+        const string no_separator;
+        size_t exception = 0, separator = 0;
+        
+        for (size_t start = 0; start < raw_tokens.size(); start += SPLIT_BLOCK_TOKENS) {
+            size_t end = min(raw_tokens.size(), start + SPLIT_BLOCK_TOKENS);
+            vector<uint32_t> word_ids;
+            vector<uint16_t> keys;
+            for (size_t i = start; i < end; ++i) {
+                const string& token = raw_tokens[i];
+                uint32_t word_id;
+                if (!find_main_code(token, word_id)) {
+                    if (!find_local_code(token, word_id)) {
+                        cerr << "Error: Word not found in either dictionary: " << token << endl;
+                        return false;
+                    }
+                    word_id += main_size;
+                }
+                word_ids.push_back(word_id);
+                keys.push_back(TextForms::Predictor::key_of(token[0]));
+            }
+            
+            // The token and the punctuation after it, as far as a wrap width reaches
+            auto chunk_length = [&](size_t i) {
+                size_t length = raw_tokens[i].size();
+                for (size_t j = i + 1; j < end && keys[j - start] != 0 && length < TextForms::Predictor::MAX_WRAP_WIDTH; ++j) {
+                    length += raw_tokens[j].size();
+                }
+                return length;
+            };
+            auto separator_text = [&](size_t i, size_t index) -> const string& {
+                return text_forms.spacings[i] == TextForms::SPACING_OTHER ? text_forms.separators[index] : no_separator;
+            };
+            
+            // First pass: the wrap width with the fewest spacing misses. Where
+            // the context says space or newline, a gap whose chunk ends past
+            // the width is guessed a newline.
+            uint32_t wrapped_at[2][TextForms::Predictor::MAX_WRAP_WIDTH + 1] = {};
+            uint32_t unwrapped_misses = 0;
+            predictor.reset(0);
+            for (size_t i = start, index = separator; i < end; ++i) {
+                uint8_t spacing = text_forms.spacings[i];
+                size_t chunk = chunk_length(i);
+                uint8_t mode = predictor.guess_spacing(keys[i - start], chunk);
+                if ((mode == TextForms::SPACING_SPACE || mode == TextForms::SPACING_NEWLINE) &&
+                    (spacing == TextForms::SPACING_SPACE || spacing == TextForms::SPACING_NEWLINE)) {
+                    wrapped_at[spacing == TextForms::SPACING_NEWLINE][predictor.wrap_column(chunk)]++;
+                    unwrapped_misses += spacing != mode;
+                }
+                const string& text = separator_text(i, index);
+                index += spacing == TextForms::SPACING_OTHER;
+                predictor.update(word_ids[i - start], keys[i - start], text_forms.cases[i], spacing,
+                                 text, raw_tokens[i].size());
+            }
+            uint32_t wrap_width = 0;
+            uint32_t spaces_past = 0, newlines_within = 0;
+            for (uint32_t column = 0; column <= TextForms::Predictor::MAX_WRAP_WIDTH; ++column) {
+                spaces_past += wrapped_at[0][column];
+            }
+            uint32_t best_misses = unwrapped_misses;
+            for (uint32_t width = 1; width <= TextForms::Predictor::MAX_WRAP_WIDTH; ++width) {
+                spaces_past -= wrapped_at[0][width];
+                newlines_within += wrapped_at[1][width];
+                if (spaces_past + newlines_within < best_misses) {
+                    best_misses = spaces_past + newlines_within;
+                    wrap_width = width;
+                }
+            }
+            
+            // Second pass: the misses at that width
+            vector<uint32_t> streams[FORM_STREAM_COUNT];
+            uint32_t case_run = 0, spacing_run = 0;
+            predictor.reset(wrap_width);
+            for (size_t i = start; i < end; ++i) {
+                uint32_t word_id = word_ids[i - start];
+                uint16_t key = keys[i - start];
+                uint8_t case_class = text_forms.cases[i];
+                uint8_t spacing = text_forms.spacings[i];
+                
+                if (case_class == predictor.guess_case(word_id)) {
+                    case_run++;
+                } else {
+                    streams[FORM_CASE_RUNS].push_back(case_run);
+                    streams[FORM_CASE_MISSES].push_back(case_class);
+                    case_run = 0;
+                }
+                if (spacing == predictor.guess_spacing(key, chunk_length(i))) {
+                    spacing_run++;
+                } else {
+                    streams[FORM_SPACING_RUNS].push_back(spacing_run);
+                    streams[FORM_SPACING_MISSES].push_back(spacing);
+                    spacing_run = 0;
+                }
+                
+                const string& text = separator_text(i, separator);
+                if (spacing == TextForms::SPACING_OTHER) {
+                    separator++;
+                    streams[FORM_SEPARATOR_LENGTHS].push_back(text.size());
+                    streams[FORM_TEXT].insert(streams[FORM_TEXT].end(), text.begin(), text.end());
+                }
+                if (case_class == TextForms::CASE_EXCEPTION) {
+                    const string& written = text_forms.exceptions[exception++];
+                    streams[FORM_TEXT].insert(streams[FORM_TEXT].end(), written.begin(), written.end());
+                }
+                predictor.update(word_id, key, case_class, spacing, text, raw_tokens[i].size());
+            }
+            streams[FORM_CASE_RUNS].push_back(case_run);
+            streams[FORM_SPACING_RUNS].push_back(spacing_run);
+            
+            writer.write_bits(end - start, 32);
+            writer.write_bits(wrap_width, 8);
+            for (int s = 0; s < FORM_STREAM_COUNT; ++s) {
+                if (s == FORM_TEXT) {
+                    // Bytes as written, not sign-extended chars
+                    for (auto& byte : streams[s]) {
+                        byte &= 0xFF;
+                    }
+                }
+                write_split_stream(writer, streams[s], nullptr, true, false, settings.backend);
+            }
+        }
+        
+        writer.write_bits(text_forms.trailing.size(), 32);
+        writer.write_bytes(vector<uint8_t>(text_forms.trailing.begin(), text_forms.trailing.end()));
+        stats.lossless_bits = writer.bit_count() - start_bits;
+        return true;
+    }
+    
+    // One split stream: a coding byte, the packed width, the number of
+    // values and the length in bytes, then the values. Fixed-width lanes,
+    // the fastest to decode, are used unless another coding is smaller: the
+    // filler width of each value's phrase, which the filler stream passes,
+    // or with entropy_code, gamma and Huffman codes. With stream_vbyte every
+    // stream is Stream VByte, whatever its size. With a backend, codings are
+    // compared by their size after it, and a stream it does not shrink is
+    // stored as it is.
+    static void write_split_stream(BitWriter& writer, const vector<uint32_t>& values,
+                                   const vector<uint8_t>* value_widths, bool entropy_code, bool stream_vbyte,
+                                   const BackendCodec* backend) {
+        uint32_t max_value = values.empty() ? 0 : *max_element(values.begin(), values.end());
+        uint8_t width = bits_needed(static_cast<size_t>(max_value) + 1);
+        
+        vector<pair<StreamCoding, vector<uint8_t>>> candidates;
+        auto add = [&](StreamCoding candidate, BitWriter& bits) {
+            bits.flush();
+            candidates.emplace_back(candidate, bits.get_buffer());
+        };
+        if (stream_vbyte) {
+            candidates.emplace_back(CODING_STREAM_VBYTE, StreamVByte::encode(values));
+        } else {
+            candidates.emplace_back(CODING_LANES, LanePacker::pack(values, width));
+        }
+        if (value_widths != nullptr && !stream_vbyte) {
+            BitWriter filler_packed;
+            for (size_t i = 0; i < values.size(); ++i) {
+                filler_packed.write_bits(values[i], (*value_widths)[i]);
+            }
+            add(CODING_FILLER_WIDTHS, filler_packed);
+        }
+        if (entropy_code && !stream_vbyte && !values.empty()) {
+            BitWriter gamma, huffman;
+            for (uint32_t value : values) {
+                gamma.write_gamma(value + 1);
+            }
+            HuffmanCoder coder;
+            coder.build(values);
+            coder.write_table(huffman);
+            for (uint32_t value : values) {
+                coder.encode(huffman, value);
+            }
+            add(CODING_GAMMA, gamma);
+            add(CODING_HUFFMAN, huffman);
+        }
+        
+        // Smallest as stored; the first candidate wins ties
+        size_t best = 0;
+        bool best_backend = false;
+        vector<uint8_t> best_stored, stored;
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            size_t best_size = best_backend ? best_stored.size() : candidates[best].second.size();
+            if (candidates[i].second.size() < best_size) {
+                best = i;
+                best_backend = false;
+                best_size = candidates[i].second.size();
+            }
+            if (backend != nullptr && !candidates[i].second.empty() &&
+                backend->compress(candidates[i].second, stored) && stored.size() < best_size) {
+                best = i;
+                best_backend = true;
+                best_stored.swap(stored);
+            }
+        }
+        
+        const vector<uint8_t>& raw = candidates[best].second;
+        writer.write_bits(candidates[best].first | (best_backend ? CODING_BACKEND_BIT : 0), 8);
+        writer.write_bits(width, 8);
+        writer.write_bits(values.size(), 32);
+        writer.write_bits(raw.size(), 32);
+        if (best_backend) {
+            writer.write_bits(best_stored.size(), 32);
+            writer.write_bytes(best_stored);
+        } else {
+            writer.write_bytes(raw);
+        }
+    }
+    
+    // Read one split stream and decode all of its values at once; false if
+    // it is malformed or holds more than max_count values. Only the filler
+    // stream has value_widths. A stream that went through the backend is
+    // restored into backend_bytes first.
+    static bool read_split_stream(BitReader& reader, vector<uint32_t>& values,
+                                  const vector<uint8_t>* value_widths, uint64_t max_count,
+                                  const BackendCodec* backend, vector<uint8_t>& backend_bytes) {
+        uint8_t coding = reader.read_bits(8);
+        uint8_t width = reader.read_bits(8);
+        uint32_t count = reader.read_bits(32);
+        uint32_t size = reader.read_bits(32);
+        bool backend_coded = coding & CODING_BACKEND_BIT;
+        coding &= ~CODING_BACKEND_BIT;
+        uint32_t stored_size = backend_coded ? reader.read_bits(32) : size;
+        const uint8_t* bytes = reader.read_bytes(stored_size);
+        if (coding > CODING_STREAM_VBYTE || width > LanePacker::MAX_WIDTH || bytes == nullptr || count > max_count ||
+            reader.overran()) {
+            return false;
+        }
+        if (backend_coded) {
+            // No coding takes more than 32 bytes a value, Huffman table
+            // included, so a larger size is corrupt and is not allocated
+            if (backend == nullptr || size > 32 * max_count + 4096 ||
+                !backend->decompress(bytes, stored_size, size, backend_bytes)) {
+                return false;
+            }
+            bytes = backend_bytes.data();
+        }
+        if (coding == CODING_FILLER_WIDTHS && (value_widths == nullptr || value_widths->size() != count)) {
+            return false;
+        }
+        
+        if (coding == CODING_LANES) {
+            if (size != LanePacker::packed_bytes(count, width)) {
+                return false;
+            }
+            values.resize(LanePacker::unpacked_capacity(count));
+            LanePacker::unpack(bytes, count, width, values.data());
+            values.resize(count);
+            return true;
+        }
+        if (coding == CODING_STREAM_VBYTE) {
+            values.resize(count);
+            return StreamVByte::decode(bytes, size, count, values.data());
+        }
+        
+        BitReader stream(bytes, size);
+        values.resize(count);
+        if (coding == CODING_GAMMA) {
+            for (auto& value : values) {
+                value = stream.read_gamma() - 1;
+            }
+        } else if (coding == CODING_FILLER_WIDTHS) {
+            for (size_t i = 0; i < count; ++i) {
+                values[i] = stream.read_window((*value_widths)[i]);
+            }
+        } else {
+            HuffmanCoder coder;
+            if (!coder.read_table(stream)) {
+                return false;
+            }
+            for (auto& value : values) {
+                value = coder.decode(stream);
+            }
+        }
+        return true;
+    }
+    
+    // Values of the number tokens as text; the tokens hold expected_count
+    bool decode_numbers(BitReader& reader, const BackendCodec* backend, size_t expected_count,
+                        vector<string>& numbers) {
+        reader.align_to_byte();
+        uint32_t number_count = reader.read_bits(32);
+        if (number_count != expected_count) {
+            cerr << "Number count does not match the tokens: " << number_count << endl;
+            return false;
+        }
+        
+        // A number takes at most two varints of ten bytes
+        vector<uint32_t> bytes;
+        vector<uint8_t> backend_bytes;
+        if (!read_split_stream(reader, bytes, nullptr, 20ULL * number_count, backend, backend_bytes)) {
+            cerr << "Invalid number stream" << endl;
+            return false;
+        }
+        size_t position = 0;
+        auto read_varint = [&](uint64_t& value) {
+            value = 0;
+            for (uint32_t shift = 0; shift < 64 && position < bytes.size() && bytes[position] <= 0xFF; shift += 7) {
+                uint32_t byte = bytes[position++];
+                value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                if ((byte & 0x80) == 0) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        
+        numbers.clear();
+        numbers.reserve(number_count);
+        for (uint32_t i = 0; i < number_count; ++i) {
+            uint64_t code, zeros = 0;
+            if (!read_varint(code) || ((code & 1) && !read_varint(zeros))) {
+                cerr << "Invalid number " << i << endl;
+                return false;
+            }
+            string digits = to_string(code >> 1);
+            zeros += code & 1;
+            if (zeros > MAX_NUMBER_DIGITS - digits.size()) {
+                cerr << "Invalid number " << i << endl;
+                return false;
+            }
+            numbers.push_back(string(zeros, '0') + digits);
+        }
+        if (position != bytes.size()) {
+            cerr << "Invalid number stream" << endl;
+            return false;
+        }
+        return true;
+    }
+    
+    // Lossless mode: rebuild the forms of the decoded tokens from their
+    // misses, running the same predictor over the word IDs as the encoder
+    bool decode_text_forms(BitReader& reader, const vector<string>& local_words,
+                           const BackendCodec* backend, const vector<uint32_t>& history,
+                           uint32_t number_id, const vector<string>& numbers, TextForms& forms) {
+        reader.align_to_byte();
+        uint32_t main_size = main_decode_dict.size();
+        size_t word_count = main_size + local_words.size();
+        TextForms::Predictor predictor(word_count);
+        const string no_separator;
+        vector<uint32_t> streams[FORM_STREAM_COUNT];
+        vector<uint8_t> backend_bytes;
+        forms.clear();
+        forms.cases.resize(history.size());
+        forms.spacings.resize(history.size());
+        
+        size_t start = 0, number = 0;
+        while (start < history.size()) {
+            uint32_t block_tokens = reader.read_bits(32);
+            uint32_t wrap_width = reader.read_bits(8);
+            if (block_tokens == 0 || block_tokens > history.size() - start) {
+                cerr << "Invalid lossless block size: " << block_tokens << endl;
+                return false;
+            }
+            for (int s = 0; s < FORM_STREAM_COUNT; ++s) {
+                // Runs have one value more than misses; the text is as long as it is
+                uint64_t max_count = s == FORM_TEXT ? UINT32_MAX : static_cast<uint64_t>(block_tokens) + 1;
+                if (!read_split_stream(reader, streams[s], nullptr, max_count, backend, backend_bytes)) {
+                    cerr << "Invalid lossless stream " << s << endl;
+                    return false;
+                }
+            }
+            
+            // Reading past the end of a stream gives UINT32_MAX, which the
+            // checks below and at the end of the block reject
+            size_t positions[FORM_STREAM_COUNT] = {};
+            auto next = [&](int s) {
+                return positions[s] < streams[s].size() ? streams[s][positions[s]++] : UINT32_MAX;
+            };
+            auto take_text = [&](size_t length, string& text) {
+                if (length > streams[FORM_TEXT].size() - positions[FORM_TEXT]) {
+                    return false;
+                }
+                const uint32_t* bytes = streams[FORM_TEXT].data() + positions[FORM_TEXT];
+                text.assign(bytes, bytes + length);
+                positions[FORM_TEXT] += length;
+                return true;
+            };
+            
+            size_t end = start + block_tokens;
+            for (size_t i = start; i < end; ++i) {
+                if (history[i] >= word_count) {
+                    cerr << "Invalid word ID in lossless forms: " << history[i] << endl;
+                    return false;
+                }
+            }
+            auto word_of = [&](size_t i) {
+                uint32_t id = history[i];
+                return id < main_size ? main_decode_dict[id] : string_view(local_words[id - main_size]);
+            };
+            // The token and the punctuation after it, as the encoder counts it.
+            // A number ahead reads as the digits of its stand-in local entry,
+            // so it ends the chunk like any other word.
+            auto chunk_length = [&](size_t i, size_t length) {
+                for (size_t j = i + 1; j < end && TextForms::Predictor::key_of(word_of(j)[0]) != 0 &&
+                                       length < TextForms::Predictor::MAX_WRAP_WIDTH; ++j) {
+                    length += word_of(j).size();
+                }
+                return length;
+            };
+            
+            predictor.reset(wrap_width);
+            uint32_t case_run = next(FORM_CASE_RUNS);
+            uint32_t spacing_run = next(FORM_SPACING_RUNS);
+            for (size_t i = start; i < end; ++i) {
+                uint32_t id = history[i];
+                string_view word = id == number_id ? string_view(numbers[number++]) : word_of(i);
+                uint16_t key = TextForms::Predictor::key_of(word[0]);
+                
+                uint32_t case_class = predictor.guess_case(id);
+                if (case_run-- == 0) {
+                    case_class = next(FORM_CASE_MISSES);
+                    case_run = next(FORM_CASE_RUNS);
+                }
+                uint32_t spacing = predictor.guess_spacing(key, chunk_length(i, word.size()));
+                if (spacing_run-- == 0) {
+                    spacing = next(FORM_SPACING_MISSES);
+                    spacing_run = next(FORM_SPACING_RUNS);
+                }
+                if (case_class >= TextForms::CASE_COUNT || spacing >= TextForms::SPACING_COUNT) {
+                    cerr << "Invalid lossless form at token " << i << endl;
+                    return false;
+                }
+                
+                const string* separator = &no_separator;
+                if (spacing == TextForms::SPACING_OTHER) {
+                    forms.separators.emplace_back();
+                    if (!take_text(next(FORM_SEPARATOR_LENGTHS), forms.separators.back())) {
+                        cerr << "Missing separator text at token " << i << endl;
+                        return false;
+                    }
+                    separator = &forms.separators.back();
+                }
+                if (case_class == TextForms::CASE_EXCEPTION) {
+                    forms.exceptions.emplace_back();
+                    if (!take_text(word.size(), forms.exceptions.back())) {
+                        cerr << "Missing exception text at token " << i << endl;
+                        return false;
+                    }
+                }
+                forms.cases[i] = case_class;
+                forms.spacings[i] = spacing;
+                predictor.update(id, key, case_class, spacing, *separator, word.size());
+            }
+            
+            // Every run and every value was used up
+            for (int s = 0; s < FORM_STREAM_COUNT; ++s) {
+                if (positions[s] != streams[s].size()) {
+                    cerr << "Invalid lossless stream " << s << endl;
+                    return false;
+                }
+            }
+            if (case_run != 0 || spacing_run != 0) {
+                cerr << "Invalid lossless runs" << endl;
+                return false;
+            }
+            start = end;
+        }
+        
+        uint32_t trailing_size = reader.read_bits(32);
+        const uint8_t* trailing = reader.read_bytes(trailing_size);
+        if (trailing == nullptr) {
+            cerr << "Missing trailing whitespace" << endl;
+            return false;
+        }
+        forms.trailing.assign(trailing, trailing + trailing_size);
+        return true;
+    }
+    
+    // Decode the token stream of a phrase-mode file into word IDs
+    bool decode_token_stream(BitReader& reader, const vector<string>& local_words,
+                             uint8_t flags, const BackendCodec* backend, vector<uint32_t>& history) {
+        if (reader.bits_left() < 32) {
+            cerr << "Compressed data ends before the token count" << endl;
+            return false;
+        }
+        uint32_t token_count = reader.read_bits(32);
+        
+        if (flags & FLAG_SPLIT_STREAMS) {
+            return decode_split_streams(reader, local_words, token_count, backend, history);
+        }
+        if (flags & FLAG_ENTROPY_CODED) {
+            return decode_entropy_tokens(reader, local_words, token_count, history);
+        }
+        return decode_fixed_tokens(reader, local_words, token_count, history);
+    }
+    
+    // Fixed-width token stream. The type bit and a main code are read with
+    // one windowed read, as main words are the commonest token.
+    bool decode_fixed_tokens(BitReader& reader, const vector<string>& local_words,
+                             uint32_t token_count, vector<uint32_t>& history) {
+        uint32_t main_size = main_decode_dict.size();
+        uint32_t match_escape = phrase_decode_dict.size();
+        uint8_t main_bits = main_max_bit_length;
+        uint8_t local_bits = bits_needed(local_words.size());
+        
+        for (uint32_t token_idx = 0; token_idx < token_count; ++token_idx) {
+            if (reader.overran()) {
+                cerr << "Compressed data ends inside the token stream" << endl;
+                return false;
+            }
+            
+            // Read token type together with the code of a main word, the
+            // commonest token
+            uint32_t main_token = reader.peek_window(1 + main_bits);
+            uint8_t type_bits = main_token >> main_bits;
+            reader.skip_bits(type_bits == 0 ? 1 + main_bits : 1);
+            
+            if (type_bits == 0) {
+                // Main dictionary word
+                uint32_t word_code = main_token;
+                if (word_code < main_decode_dict.size()) {
+                    history.push_back(word_code);
+                    stats.count_token(STATS_MAIN_WORD);
+                } else {
+                    cerr << "Invalid word code in main dictionary: " << word_code << endl;
+                    return false;
+                }
+            } else {
+                // Additional type bit needed
+                uint8_t additional_type_bit = reader.read_bits<1>();
+                
+                if (additional_type_bit == 0) {
+                    // Local dictionary word
+                    uint32_t word_code = reader.read_window(local_bits);
+                    if (word_code < local_words.size()) {
+                        history.push_back(main_size + word_code);
+                        stats.count_token(STATS_LOCAL_WORD);
+                    } else {
+                        cerr << "Invalid word code in local dictionary: " << word_code << endl;
+                        return false;
+                    }
+                } else {
+                    uint32_t phrase_id = reader.read_window(phrase_max_bit_length);
+                    
+                    if (phrase_id == match_escape) {
+                        // Back-reference into the decoded stream; may overlap itself
+                        uint32_t distance = reader.read_gamma();
+                        uint32_t length = reader.read_gamma() + MIN_MATCH_LENGTH - 1;
+                        if (distance == 0 || distance > history.size()) {
+                            cerr << "Invalid match distance: " << distance << endl;
+                            return false;
+                        }
+                        
+                        size_t from = history.size() - distance;
+                        for (uint32_t k = 0; k < length; ++k) {
+                            history.push_back(history[from + k]);
+                        }
+                        stats.count_token(STATS_MATCH);
+                        stats.count_match_length(length);
+                    } else if (phrase_id < phrase_decode_dict.size()) {
+                        const auto& phrase = phrase_decode_dict[phrase_id];
+                        uint32_t wildcard_id = 0;
+                        stats.count_token(STATS_PHRASE);
+                        if (phrase.has_wildcard) {
+                            stats.count_token(STATS_FILLER);
+                        }
+                        
+                        // For phrases with wildcards, the filler follows the phrase
+                        uint32_t filler_index = phrase.has_wildcard ? reader.read_window(phrase.filler_bit_length) : 0;
+                        
+                        if (phrase.has_wildcard && filler_index < phrase.filler_codes.size()) {
+                            wildcard_id = phrase.filler_codes[filler_index];
+                            if (wildcard_id >= main_size) {
+                                cerr << "Invalid filler code in phrase: " << wildcard_id << endl;
+                                return false;
+                            }
+                        } else if (phrase.has_wildcard) {
+                            // Escaped filler: read full word code
+                            uint8_t word_dict_type = reader.read_bits<1>();
+                            uint32_t word_code;
+                            
+                            if (word_dict_type == 0) {
+                                word_code = reader.read_window(main_bits);
+                                if (word_code >= main_decode_dict.size()) {
+                                    cerr << "Invalid wildcard word code in main dictionary: " << word_code << endl;
+                                    return false;
+                                }
+                                wildcard_id = word_code;
+                            } else {
+                                word_code = reader.read_window(local_bits);
+                                if (word_code >= local_words.size()) {
+                                    cerr << "Invalid wildcard word code in local dictionary: " << word_code << endl;
+                                    return false;
+                                }
+                                wildcard_id = main_size + word_code;
+                            }
+                        }
+                        
+                        // Expand phrase, inserting the wildcard word
+                        for (size_t i = 0; i < phrase.word_codes.size(); ++i) {
+                            if (phrase.has_wildcard && i == phrase.wildcard_pos) {
+                                history.push_back(wildcard_id);
+                            } else if (phrase.word_codes[i] < main_decode_dict.size()) {
+                                history.push_back(phrase.word_codes[i]);
+                            } else {
+                                cerr << "Invalid word code in phrase: " << phrase.word_codes[i] << endl;
+                                return false;
+                            }
+                        }
+                    } else {
+                        cerr << "Invalid phrase ID: " << phrase_id << endl;
+                        return false;
+                    }
+                }
+            }
+        }
+        
+        if (reader.overran()) {
+            cerr << "Compressed data ends inside the token stream" << endl;
+            return false;
+        }
+        return true;
+    }
+    
+    // Read the streams of one split-stream block, after its token count; on
+    // failure bad_stream is the one that is malformed
+    bool read_split_block(BitReader& reader, uint32_t block_tokens, const BackendCodec* backend,
+                          vector<uint32_t> (&streams)[STREAM_COUNT], vector<uint8_t>& backend_bytes,
+                          int& bad_stream) const {
+        vector<uint8_t> filler_widths;
+        for (int s = 0; s < STREAM_COUNT; ++s) {
+            if (s == STREAM_FILLER) {
+                // The phrases come first and tell the width of each filler
+                filler_widths.clear();
+                for (uint32_t phrase_id : streams[STREAM_PHRASE]) {
+                    if (phrase_id < phrase_expansions.size() &&
+                        phrase_expansions[phrase_id].wildcard_pos != PhraseExpansion::NO_WILDCARD) {
+                        filler_widths.push_back(phrase_expansions[phrase_id].filler_bit_length);
+                    }
+                }
+            }
+            // No stream has more than two values per token
+            if (!read_split_stream(reader, streams[s], s == STREAM_FILLER ? &filler_widths : nullptr,
+                                   2 * static_cast<uint64_t>(block_tokens), backend, backend_bytes)) {
+                bad_stream = s;
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // Split-stream layout: decode the streams of each block in bulk, then
+    // rebuild the tokens by following the class stream
+    bool decode_split_streams(BitReader& reader, const vector<string>& local_words, uint32_t token_count,
+                              const BackendCodec* backend, vector<uint32_t>& history) {
+        uint32_t main_size = main_decode_dict.size();
+        vector<uint32_t> streams[STREAM_COUNT];
+        vector<uint8_t> backend_bytes;
+        size_t size = history.size();
+        
+        reader.align_to_byte();
+        uint32_t decoded = 0;
+        while (decoded < token_count) {
+            uint32_t block_tokens = reader.read_bits(32);
+            if (block_tokens == 0 || block_tokens > token_count - decoded) {
+                cerr << "Invalid split-stream block size: " << block_tokens << endl;
+                return false;
+            }
+            
+            int bad_stream;
+            if (!read_split_block(reader, block_tokens, backend, streams, backend_bytes, bad_stream)) {
+                cerr << "Invalid split stream " << bad_stream << endl;
+                return false;
+            }
+            
+            // Reading past the end of a stream gives UINT32_MAX, which every
+            // check below rejects
+            size_t positions[STREAM_COUNT] = {};
+            auto next = [&](int s) {
+                return positions[s] < streams[s].size() ? streams[s][positions[s]++] : UINT32_MAX;
+            };
+            
+            uint32_t class_symbol = 0;
+            uint32_t classes_left = 0;
+            auto next_class = [&]() {
+                if (classes_left == 0) {
+                    class_symbol = next(STREAM_CLASS);
+                    classes_left = CLASSES_PER_SYMBOL;
+                }
+                classes_left--;
+                return (class_symbol >> (2 * classes_left)) & 3;
+            };
+            
+            // A word from its class and code, as a word ID
+            auto next_word = [&](uint32_t token_class, uint32_t& id) {
+                if (token_class == SPLIT_MAIN_WORD) {
+                    id = next(STREAM_MAIN);
+                    if (id >= main_size) {
+                        cerr << "Invalid word code in main dictionary: " << id << endl;
+                        return false;
+                    }
+                } else if (token_class == SPLIT_LOCAL_WORD) {
+                    uint32_t code = next(STREAM_LOCAL);
+                    if (code >= local_words.size()) {
+                        cerr << "Invalid word code in local dictionary: " << code << endl;
+                        return false;
+                    }
+                    id = main_size + code;
+                } else {
+                    cerr << "Invalid word class: " << token_class << endl;
+                    return false;
+                }
+                return true;
+            };
+            
+            // The streams bound the IDs the block writes: a word or filler
+            // code writes at most one, and a phrase or match no more than
+            // its length. So history is sized once and IDs are written
+            // through a pointer; size counts those written so far.
+            uint64_t bound = streams[STREAM_MAIN].size() + streams[STREAM_LOCAL].size();
+            for (uint32_t phrase_id : streams[STREAM_PHRASE]) {
+                bound += phrase_id < phrase_expansions.size() ? phrase_expansions[phrase_id].word_count : 0;
+            }
+            for (size_t i = 1; i < streams[STREAM_MATCH].size(); i += 2) {
+                bound += streams[STREAM_MATCH][i] + MIN_MATCH_LENGTH - 1;
+            }
+            history.resize(size + bound);
+            
+            auto prefetch_phrases = [&]() {
+                const vector<uint32_t>& phrases = streams[STREAM_PHRASE];
+                size_t ahead = positions[STREAM_PHRASE] + PHRASE_PREFETCH_DISTANCE;
+                if (ahead < phrases.size() && phrases[ahead] < phrase_expansions.size()) {
+                    __builtin_prefetch(&phrase_expansions[phrases[ahead]]);
+                }
+                ahead -= PHRASE_PREFETCH_DISTANCE / 2;
+                if (ahead < phrases.size() && phrases[ahead] < phrase_expansions.size()) {
+                    const PhraseExpansion& phrase = phrase_expansions[phrases[ahead]];
+                    __builtin_prefetch(phrase_words.data() + phrase.word_start);
+                    __builtin_prefetch(phrase_fillers.data() + phrase.filler_start);
+                }
+            };
+            
+            for (uint32_t token_idx = 0; token_idx < block_tokens; ++token_idx) {
+                uint32_t token_class = next_class();
+                
+                if (token_class == SPLIT_MAIN_WORD || token_class == SPLIT_LOCAL_WORD) {
+                    uint32_t id;
+                    if (!next_word(token_class, id)) {
+                        return false;
+                    }
+                    history[size++] = id;
+                    stats.count_token(id < main_size ? STATS_MAIN_WORD : STATS_LOCAL_WORD);
+                } else if (token_class == SPLIT_MATCH) {
+                    // Back-reference into the decoded stream; may overlap itself
+                    uint32_t distance = next(STREAM_MATCH);
+                    uint32_t length_code = next(STREAM_MATCH);
+                    uint32_t length = length_code + MIN_MATCH_LENGTH - 1;
+                    if (distance == 0 || distance > size) {
+                        cerr << "Invalid match distance: " << distance << endl;
+                        return false;
+                    }
+                    if (length_code == UINT32_MAX) {
+                        cerr << "Missing match length" << endl;
+                        return false;
+                    }
+                    
+                    uint32_t* out = history.data() + size;
+                    const uint32_t* from = out - distance;
+                    for (uint32_t k = 0; k < length; ++k) {
+                        out[k] = from[k];
+                    }
+                    size += length;
+                    stats.count_token(STATS_MATCH);
+                    stats.count_match_length(length);
+                } else if (token_class == SPLIT_PHRASE) {
+                    prefetch_phrases();
+                    uint32_t phrase_id = next(STREAM_PHRASE);
+                    if (phrase_id >= phrase_expansions.size()) {
+                        cerr << "Invalid phrase ID: " << phrase_id << endl;
+                        return false;
+                    }
+                    const PhraseExpansion& phrase = phrase_expansions[phrase_id];
+                    stats.count_token(STATS_PHRASE);
+                    
+                    // Copy the phrase's words, then put the wildcard word in
+                    uint32_t* out = history.data() + size;
+                    memcpy(out, phrase_words.data() + phrase.word_start, phrase.word_count * sizeof(uint32_t));
+                    if (phrase.wildcard_pos != PhraseExpansion::NO_WILDCARD) {
+                        stats.count_token(STATS_FILLER);
+                        uint32_t filler = next(STREAM_FILLER);
+                        if (filler < phrase.filler_count) {
+                            out[phrase.wildcard_pos] = phrase_fillers[phrase.filler_start + filler];
+                        } else if (!next_word(next_class(), out[phrase.wildcard_pos])) {
+                            return false;
+                        }
+                    }
+                    size += phrase.word_count;
+                } else {
+                    cerr << "Invalid token class: " << token_class << endl;
+                    return false;
+                }
+            }
+            decoded += block_tokens;
+        }
+        history.resize(size);
+        
+        return true;
+    }
+    
+    // Entropy-coded token stream: word symbols are their word IDs, phrase
+    // symbols follow the local words and the last symbol escapes a match
+    bool decode_entropy_tokens(BitReader& reader, const vector<string>& local_words,
+                               uint32_t token_count, vector<uint32_t>& history) {
+        uint32_t main_size = main_decode_dict.size();
+        uint32_t phrase_base = main_size + local_words.size();
+        uint32_t match_symbol = phrase_base + phrase_decode_dict.size();
+        
+        HuffmanCoder token_coder, filler_coder;
+        if (!token_coder.read_table(reader) || !filler_coder.read_table(reader)) {
+            cerr << "Invalid token code tables" << endl;
+            return false;
+        }
+        
+        for (uint32_t token_idx = 0; token_idx < token_count; ++token_idx) {
+            if (reader.overran()) {
+                cerr << "Compressed data ends inside the token stream" << endl;
+                return false;
+            }
+            uint32_t symbol = token_coder.decode(reader);
+            
+            if (symbol < phrase_base) {
+                history.push_back(symbol);
+                stats.count_token(symbol < main_size ? STATS_MAIN_WORD : STATS_LOCAL_WORD);
+            } else if (symbol < match_symbol) {
+                const auto& phrase = phrase_decode_dict[symbol - phrase_base];
+                uint32_t wildcard_id = 0;
+                stats.count_token(STATS_PHRASE);
+                if (phrase.has_wildcard) {
+                    stats.count_token(STATS_FILLER);
+                }
+                
+                if (phrase.has_wildcard) {
+                    uint32_t filler = filler_coder.decode(reader);
+                    if (filler < phrase.filler_codes.size()) {
+                        wildcard_id = phrase.filler_codes[filler];
+                    } else if (filler == FILLER_ESCAPE) {
+                        wildcard_id = token_coder.decode(reader);
+                    } else {
+                        wildcard_id = UINT32_MAX;
+                    }
+                    if (wildcard_id >= phrase_base) {
+                        cerr << "Invalid wildcard filler in phrase: " << symbol - phrase_base << endl;
+                        return false;
+                    }
+                }
+                
+                for (size_t i = 0; i < phrase.word_codes.size(); ++i) {
+                    if (phrase.has_wildcard && i == phrase.wildcard_pos) {
+                        history.push_back(wildcard_id);
+                    } else if (phrase.word_codes[i] < main_size) {
+                        history.push_back(phrase.word_codes[i]);
+                    } else {
+                        cerr << "Invalid word code in phrase: " << phrase.word_codes[i] << endl;
+                        return false;
+                    }
+                }
+            } else if (symbol == match_symbol) {
+                uint32_t distance = reader.read_gamma();
+                uint32_t length = reader.read_gamma() + MIN_MATCH_LENGTH - 1;
+                if (distance == 0 || distance > history.size()) {
+                    cerr << "Invalid match distance: " << distance << endl;
+                    return false;
+                }
+                
+                size_t from = history.size() - distance;
+                for (uint32_t k = 0; k < length; ++k) {
+                    history.push_back(history[from + k]);
+                }
+                stats.count_token(STATS_MATCH);
+                stats.count_match_length(length);
+            } else {
+                cerr << "Invalid token symbol: " << symbol << endl;
+                return false;
+            }
+        }
+        
+        if (reader.overran()) {
+            cerr << "Compressed data ends inside the token stream" << endl;
+            return false;
+        }
+        return true;
+    }
+    
+    // Search over a split-stream archive keeps the streams of every block
+    // and walks the class stream without rebuilding the text: a cursor is
+    // where a walk stands, and a walk yields one top-level token at a time
+    struct SplitCursor {
+        uint64_t position = 0;  // Of the next word in the archive
+        uint32_t tokens = 0;    // Top-level tokens read
+        size_t classes = 0;     // Classes read, escaped fillers included
+        size_t values[STREAM_COUNT] = {};
+    };
+    
+    struct SplitToken {
+        uint64_t position;
+        uint32_t token_class;
+        uint32_t code;    // Word ID, phrase ID or match distance
+        uint32_t length;  // In words
+        uint32_t filler;  // Word ID of a phrase's wildcard word
+    };
+    
+    struct SearchBlock {
+        uint32_t tokens = 0;
+        vector<uint32_t> streams[STREAM_COUNT];
+        uint64_t start = 0;         // Position of its first word
+        uint64_t words = 0;
+        bool has_terms = false;     // A tracked ID, or a phrase that may hold one, is in its streams
+        vector<SplitCursor> checkpoints;  // Every SEARCH_CHECKPOINT_TOKENS tokens, once walked
+        BitReader reader{nullptr, 0};     // At its first stream
+        bool loaded = false;        // Streams decoded
+        
+        // With a block index: numbers in the blocks before, and where the
+        // block's own are, once a context has needed one of them
+        uint64_t numbers_before = 0;
+        vector<uint64_t> number_positions;
+        bool numbers_found = false;
+    };
+    
+    // A phrase-mode archive opened for search. The walk tracks where the
+    // anchor, the query word searched for, and without a block index every
+    // number occur.
+    struct SearchArchive {
+        vector<string> local_words;   // The number stand-in included
+        uint32_t number_id = UINT32_MAX;
+        const BackendCodec* backend = nullptr;
+        bool indexed = false;         // Blocks are known from a block index
+        uint64_t indexed_numbers = 0; // Numbers it counts in all blocks
+        vector<string> numbers;
+        vector<SearchBlock> blocks;   // Split-stream archives
+        vector<uint32_t> history;     // Other archives: all word IDs
+        uint64_t words = 0;
+        
+        uint32_t anchor = UINT32_MAX;
+        vector<bool> anchor_phrases;  // Phrases with the anchor as a fixed word or a table filler
+        vector<uint64_t> anchor_positions;
+        vector<uint64_t> number_positions;
+        
+        // Where the last read of word IDs stopped
+        size_t resume_block = SIZE_MAX;
+        SplitCursor resume;
+    };
+    
+    // Move the cursor past one top-level token of the block; false if the
+    // streams are malformed there
+    bool next_split_token(const SearchArchive& archive, const SearchBlock& block, SplitCursor& cursor,
+                          SplitToken& token) const {
+        uint32_t main_size = main_decode_dict.size();
+        auto next = [&](int s, uint32_t& value) {
+            if (cursor.values[s] >= block.streams[s].size()) {
+                return false;
+            }
+            value = block.streams[s][cursor.values[s]++];
+            return true;
+        };
+        auto next_class = [&](uint32_t& token_class) {
+            size_t symbol = cursor.classes / CLASSES_PER_SYMBOL;
+            if (symbol >= block.streams[STREAM_CLASS].size()) {
+                return false;
+            }
+            uint32_t shift = 2 * (CLASSES_PER_SYMBOL - 1 - cursor.classes % CLASSES_PER_SYMBOL);
+            token_class = (block.streams[STREAM_CLASS][symbol] >> shift) & 3;
+            cursor.classes++;
+            return true;
+        };
+        auto next_word = [&](uint32_t& id) {
+            uint32_t word_class, code;
+            if (!next_class(word_class)) {
+                return false;
+            }
+            if (word_class == SPLIT_MAIN_WORD) {
+                return next(STREAM_MAIN, id) && id < main_size;
+            }
+            if (word_class == SPLIT_LOCAL_WORD && next(STREAM_LOCAL, code) && code < archive.local_words.size()) {
+                id = main_size + code;
+                return true;
+            }
+            return false;
+        };
+        
+        // Peek at the class; words read it again through next_word
+        SplitCursor start = cursor;
+        token.position = cursor.position;
+        if (!next_class(token.token_class)) {
+            return false;
+        }
+        if (token.token_class == SPLIT_MAIN_WORD || token.token_class == SPLIT_LOCAL_WORD) {
+            cursor = start;
+            if (!next_word(token.code)) {
+                return false;
+            }
+            token.length = 1;
+        } else if (token.token_class == SPLIT_MATCH) {
+            uint32_t length_code;
+            if (!next(STREAM_MATCH, token.code) || !next(STREAM_MATCH, length_code) ||
+                token.code == 0 || token.code > cursor.position || length_code > UINT32_MAX - MIN_MATCH_LENGTH) {
+                return false;
+            }
+            token.length = length_code + MIN_MATCH_LENGTH - 1;
+        } else {
+            if (!next(STREAM_PHRASE, token.code) || token.code >= phrase_expansions.size()) {
+                return false;
+            }
+            const PhraseExpansion& phrase = phrase_expansions[token.code];
+            token.length = phrase.word_count;
+            if (phrase.wildcard_pos != PhraseExpansion::NO_WILDCARD) {
+                uint32_t filler;
+                if (!next(STREAM_FILLER, filler)) {
+                    return false;
+                }
+                if (filler < phrase.filler_count) {
+                    token.filler = phrase_fillers[phrase.filler_start + filler];
+                } else if (!next_word(token.filler)) {
+                    return false;
+                }
+            }
+        }
+        cursor.position += token.length;
+        cursor.tokens++;
+        return true;
+    }
+    
+    // Positions in a sorted list that a match copies, appended shifted to
+    // the copy. A match may overlap itself, so entries it adds are copied
+    // on in turn.
+    static void track_match(vector<uint64_t>& positions, const SplitToken& match) {
+        uint64_t source = match.position - match.code;
+        size_t i = lower_bound(positions.begin(), positions.end(), source) - positions.begin();
+        for (; i < positions.size() && positions[i] < source + match.length; ++i) {
+            positions.push_back(positions[i] + match.code);
+        }
+    }
+    
+    static void track_word(SearchArchive& archive, uint32_t id, uint64_t position) {
+        if (id == archive.anchor) {
+            archive.anchor_positions.push_back(position);
+        }
+        if (id == archive.number_id && !archive.indexed) {
+            archive.number_positions.push_back(position);
+        }
+    }
+    
+    // Walk a whole block, keeping checkpoints, and with track also where the
+    // anchor and the numbers are; false if the block is malformed
+    bool walk_split_block(SearchArchive& archive, SearchBlock& block, bool track) const {
+        SplitCursor cursor;
+        cursor.position = block.start;
+        SplitToken token;
+        block.checkpoints.clear();
+        while (cursor.tokens < block.tokens) {
+            if (cursor.tokens % SEARCH_CHECKPOINT_TOKENS == 0) {
+                block.checkpoints.push_back(cursor);
+            }
+            if (!next_split_token(archive, block, cursor, token)) {
+                return false;
+            }
+            if (!track) {
+                continue;
+            }
+            
+            if (token.token_class == SPLIT_MATCH) {
+                track_match(archive.anchor_positions, token);
+                if (!archive.indexed) {
+                    track_match(archive.number_positions, token);
+                }
+            } else if (token.token_class == SPLIT_PHRASE) {
+                const PhraseExpansion& phrase = phrase_expansions[token.code];
+                if (archive.anchor_phrases[token.code]) {
+                    for (uint32_t k = 0; k < phrase.word_count; ++k) {
+                        uint32_t id = k == phrase.wildcard_pos ? token.filler : phrase_words[phrase.word_start + k];
+                        track_word(archive, id, token.position + k);
+                    }
+                } else if (phrase.wildcard_pos != PhraseExpansion::NO_WILDCARD) {
+                    track_word(archive, token.filler, token.position + phrase.wildcard_pos);
+                }
+            } else {
+                track_word(archive, token.code, token.position);
+            }
+        }
+        return cursor.position == block.start + block.words;
+    }
+    
+    // Count the words of a block from its streams alone, and test them for
+    // the anchor and for numbers; a block without either need not be walked
+    bool summarize_split_block(const SearchArchive& archive, SearchBlock& block) const {
+        uint32_t main_size = main_decode_dict.size();
+        const vector<uint32_t>* streams = block.streams;
+        const vector<uint32_t>& fillers = streams[STREAM_FILLER];
+        
+        // Escaped fillers take a word code like the word tokens do
+        uint64_t escapes = 0;
+        size_t filler = 0;
+        block.words = 0;
+        block.has_terms = false;
+        for (uint32_t phrase_id : streams[STREAM_PHRASE]) {
+            if (phrase_id >= phrase_expansions.size()) {
+                return false;
+            }
+            const PhraseExpansion& phrase = phrase_expansions[phrase_id];
+            block.words += phrase.word_count;
+            block.has_terms |= archive.anchor_phrases[phrase_id];
+            if (phrase.wildcard_pos != PhraseExpansion::NO_WILDCARD) {
+                if (filler >= fillers.size()) {
+                    return false;
+                }
+                escapes += fillers[filler++] >= phrase.filler_count;
+            }
+        }
+        uint64_t codes = streams[STREAM_MAIN].size() + streams[STREAM_LOCAL].size();
+        if (escapes > codes) {
+            return false;
+        }
+        block.words += codes - escapes;
+        for (size_t i = 0; i + 1 < streams[STREAM_MATCH].size(); i += 2) {
+            block.words += static_cast<uint64_t>(streams[STREAM_MATCH][i + 1]) + MIN_MATCH_LENGTH - 1;
+        }
+        
+        auto holds = [&](uint32_t id) {
+            const vector<uint32_t>& codes = id < main_size ? streams[STREAM_MAIN] : streams[STREAM_LOCAL];
+            uint32_t code = id < main_size ? id : id - main_size;
+            return IdScan::find(codes.data(), codes.size(), code) < codes.size();
+        };
+        block.has_terms |= holds(archive.anchor) || (archive.number_id != UINT32_MAX && holds(archive.number_id));
+        return true;
+    }
+    
+    // Skip one split stream without decoding it
+    static bool skip_split_stream(BitReader& reader) {
+        uint8_t coding = reader.read_bits(8);
+        reader.read_bits(8);
+        reader.read_bits(32);
+        uint32_t size = reader.read_bits(32);
+        uint32_t stored_size = (coding & CODING_BACKEND_BIT) ? reader.read_bits(32) : size;
+        return reader.read_bytes(stored_size) != nullptr;
+    }
+    
+    // Whether a match of a block may copy a tracked position. The block
+    // does not hold one itself, so a match copies one only from before the
+    // block, at its distance back from somewhere in the block.
+    static bool reaches_tracked(const SearchArchive& archive, const SearchBlock& block) {
+        const vector<uint32_t>& matches = block.streams[STREAM_MATCH];
+        for (size_t i = 0; i + 1 < matches.size(); i += 2) {
+            uint64_t distance = matches[i];
+            uint64_t first = block.start - min<uint64_t>(block.start, distance);
+            uint64_t end = block.start + block.words - min(block.start + block.words, distance) +
+                           matches[i + 1] + MIN_MATCH_LENGTH - 1;
+            for (const vector<uint64_t>* positions : {&archive.anchor_positions, &archive.number_positions}) {
+                auto it = lower_bound(positions->begin(), positions->end(), first);
+                if (it != positions->end() && *it < end) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    
+    // Decode the streams of a block and count its words; false if they are
+    // malformed or, where the blocks come from an index, if the count is
+    // not the one it gives
+    bool load_split_block(const SearchArchive& archive, SearchBlock& block, vector<uint8_t>& backend_bytes) const {
+        uint64_t indexed_words = block.words;
+        BitReader reader = block.reader;
+        int bad_stream;
+        block.loaded = read_split_block(reader, block.tokens, archive.backend, block.streams, backend_bytes,
+                                        bad_stream) &&
+                       summarize_split_block(archive, block) && (!archive.indexed || block.words == indexed_words);
+        return block.loaded;
+    }
+    
+    // Load the given blocks of an archive on all cores
+    bool load_split_blocks(SearchArchive& archive, const vector<size_t>& which) const {
+        vector<char> valid(which.size(), 0);
+        auto load_blocks = [&](size_t first, size_t step) {
+            vector<uint8_t> backend_bytes;
+            for (size_t i = first; i < which.size(); i += step) {
+                valid[i] = load_split_block(archive, archive.blocks[which[i]], backend_bytes);
+            }
+        };
+        size_t thread_count = min<size_t>(which.size(), max(1u, thread::hardware_concurrency()));
+        vector<thread> threads;
+        for (size_t t = 1; t < thread_count; ++t) {
+            threads.emplace_back(load_blocks, t, thread_count);
+        }
+        load_blocks(0, thread_count);
+        for (auto& worker : threads) {
+            worker.join();
+        }
+        for (size_t i = 0; i < which.size(); ++i) {
+            if (!valid[i]) {
+                cerr << "Invalid split-stream block: " << which[i] << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // Find the anchor and the numbers in the split streams of an archive.
+    // Blocks are found by their stream lengths, and their streams decoded
+    // and tested on all cores; then the blocks that may hold a tracked ID
+    // are walked in order. A block is skipped unless it holds the anchor or
+    // a number, or its matches reach back to one.
+    bool scan_split_streams(BitReader& reader, uint32_t token_count, SearchArchive& archive) {
+        stats.timer.begin("stream_read");
+        vector<SearchBlock>& blocks = archive.blocks;
+        reader.align_to_byte();
+        uint32_t decoded = 0;
+        while (decoded < token_count) {
+            uint32_t block_tokens = reader.read_bits(32);
+            if (block_tokens == 0 || block_tokens > token_count - decoded) {
+                cerr << "Invalid split-stream block size: " << block_tokens << endl;
+                return false;
+            }
+            blocks.emplace_back();
+            blocks.back().tokens = block_tokens;
+            blocks.back().reader = reader;
+            for (int s = 0; s < STREAM_COUNT; ++s) {
+                if (!skip_split_stream(reader)) {
+                    cerr << "Invalid split stream " << s << endl;
+                    return false;
+                }
+            }
+            decoded += block_tokens;
+        }
+        
+        vector<size_t> all(blocks.size());
+        iota(all.begin(), all.end(), 0);
+        if (!load_split_blocks(archive, all)) {
+            return false;
+        }
+        stats.timer.end();
+        
+        StageTimer::Scope stage(stats.timer, "scan");
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            SearchBlock& block = blocks[b];
+            block.start = archive.words;
+            archive.words += block.words;
+            
+            if ((block.has_terms || reaches_tracked(archive, block)) && !walk_split_block(archive, block, true)) {
+                cerr << "Invalid split-stream block: " << b << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // The same with a block index: the blocks and their counts come from
+    // the index, and only the blocks in walk are decoded and walked for the
+    // anchor. A match only copies words the index lists for its own block,
+    // so every block that holds or copies the anchor is among them. Numbers
+    // are found per block when a context reads one. The reader is left past
+    // the last block, as the number values follow it.
+    bool scan_indexed_blocks(BitReader& reader, const uint8_t* data, size_t size, uint32_t token_count,
+                             const BlockIndex& index, const vector<size_t>& walk, SearchArchive& archive) {
+        stats.timer.begin("stream_read");
+        vector<SearchBlock>& blocks = archive.blocks;
+        uint64_t decoded = 0;
+        for (const BlockIndex::Block& entry : index.get_blocks()) {
+            if (entry.offset > size - 4) {
+                cerr << "Block index does not match the archive: block at byte " << entry.offset << endl;
+                return false;
+            }
+            blocks.emplace_back();
+            SearchBlock& block = blocks.back();
+            block.reader = BitReader(data + entry.offset, size - entry.offset);
+            block.tokens = block.reader.read_bits(32);
+            block.start = archive.words;
+            block.words = entry.words;
+            block.numbers_before = archive.indexed_numbers;
+            archive.words += entry.words;
+            archive.indexed_numbers += entry.numbers;
+            decoded += block.tokens;
+            if (block.tokens == 0 || decoded > token_count) {
+                cerr << "Invalid split-stream block size: " << block.tokens << endl;
+                return false;
+            }
+        }
+        if (decoded != token_count) {
+            cerr << "Block index does not match the archive: " << decoded << " tokens" << endl;
+            return false;
+        }
+        if (!blocks.empty()) {
+            reader = blocks.back().reader;
+            for (int s = 0; s < STREAM_COUNT; ++s) {
+                if (!skip_split_stream(reader)) {
+                    cerr << "Invalid split stream " << s << endl;
+                    return false;
+                }
+            }
+        }
+        
+        if (!load_split_blocks(archive, walk)) {
+            return false;
+        }
+        stats.timer.end();
+        
+        StageTimer::Scope stage(stats.timer, "scan");
+        for (size_t b : walk) {
+            if (!walk_split_block(archive, blocks[b], true)) {
+                cerr << "Invalid split-stream block: " << b << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // Block holding a position of a split-stream archive, loaded if it was
+    // not and walked at least once so that it has checkpoints
+    bool search_block(SearchArchive& archive, uint64_t position, size_t& b) const {
+        auto block_it = upper_bound(archive.blocks.begin(), archive.blocks.end(), position,
+                                    [](uint64_t p, const SearchBlock& block) { return p < block.start; });
+        b = block_it - archive.blocks.begin() - 1;
+        SearchBlock& block = archive.blocks[b];
+        vector<uint8_t> backend_bytes;
+        if ((!block.loaded && !load_split_block(archive, block, backend_bytes)) ||
+            (block.checkpoints.empty() && !walk_split_block(archive, block, false))) {
+            cerr << "Invalid split-stream block at word " << position << endl;
+            return false;
+        }
+        return true;
+    }
+    
+    // Word ID at a position of a split-stream archive. The walk starts at
+    // the nearest checkpoint, and a match sends it back to what it copies;
+    // a match that overlaps itself repeats every distance words.
+    bool search_word_id(SearchArchive& archive, uint64_t position, uint32_t& id) const {
+        while (true) {
+            size_t b;
+            if (!search_block(archive, position, b)) {
+                return false;
+            }
+            const SearchBlock& block = archive.blocks[b];
+            auto checkpoint = upper_bound(block.checkpoints.begin(), block.checkpoints.end(), position,
+                                          [](uint64_t p, const SplitCursor& cursor) { return p < cursor.position; });
+            SplitCursor cursor = *(checkpoint - 1);
+            SplitToken token;
+            do {
+                if (!next_split_token(archive, block, cursor, token)) {
+                    return false;
+                }
+            } while (cursor.position <= position);
+            
+            if (token.token_class == SPLIT_MATCH) {
+                position = token.position - token.code + (position - token.position) % token.code;
+                continue;
+            }
+            if (token.token_class == SPLIT_PHRASE) {
+                const PhraseExpansion& phrase = phrase_expansions[token.code];
+                uint32_t offset = position - token.position;
+                id = offset == phrase.wildcard_pos ? token.filler : phrase_words[phrase.word_start + offset];
+            } else {
+                id = token.code;
+            }
+            return true;
+        }
+    }
+    
+    // Word IDs at positions first to end of an archive, appended to ids.
+    // Hits come in order, so in split streams each read resumes at the token
+    // where the last one began when it can; the reads of what matches copy,
+    // at depth above 0, start at a checkpoint instead.
+    bool search_word_ids(SearchArchive& archive, uint64_t first, uint64_t end, vector<uint32_t>& ids,
+                         int depth = 0) const {
+        if (archive.blocks.empty()) {
+            ids.insert(ids.end(), archive.history.begin() + first, archive.history.begin() + end);
+            return true;
+        }
+        while (first < end) {
+            size_t b;
+            if (!search_block(archive, first, b)) {
+                return false;
+            }
+            const SearchBlock& block = archive.blocks[b];
+            SplitCursor cursor = archive.resume;
+            if (depth > 0 || archive.resume_block != b || cursor.position > first) {
+                auto checkpoint = upper_bound(block.checkpoints.begin(), block.checkpoints.end(), first,
+                                              [](uint64_t p, const SplitCursor& c) { return p < c.position; });
+                cursor = *(checkpoint - 1);
+            }
+            
+            // Read the tokens from the one holding first to the end of the
+            // range or of the block
+            SplitToken token;
+            SplitCursor token_start;
+            bool resumed = false;
+            while (first < end && cursor.tokens < block.tokens) {
+                token_start = cursor;
+                if (!next_split_token(archive, block, cursor, token)) {
+                    return false;
+                }
+                if (cursor.position <= first) {
+                    continue;
+                }
+                if (!resumed && depth == 0) {
+                    archive.resume_block = b;
+                    archive.resume = token_start;
+                    resumed = true;
+                }
+                uint64_t token_end = min(end, cursor.position);
+                if (token.token_class == SPLIT_MATCH && depth < SEARCH_MATCH_DEPTH &&
+                    token_end - token.code <= token.position) {
+                    if (!search_word_ids(archive, first - token.code, token_end - token.code, ids, depth + 1)) {
+                        return false;
+                    }
+                    first = token_end;
+                    continue;
+                }
+                for (uint64_t position = first; position < token_end; ++position) {
+                    uint32_t id = token.code;
+                    if (token.token_class == SPLIT_MATCH && !search_word_id(archive, position - token.code, id)) {
+                        return false;
+                    }
+                    if (token.token_class == SPLIT_PHRASE) {
+                        const PhraseExpansion& phrase = phrase_expansions[token.code];
+                        uint32_t offset = position - token.position;
+                        id = offset == phrase.wildcard_pos ? token.filler : phrase_words[phrase.word_start + offset];
+                    }
+                    ids.push_back(id);
+                    first = position + 1;
+                }
+            }
+        }
+        return true;
+    }
+    
+    // Ordinal of the number at a position of an archive. Without a block
+    // index the scan tracked every number; with one, the numbers of a block
+    // are found by reading its word IDs the first time one is needed, and
+    // the index tells how many come before it.
+    bool search_number(SearchArchive& archive, uint64_t position, size_t& ordinal) const {
+        const vector<uint64_t>* positions = &archive.number_positions;
+        uint64_t before = 0;
+        if (archive.indexed) {
+            size_t b;
+            if (!search_block(archive, position, b)) {
+                return false;
+            }
+            SearchBlock& block = archive.blocks[b];
+            if (!block.numbers_found) {
+                vector<uint32_t> block_ids;
+                if (!search_word_ids(archive, block.start, block.start + block.words, block_ids, 1)) {
+                    return false;
+                }
+                for (size_t i = 0; i < block_ids.size(); ++i) {
+                    if (block_ids[i] == archive.number_id) {
+                        block.number_positions.push_back(block.start + i);
+                    }
+                }
+                block.numbers_found = true;
+            }
+            positions = &block.number_positions;
+            before = block.numbers_before;
+        }
+        size_t i = lower_bound(positions->begin(), positions->end(), position) - positions->begin();
+        if (i == positions->size() || (*positions)[i] != position || before + i >= archive.numbers.size()) {
+            cerr << "Number at word " << position << " was not found in the scan" << endl;
+            return false;
+        }
+        ordinal = before + i;
+        return true;
+    }
+    
+    // Text of a word ID at a position of an archive
+    bool search_word(SearchArchive& archive, uint32_t id, uint64_t position, string_view& word) const {
+        uint32_t main_size = main_decode_dict.size();
+        size_t ordinal;
+        if (id < main_size) {
+            word = main_decode_dict[id];
+        } else if (id != archive.number_id) {
+            word = archive.local_words[id - main_size];
+        } else if (search_number(archive, position, ordinal)) {
+            word = archive.numbers[ordinal];
+        } else {
+            return false;
+        }
+        return true;
+    }
+    
+    // Find the query in one segment of an archive, with its block index if
+    // it has a current one: pick the anchor among its words, find every
+    // place the anchor occurs, and check the other query words and read the
+    // context around each of those places only. Hit positions count from
+    // the start of the segment; words is its word count, or UINT64_MAX if
+    // it was not read as no query word can occur in it.
+    bool search_segment(const char* data, size_t data_size, pair<uint64_t, uint64_t> segment, uint8_t flags,
+                        const BackendCodec* backend, const BlockIndex* index, size_t file,
+                        const vector<string>& query, vector<SearchHit>& hits, uint64_t& segment_words) {
+        stats.timer.begin("stream_read");
+        BitReader reader(reinterpret_cast<const uint8_t*>(data) + segment.first, segment.second - segment.first);
+        segment_words = UINT64_MAX;
+        SearchArchive archive;
+        archive.backend = backend;
+        if (!read_local_dictionary(reader, archive.local_words)) {
+            stats.timer.end();
+            return false;
+        }
+        uint32_t main_size = main_decode_dict.size();
+        size_t real_local_size = archive.local_words.size();
+        if (flags & FLAG_NUMBERS) {
+            archive.number_id = main_size + archive.local_words.size();
+            archive.local_words.push_back("0");
+        }
+        
+        // Query words as word IDs; a word in neither dictionary occurs nowhere
+        vector<uint32_t> ids;
+        for (const auto& word : query) {
+            uint32_t id;
+            if (find_main_code(word, id)) {
+                ids.push_back(id);
+                continue;
+            }
+            auto local_it = find(archive.local_words.begin(), archive.local_words.begin() + real_local_size, word);
+            if (local_it != archive.local_words.begin() + real_local_size) {
+                ids.push_back(main_size + (local_it - archive.local_words.begin()));
+            } else if (archive.number_id != UINT32_MAX && is_number(word)) {
+                ids.push_back(archive.number_id);
+            } else {
+                stats.timer.end();
+                return true;
+            }
+        }
+        
+        // The anchor is the query word likely to be rarest: a local word, or
+        // the main word with the highest code, as codes go by frequency.
+        // Numbers share one ID, so they come last.
+        auto rarity = [&](uint32_t id) -> uint64_t {
+            return id == archive.number_id ? 0 : id >= main_size ? UINT64_MAX : 1 + static_cast<uint64_t>(id);
+        };
+        size_t anchor_index = 0;
+        for (size_t k = 1; k < ids.size(); ++k) {
+            if (rarity(ids[k]) > rarity(ids[anchor_index])) {
+                anchor_index = k;
+            }
+        }
+        archive.anchor = ids[anchor_index];
+        archive.anchor_phrases.assign(phrase_expansions.size(), false);
+        for (size_t p = 0; p < phrase_expansions.size() && archive.anchor < main_size; ++p) {
+            const PhraseExpansion& phrase = phrase_expansions[p];
+            const uint32_t* words = phrase_words.data() + phrase.word_start;
+            const uint32_t* fillers = phrase_fillers.data() + phrase.filler_start;
+            for (uint32_t k = 0; k < phrase.word_count; ++k) {
+                if (k != phrase.wildcard_pos && words[k] == archive.anchor) {
+                    archive.anchor_phrases[p] = true;
+                }
+            }
+            if (IdScan::find(fillers, phrase.filler_count, archive.anchor) < phrase.filler_count) {
+                archive.anchor_phrases[p] = true;
+            }
+        }
+        
+        // With a block index, the blocks a hit can start in: those that hold
+        // each query word, itself or in a phrase, or for a query of more
+        // words the block after, as a hit may run on into it
+        vector<uint32_t> candidates;
+        vector<size_t> walk;
+        archive.indexed = index != nullptr;
+        if (archive.indexed) {
+            uint32_t phrase_base = main_size + real_local_size + 1;
+            auto term_blocks = [&](uint32_t id) {
+                BlockIndex::Postings postings = index->find(id);
+                vector<uint32_t> blocks(postings.first, postings.last);
+                for (size_t p = 0; p < phrase_expansions.size() && id < main_size; ++p) {
+                    const PhraseExpansion& phrase = phrase_expansions[p];
+                    const uint32_t* words = phrase_words.data() + phrase.word_start;
+                    for (uint32_t k = 0; k < phrase.word_count; ++k) {
+                        if (k != phrase.wildcard_pos && words[k] == id) {
+                            postings = index->find(phrase_base + p);
+                            blocks.insert(blocks.end(), postings.first, postings.last);
+                            break;
+                        }
+                    }
+                }
+                sort(blocks.begin(), blocks.end());
+                blocks.erase(unique(blocks.begin(), blocks.end()), blocks.end());
+                return blocks;
+            };
+            
+            vector<uint32_t> anchor_blocks;
+            for (size_t k = 0; k < ids.size(); ++k) {
+                vector<uint32_t> blocks = term_blocks(ids[k]);
+                if (k == anchor_index) {
+                    anchor_blocks = blocks;
+                }
+                if (ids.size() > 1) {
+                    for (size_t i = 0, count = blocks.size(); i < count; ++i) {
+                        if (blocks[i] > 0) {
+                            blocks.push_back(blocks[i] - 1);
+                        }
+                    }
+                    sort(blocks.begin(), blocks.end());
+                    blocks.erase(unique(blocks.begin(), blocks.end()), blocks.end());
+                }
+                candidates = k == 0 ? blocks : BlockIndex::intersect(candidates, blocks);
+            }
+            stats.blocks += index->get_blocks().size();
+            if (candidates.empty()) {
+                segment_words = 0;
+                for (const BlockIndex::Block& block : index->get_blocks()) {
+                    segment_words += block.words;
+                }
+                stats.timer.end();
+                return true;
+            }
+            
+            // The anchor is tracked up to the end of the block after the
+            // last candidate
+            for (uint32_t b : anchor_blocks) {
+                if (b <= candidates.back() + 1) {
+                    walk.push_back(b);
+                }
+            }
+        }
+        
+        // Find the anchor and the numbers: in split streams by walking the
+        // blocks that may hold them, otherwise in the decoded word IDs
+        stats.timer.end();
+        if (flags & FLAG_SPLIT_STREAMS) {
+            if (reader.bits_left() < 32) {
+                cerr << "Compressed data ends before the token count" << endl;
+                return false;
+            }
+            uint32_t token_count = reader.read_bits(32);
+            bool scanned = archive.indexed
+                               ? scan_indexed_blocks(reader, reinterpret_cast<const uint8_t*>(data), data_size,
+                                                     token_count, *index, walk, archive)
+                               : scan_split_streams(reader, token_count, archive);
+            if (!scanned) {
+                return false;
+            }
+            if (!archive.indexed) {
+                stats.blocks += archive.blocks.size();
+            }
+        } else {
+            StageTimer::Scope stage(stats.timer, "scan");
+            if (!decode_token_stream(reader, archive.local_words, flags, backend, archive.history)) {
+                return false;
+            }
+            const uint32_t* history = archive.history.data();
+            size_t words = archive.words = archive.history.size();
+            auto find_all = [&](uint32_t id, vector<uint64_t>& positions) {
+                for (size_t i = IdScan::find(history, words, id); i < words;
+                     i += 1 + IdScan::find(history + i + 1, words - i - 1, id)) {
+                    positions.push_back(i);
+                }
+            };
+            find_all(archive.anchor, archive.anchor_positions);
+            if (archive.number_id != UINT32_MAX) {
+                find_all(archive.number_id, archive.number_positions);
+            }
+        }
+        
+        StageTimer::Scope stage(stats.timer, "verify");
+        size_t number_count = archive.indexed ? archive.indexed_numbers : archive.number_positions.size();
+        if ((flags & FLAG_NUMBERS) && !decode_numbers(reader, backend, number_count, archive.numbers)) {
+            return false;
+        }
+        // Read the context of each place the anchor is at, and keep those
+        // where the query words are. Numbers share an ID, so their text is
+        // compared.
+        auto block_of = [&](uint64_t position) {
+            return static_cast<uint32_t>(upper_bound(archive.blocks.begin(), archive.blocks.end(), position,
+                                                     [](uint64_t p, const SearchBlock& block) {
+                                                         return p < block.start;
+                                                     }) - archive.blocks.begin() - 1);
+        };
+        vector<uint32_t> context_ids;
+        string_view word;
+        for (uint64_t anchor_position : archive.anchor_positions) {
+            if (anchor_position < anchor_index || anchor_position - anchor_index + query.size() > archive.words) {
+                continue;
+            }
+            uint64_t start = anchor_position - anchor_index;
+            if (archive.indexed && !binary_search(candidates.begin(), candidates.end(), block_of(start))) {
+                continue;
+            }
+            uint64_t first = start - min(start, SEARCH_CONTEXT_WORDS);
+            uint64_t end = min(archive.words, start + query.size() + SEARCH_CONTEXT_WORDS);
+            context_ids.clear();
+            if (!search_word_ids(archive, first, end, context_ids)) {
+                return false;
+            }
+            const uint32_t* found_ids = context_ids.data() + (start - first);
+            bool found = equal(ids.begin(), ids.end(), found_ids);
+            for (size_t k = 0; k < ids.size() && found; ++k) {
+                if (ids[k] == archive.number_id) {
+                    if (!search_word(archive, ids[k], start + k, word)) {
+                        return false;
+                    }
+                    found = word == query[k];
+                }
+            }
+            if (!found) {
+                continue;
+            }
+            
+            SearchHit hit;
+            hit.file = file;
+            hit.position = start;
+            for (size_t k = 0; k < context_ids.size(); ++k) {
+                if (!search_word(archive, context_ids[k], first + k, word)) {
+                    return false;
+                }
+                if (k > 0) {
+                    hit.context += ' ';
+                }
+                hit.context += word;
+            }
+            hits.push_back(move(hit));
+        }
+        
+        if (archive.blocks.empty()) {
+            stats.blocks++;
+            stats.blocks_read++;
+        }
+        for (const SearchBlock& block : archive.blocks) {
+            stats.blocks_read += block.loaded;
+        }
+        segment_words = archive.words;
+        return true;
+    }
+    
+    // Word count of a segment that search did not read
+    bool count_segment_words(const char* data, pair<uint64_t, uint64_t> segment, uint8_t flags,
+                             const BackendCodec* backend, uint64_t& words) {
+        StageTimer::Scope stage(stats.timer, "scan");
+        BitReader reader(reinterpret_cast<const uint8_t*>(data) + segment.first, segment.second - segment.first);
+        vector<string> local_words;
+        if (!read_local_dictionary(reader, local_words)) {
+            return false;
+        }
+        if (flags & FLAG_NUMBERS) {
+            local_words.push_back("0");
+        }
+        vector<uint32_t> history;
+        if (!decode_token_stream(reader, local_words, flags, backend, history)) {
+            return false;
+        }
+        words = history.size();
+        return true;
+    }
+    
+    // Find the query in one archive, segment by segment, and number the
+    // hits from the start of the archive. A hit does not run from one
+    // segment into the next.
+    bool search_archive(const string& input_file, size_t file, const vector<string>& query,
+                        vector<SearchHit>& hits) {
+        stats.timer.begin("stream_read");
+        MappedFile compressed;
+        if (!compressed.open(input_file)) {
+            cerr << "Error opening compressed file: " << input_file << endl;
+            return false;
+        }
+        const char* data = compressed.data();
+        size_t data_size = compressed.size();
+        BitReader reader(reinterpret_cast<const uint8_t*>(data), data_size);
+        stats.total_bits += data_size * 8;
+        if (data_size < 5 || !equal(data, data + 4, PHRASE_MAGIC)) {
+            cerr << "Search needs a phrase-mode compressed file: " << input_file << endl;
+            return false;
+        }
+        reader.read_bits(32);
+        
+        uint8_t flags = reader.read_bits(8);
+        const BackendCodec* backend = nullptr;
+        if (flags & FLAG_BACKEND) {
+            uint8_t backend_id = reader.read_bits(8);
+            backend = BackendCodec::find(backend_id);
+            if (backend == nullptr) {
+                cerr << "Compressed file needs a backend codec that is not built in: "
+                     << static_cast<int>(backend_id) << endl;
+                return false;
+            }
+        }
+        if (flags & FLAG_MEMBERS) {
+            cerr << "Search does not read member archives: " << input_file << endl;
+            return false;
+        }
+        size_t body = 5 + ((flags & FLAG_BACKEND) != 0);
+        vector<pair<uint64_t, uint64_t>> segments;
+        if (!read_segments(data, data_size, body, flags, segments)) {
+            cerr << "Invalid segment table: " << input_file << endl;
+            return false;
+        }
+        
+        // The index holds a section per segment, each ending where its
+        // segment does; one written before the last append is stale
+        vector<BlockIndex> sections;
+        bool indexed = (flags & FLAG_SPLIT_STREAMS) && BlockIndex::read(input_file + INDEX_SUFFIX, sections);
+        if (indexed) {
+            indexed = sections.size() == segments.size();
+            for (size_t s = 0; s < segments.size() && indexed; ++s) {
+                indexed = sections[s].segment_end() == segments[s].second;
+            }
+            if (!indexed) {
+                cerr << "Ignoring block index that does not match the archive: " << input_file << INDEX_SUFFIX << endl;
+            }
+        }
+        stats.timer.end();
+        
+        // Word counts of the segments, as far as they are known; those of
+        // segments ruled out are only needed for a hit after them
+        vector<uint64_t> segment_words(segments.size());
+        for (size_t s = 0; s < segments.size(); ++s) {
+            size_t first_hit = hits.size();
+            if (!search_segment(data, data_size, segments[s], flags, backend, indexed ? &sections[s] : nullptr,
+                                file, query, hits, segment_words[s])) {
+                return false;
+            }
+            if (hits.size() == first_hit || s == 0) {
+                continue;
+            }
+            uint64_t base = 0;
+            for (size_t before = 0; before < s; ++before) {
+                if (segment_words[before] == UINT64_MAX &&
+                    !count_segment_words(data, segments[before], flags, backend, segment_words[before])) {
+                    return false;
+                }
+                base += segment_words[before];
+            }
+            for (size_t h = first_hit; h < hits.size(); ++h) {
+                hits[h].position += base;
+            }
+        }
+        return true;
+    }
+    
+    // Byte ranges of the segments of a phrase-mode archive whose header ends
+    // at byte body: one from there to the end unless text was appended;
+    // false if the segment table is malformed
+    static bool read_segments(const char* data, size_t size, size_t body, uint8_t flags,
+                              vector<pair<uint64_t, uint64_t>>& segments) {
+        segments.clear();
+        if (!(flags & FLAG_SEGMENTS)) {
+            segments.emplace_back(body, size);
+            return true;
+        }
+        if (size < body + 8 || !equal(data + size - 4, data + size, SEGMENT_MAGIC)) {
+            return false;
+        }
+        BitReader count_reader(reinterpret_cast<const uint8_t*>(data) + size - 8, 4);
+        uint64_t count = count_reader.read_bits(32);
+        if (count == 0 || count > (size - body - 8) / 8) {
+            return false;
+        }
+        uint64_t table = size - 8 - 8 * count;
+        BitReader reader(reinterpret_cast<const uint8_t*>(data) + table, 8 * count);
+        for (uint64_t s = 0; s < count; ++s) {
+            uint64_t high = reader.read_bits(32);
+            uint64_t start = high << 32 | reader.read_bits(32);
+            if (s == 0 ? start != body : start < segments.back().first || start > table) {
+                return false;
+            }
+            if (s > 0) {
+                segments.back().second = start;
+            }
+            segments.emplace_back(start, table);
+        }
+        return true;
+    }
+    
+    // A segment decoded to word IDs, with what turns them into text
+    struct DecodedSegment {
+        vector<string> local_words;  // The number stand-in last, if numbers are coded
+        uint32_t number_id = UINT32_MAX;
+        vector<uint32_t> history;
+        vector<string> numbers;
+        TextForms forms;             // In lossless mode
+    };
+    
+    // How far the side lists of a segment are used up before a word: its
+    // numbers, case exceptions and separators
+    struct EmitPosition {
+        size_t number = 0;
+        size_t exception = 0;
+        size_t separator = 0;
+    };
+    
+    // Text written out in pieces small enough to stay in cache
+    struct TextSink {
+        ofstream& file;
+        vector<char> text;
+        char* out;
+        
+        explicit TextSink(ofstream& file) : file(file), text(TEXT_BUFFER_BYTES), out(text.data()) {}
+        
+        // Room for needed more bytes
+        void reserve(size_t needed) {
+            if (static_cast<size_t>(text.data() + text.size() - out) < needed) {
+                flush();
+                text.resize(max(text.size(), needed));
+                out = text.data();
+            }
+        }
+        
+        void flush() {
+            file.write(text.data(), out - text.data());
+            out = text.data();
+        }
+    };
+    
+    // Decode a segment of a phrase-mode archive, up to its text forms
+    bool decode_segment(BitReader& reader, uint8_t flags, const BackendCodec* backend, DecodedSegment& segment) {
+        StageTimer::Scope stage(stats.timer, "bit_decode");
+        if (!read_local_dictionary(reader, segment.local_words)) {
+            return false;
+        }
+        
+        // The number code gets a stand-in local entry, so the token decoders
+        // take it like any local code
+        uint32_t main_size = main_decode_dict.size();
+        if (flags & FLAG_NUMBERS) {
+            segment.number_id = main_size + segment.local_words.size();
+            segment.local_words.push_back("0");
+        }
+        
+        // Decode word IDs. Local words follow the main dictionary, and
+        // matches copy from the IDs decoded so far. Then the values of the
+        // numbers, in the order their IDs came out.
+        if (!decode_token_stream(reader, segment.local_words, flags, backend, segment.history)) {
+            return false;
+        }
+        if ((flags & FLAG_NUMBERS) &&
+            !decode_numbers(reader, backend, count(segment.history.begin(), segment.history.end(), segment.number_id),
+                            segment.numbers)) {
+            return false;
+        }
+        return !(flags & FLAG_LOSSLESS) ||
+               decode_text_forms(reader, segment.local_words, backend, segment.history, segment.number_id,
+                                 segment.numbers, segment.forms);
+    }
+    
+    // Write the words [first, last) of a decoded segment, from position, as
+    // decompress does: separated by spaces, or in lossless mode by their own
+    // whitespace and in their own case. Each word needs room for its
+    // separator and for main words to be copied in whole chunks. A word
+    // takes a space if words were written before it.
+    void emit_words(const DecodedSegment& segment, size_t first, size_t last, EmitPosition position,
+                    bool lossless, bool& words_before, TextSink& sink) const {
+        uint32_t main_size = main_decode_dict.size();
+        const TextForms& forms = segment.forms;
+        for (size_t i = first; i < last; ++i) {
+            uint32_t id = segment.history[i];
+            const string* word = id < main_size ? nullptr :
+                                 id == segment.number_id ? &segment.numbers[position.number++] :
+                                 &segment.local_words[id - main_size];
+            size_t length = word == nullptr ? main_decode_dict.length(id) : word->size();
+            const string* other = nullptr;
+            size_t separator_length = words_before;
+            if (lossless) {
+                uint8_t spacing = forms.spacings[i];
+                other = spacing == TextForms::SPACING_OTHER ? &forms.separators[position.separator++] : nullptr;
+                separator_length = other != nullptr ? other->size() : spacing != TextForms::SPACING_NONE;
+            }
+            sink.reserve(separator_length + length + StringPool::COPY_WIDTH);
+            char*& out = sink.out;
+            if (other != nullptr) {
+                memcpy(out, other->data(), separator_length);
+            } else if (separator_length > 0) {
+                *out = !lossless || forms.spacings[i] == TextForms::SPACING_SPACE ? ' ' : '\n';
+            }
+            out += separator_length;
+            
+            if (word == nullptr) {
+                main_decode_dict.copy_word(id, out);
+            } else {
+                memcpy(out, word->data(), length);
+            }
+            if (lossless && forms.cases[i] == TextForms::CASE_EXCEPTION) {
+                memcpy(out, forms.exceptions[position.exception++].data(), length);
+            } else if (lossless) {
+                TextForms::apply_case(out, length, forms.cases[i]);
+            }
+            out += length;
+            words_before = true;
+        }
+    }
+    
+    // Decode one segment of a phrase-mode archive and write its text. Its
+    // first word takes a space if words were written before it, unless the
+    // archive is lossless and keeps its own whitespace.
+    bool decompress_segment(BitReader& reader, uint8_t flags, const BackendCodec* backend, bool& words_before,
+                            ofstream& outfile) {
+        DecodedSegment segment;
+        if (!decode_segment(reader, flags, backend, segment)) {
+            return false;
+        }
+        StageTimer::Scope stage(stats.timer, "text_emit");
+        TextSink sink(outfile);
+        emit_words(segment, 0, segment.history.size(), EmitPosition(), flags & FLAG_LOSSLESS, words_before, sink);
+        sink.flush();
+        outfile.write(segment.forms.trailing.data(), segment.forms.trailing.size());
+        return outfile.good();
+    }
+    
+    // Entry of the member table of a member archive
+    struct ArchiveMember {
+        string name;
+        uint64_t offset;         // Of its segment
+        uint64_t size;           // Of its segment, in bytes
+        uint64_t text_bytes;     // Of its input
+        vector<uint32_t> chunks; // With FLAG_DEDUP, the IDs of the chunks it is made of
+    };
+    
+    // Chunk of a deduplicated member archive, in the segment of its owner
+    struct ArchiveChunk {
+        uint32_t owner;
+        uint32_t tokens;
+        uint64_t start = 0;  // Word of the owner's segment it starts at
+    };
+    
+    // Members cut into chunks, as deduplicate_members leaves them: the
+    // tokens and forms of the chunks each member stores, and the chunks
+    struct MemberChunks {
+        vector<vector<string>> tokens;
+        vector<TextForms> forms;
+        vector<vector<uint32_t>> refs;
+        vector<ArchiveChunk> chunks;
+    };
+    
+    // The members of an archive whose header ends at byte body, and their
+    // chunks if it is deduplicated; false if the table is malformed. Names
+    // are file names, so they cannot lead out of the directory members are
+    // extracted to.
+    static bool read_members(const char* data, size_t size, size_t body, uint8_t flags,
+                             vector<ArchiveMember>& members, vector<ArchiveChunk>& chunks) {
+        chunks.clear();
+        members.clear();
+        if (size < body + 16 || !equal(data + size - 4, data + size, MEMBER_MAGIC)) {
+            return false;
+        }
+        BitReader end_reader(reinterpret_cast<const uint8_t*>(data) + size - 16, 12);
+        uint64_t high = end_reader.read_bits(32);
+        uint64_t table = high << 32 | end_reader.read_bits(32);
+        uint32_t count = end_reader.read_bits(32);
+        if (table < body || table > size - 16) {
+            return false;
+        }
+        BitReader reader(reinterpret_cast<const uint8_t*>(data) + table, size - 16 - table);
+        for (uint32_t m = 0; m < count; ++m) {
+            const uint8_t* fields = reader.read_bytes(26);
+            if (fields == nullptr) {
+                return false;
+            }
+            BitReader field_reader(fields, 26);
+            uint64_t values[3];
+            for (uint64_t& value : values) {
+                uint64_t value_high = field_reader.read_bits(32);
+                value = value_high << 32 | field_reader.read_bits(32);
+            }
+            uint16_t name_length = field_reader.read_bits(16);
+            const uint8_t* name = reader.read_bytes(name_length);
+            if (name == nullptr || values[0] < body || values[0] > table || values[1] > table - values[0]) {
+                return false;
+            }
+            members.push_back({string(reinterpret_cast<const char*>(name), name_length), values[0], values[1],
+                               values[2], {}});
+            const string& member_name = members.back().name;
+            if (member_name.empty() || member_name == "." || member_name == ".." ||
+                member_name.find_first_of(string("/\0", 2)) != string::npos) {
+                return false;
+            }
+        }
+        if (!(flags & FLAG_DEDUP)) {
+            return !reader.has_more();
+        }
+        
+        // The chunk table, up to the end of the member table
+        const uint8_t* chunk_table = reader.read_bytes(0);
+        size_t chunk_table_size = reinterpret_cast<const uint8_t*>(data) + size - 16 - chunk_table;
+        BitReader chunk_reader(chunk_table, chunk_table_size);
+        uint32_t chunk_count = chunk_reader.read_bits(32);
+        if (chunk_count > chunk_table_size * 4) {
+            return false;
+        }
+        vector<uint64_t> owned_tokens(members.size(), 0);
+        uint64_t owner = 0;
+        for (uint32_t c = 0; c < chunk_count; ++c) {
+            owner += chunk_reader.read_gamma() - 1;
+            uint32_t tokens = chunk_reader.read_gamma();
+            if (!chunk_reader.has_more() || owner >= members.size() || tokens == 0) {
+                return false;
+            }
+            chunks.push_back({static_cast<uint32_t>(owner), tokens, owned_tokens[owner]});
+            owned_tokens[owner] += tokens;
+        }
+        for (auto& member : members) {
+            uint32_t ref_count = chunk_reader.read_bits(32);
+            if (ref_count > chunk_table_size * 8) {
+                return false;
+            }
+            int64_t expected = 0;
+            for (uint32_t r = 0; r < ref_count; ++r) {
+                if (!chunk_reader.has_more()) {
+                    return false;
+                }
+                uint32_t zigzag = chunk_reader.read_gamma() - 1;
+                int64_t id = expected + (zigzag & 1 ? -1 - static_cast<int64_t>(zigzag >> 1) : zigzag >> 1);
+                if (id < 0 || id >= chunk_count) {
+                    return false;
+                }
+                member.chunks.push_back(static_cast<uint32_t>(id));
+                expected = id + 1;
+            }
+        }
+        return true;
+    }
+    
+    // Run work(thread, member) over the members in order on all cores. Each
+    // thread takes the next member when it is done with one, so the largest
+    // should come first.
+    static void for_each_member(const vector<size_t>& order, const function<void(size_t, size_t)>& work) {
+        atomic<size_t> next{0};
+        auto run = [&](size_t thread_index) {
+            for (size_t i = next++; i < order.size(); i = next++) {
+                work(thread_index, order[i]);
+            }
+        };
+        size_t thread_count = min<size_t>(order.size(), member_threads());
+        vector<thread> threads;
+        for (size_t t = 1; t < thread_count; ++t) {
+            threads.emplace_back(run, t);
+        }
+        run(0);
+        for (auto& worker : threads) {
+            worker.join();
+        }
+    }
+    
+    static size_t member_threads() {
+        return max(1u, thread::hardware_concurrency());
+    }
+    
+    // A compressor for one thread of for_each_member, with the settings of
+    // this one and the dictionaries of dict_file; nullptr if they do not load
+    unique_ptr<TwoTierTextCompressor> make_member_worker(const string& dict_file) const {
+        auto worker = make_unique<TwoTierTextCompressor>();
+        worker->settings = settings;
+        worker->settings.block_index = false;
+        worker->quiet = true;
+        if (!worker->load_dictionaries(dict_file)) {
+            return nullptr;
+        }
+        worker->rebuild_phrase_trie();
+        return worker;
+    }
+    
+    // Cut each input into chunks and keep each chunk once, in the member it
+    // is first seen in, members taken in the order given. Chunks are cut on
+    // IDs that only depend on a token's text, as the dictionaries are not
+    // built yet, and compared by their tokens, and in lossless mode by
+    // their forms too. Reading and cutting runs in parallel, in the order
+    // given; storing the chunks does not.
+    bool deduplicate_members(const vector<string>& input_files, const vector<size_t>& order, MemberChunks& result) {
+        size_t member_count = input_files.size();
+        result.tokens.assign(member_count, {});
+        result.forms.assign(member_count, TextForms());
+        result.refs.assign(member_count, {});
+        result.chunks.clear();
+        
+        // Chunk ends and contents: each token followed by a 0 byte, which
+        // no token holds but one that is a 0 byte itself, and the forms
+        bool lossless = settings.lossless;
+        vector<vector<size_t>> ends(member_count);
+        vector<vector<string>> contents(member_count);
+        vector<char> read(member_count, 0);
+        stats.timer.begin("chunking");
+        for_each_member(order, [&](size_t, size_t member) {
+            ifstream infile(input_files[member]);
+            string text((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+            read[member] = static_cast<bool>(infile);
+            const vector<string>& tokens = result.tokens[member] =
+                tokenize_raw(text, lossless ? &result.forms[member] : nullptr);
+            const TextForms& forms = result.forms[member];
+            vector<uint32_t> ids;
+            ids.reserve(tokens.size());
+            for (const auto& token : tokens) {
+                ids.push_back(static_cast<uint32_t>(FlatHash()(token)));
+            }
+            ends[member] = ChunkStore::chunk_ends(ids);
+            size_t start = 0, exception = 0, separator = 0;
+            for (size_t end : ends[member]) {
+                string content;
+                for (size_t i = start; i < end; ++i) {
+                    content.append(tokens[i]).push_back('\0');
+                    if (lossless) {
+                        content.push_back(static_cast<char>(forms.cases[i]));
+                        content.push_back(static_cast<char>(forms.spacings[i]));
+                        if (forms.cases[i] == TextForms::CASE_EXCEPTION) {
+                            content.append(forms.exceptions[exception++]).push_back('\0');
+                        }
+                        if (forms.spacings[i] == TextForms::SPACING_OTHER) {
+                            content.append(forms.separators[separator++]).push_back('\0');
+                        }
+                    }
+                }
+                contents[member].push_back(move(content));
+                start = end;
+            }
+        });
+        stats.timer.end();
+        for (size_t member = 0; member < member_count; ++member) {
+            if (!read[member]) {
+                cerr << "Error opening input file: " << input_files[member] << endl;
+                return false;
+            }
+        }
+        
+        // Store the chunks, and drop the tokens and forms of those stored
+        // before from the member
+        StageTimer::Scope stage(stats.timer, "dedup");
+        ChunkStore store;
+        for (size_t member = 0; member < member_count; ++member) {
+            vector<string>& tokens = result.tokens[member];
+            TextForms& forms = result.forms[member];
+            vector<string> kept_tokens;
+            TextForms kept_forms;
+            kept_forms.trailing = forms.trailing;
+            size_t start = 0, exception = 0, separator = 0;
+            for (size_t c = 0; c < ends[member].size(); ++c) {
+                size_t end = ends[member][c];
+                const string& content = contents[member][c];
+                bool added;
+                result.refs[member].push_back(store.add(ChunkStore::key_of(content), content, added));
+                if (added) {
+                    result.chunks.push_back({static_cast<uint32_t>(member), static_cast<uint32_t>(end - start)});
+                    stats.unique_chunk_tokens += end - start;
+                }
+                stats.chunk_tokens += end - start;
+                for (size_t i = start; i < end; ++i) {
+                    if (added) {
+                        kept_tokens.push_back(move(tokens[i]));
+                    }
+                    if (!lossless) {
+                        continue;
+                    }
+                    if (added) {
+                        kept_forms.cases.push_back(forms.cases[i]);
+                        kept_forms.spacings.push_back(forms.spacings[i]);
+                    }
+                    if (forms.cases[i] == TextForms::CASE_EXCEPTION) {
+                        string& written = forms.exceptions[exception++];
+                        if (added) {
+                            kept_forms.exceptions.push_back(move(written));
+                        }
+                    }
+                    if (forms.spacings[i] == TextForms::SPACING_OTHER) {
+                        string& whitespace = forms.separators[separator++];
+                        if (added) {
+                            kept_forms.separators.push_back(move(whitespace));
+                        }
+                    }
+                }
+                start = end;
+            }
+            tokens = move(kept_tokens);
+            forms = move(kept_forms);
+            vector<string>().swap(contents[member]);
+        }
+        stats.chunks = stats.chunk_tokens == 0 ? 0 : store.size();
+        for (const auto& refs : result.refs) {
+            stats.chunk_refs += refs.size();
+        }
+        return true;
+    }
+    
+    // Write a member of a deduplicated archive: decode the segments its
+    // chunks are in, and in lossless mode its own for the whitespace after
+    // its last word, then write the words of each chunk in turn
+    bool extract_chunks(const char* data, const vector<ArchiveMember>& members, const vector<ArchiveChunk>& chunks,
+                        size_t member, uint8_t flags, const BackendCodec* backend, ofstream& outfile) {
+        bool lossless = flags & FLAG_LOSSLESS;
+        const vector<uint32_t>& refs = members[member].chunks;
+        vector<DecodedSegment> segments(members.size());
+        vector<char> decoded(members.size(), 0);
+        auto decode = [&](size_t owner) {
+            if (decoded[owner]) {
+                return true;
+            }
+            decoded[owner] = true;
+            BitReader reader(reinterpret_cast<const uint8_t*>(data) + members[owner].offset, members[owner].size);
+            return decode_segment(reader, flags, backend, segments[owner]);
+        };
+        if (lossless && !decode(member)) {
+            return false;
+        }
+        
+        // Where the side lists stand at the start of each chunk. Chunks of
+        // an owner are numbered in the order of their starts, so the
+        // positions of all of them take one pass over its words.
+        vector<uint32_t> used(refs);
+        sort(used.begin(), used.end());
+        used.erase(unique(used.begin(), used.end()), used.end());
+        vector<EmitPosition> positions(used.size());
+        for (size_t u = 0; u < used.size(); ++u) {
+            const ArchiveChunk& chunk = chunks[used[u]];
+            if (!decode(chunk.owner) || chunk.start + chunk.tokens > segments[chunk.owner].history.size()) {
+                return false;
+            }
+            const DecodedSegment& segment = segments[chunk.owner];
+            size_t first = 0;
+            EmitPosition& position = positions[u];
+            if (u > 0 && chunks[used[u - 1]].owner == chunk.owner) {
+                first = chunks[used[u - 1]].start;
+                position = positions[u - 1];
+            }
+            for (size_t i = first; i < chunk.start; ++i) {
+                position.number += segment.history[i] == segment.number_id;
+                if (lossless) {
+                    position.exception += segment.forms.cases[i] == TextForms::CASE_EXCEPTION;
+                    position.separator += segment.forms.spacings[i] == TextForms::SPACING_OTHER;
+                }
+            }
+        }
+        
+        StageTimer::Scope stage(stats.timer, "text_emit");
+        TextSink sink(outfile);
+        bool words_before = false;
+        for (uint32_t id : refs) {
+            const ArchiveChunk& chunk = chunks[id];
+            size_t u = lower_bound(used.begin(), used.end(), id) - used.begin();
+            emit_words(segments[chunk.owner], chunk.start, chunk.start + chunk.tokens, positions[u], lossless,
+                       words_before, sink);
+        }
+        sink.flush();
+        outfile.write(segments[member].forms.trailing.data(), segments[member].forms.trailing.size());
+        return outfile.good();
+    }
+    
+    // The tokens of all inputs, one after another, read in parallel
+    bool read_member_tokens(const vector<string>& input_files, const vector<size_t>& order,
+                            vector<string>& raw_tokens) {
+        StageTimer::Scope stage(stats.timer, "tokenize");
+        vector<vector<string>> member_tokens(input_files.size());
+        vector<char> read(input_files.size(), 0);
+        for_each_member(order, [&](size_t, size_t member) {
+            ifstream infile(input_files[member]);
+            string text((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+            member_tokens[member] = tokenize_raw(text);
+            read[member] = static_cast<bool>(infile);
+        });
+        for (size_t member = 0; member < input_files.size(); ++member) {
+            if (!read[member]) {
+                cerr << "Error opening input file: " << input_files[member] << endl;
+                return false;
+            }
+            raw_tokens.insert(raw_tokens.end(), make_move_iterator(member_tokens[member].begin()),
+                              make_move_iterator(member_tokens[member].end()));
+            vector<string>().swap(member_tokens[member]);
+        }
+        return true;
+    }
+    
+    // The chunk table of a deduplicated archive, after the member entries
+    static void write_chunk_table(BitWriter& table, const MemberChunks& member_chunks) {
+        table.write_bits(static_cast<uint32_t>(member_chunks.chunks.size()), 32);
+        uint32_t owner = 0;
+        for (const auto& chunk : member_chunks.chunks) {
+            table.write_gamma(chunk.owner - owner + 1);
+            table.write_gamma(chunk.tokens);
+            owner = chunk.owner;
+        }
+        for (const auto& refs : member_chunks.refs) {
+            table.write_bits(static_cast<uint32_t>(refs.size()), 32);
+            int64_t expected = 0;
+            for (uint32_t id : refs) {
+                int64_t delta = static_cast<int64_t>(id) - expected;
+                table.write_gamma(static_cast<uint32_t>(delta >= 0 ? delta * 2 : -delta * 2 - 1) + 1);
+                expected = static_cast<int64_t>(id) + 1;
+            }
+        }
+        table.flush();
+    }
+    
+    // Code one input as a member, against the dictionaries loaded: as
+    // compress does with a trained dictionary, from Step 8 on
+    bool compress_member(const string& input_file, vector<uint8_t>& bytes) {
+        vector<string> raw_tokens;
+        return read_input_tokens(input_file, raw_tokens) && compress_member_tokens(raw_tokens, bytes);
+    }
+    
+    // The same for tokens read already, with their forms in text_forms
+    bool compress_member_tokens(const vector<string>& raw_tokens, vector<uint8_t>& bytes) {
+        vector<TokenMatch> matches = find_long_range_matches(raw_tokens);
+        stats.timer.begin("parse");
+        vector<Token> processed_tokens = process_with_phrases(raw_tokens, matches);
+        stats.timer.end();
+        collect_local_dictionary(processed_tokens);
+        
+        StageTimer::Scope stage(stats.timer, "encode");
+        BitWriter writer;
+        segment_offset = 0;
+        if (!write_segment(writer, processed_tokens, raw_tokens)) {
+            return false;
+        }
+        writer.flush();
+        bytes = writer.get_buffer();
+        return true;
+    }
+    
+public:
+    TwoTierTextCompressor() {
+        // Initialize phrase trie root
+        reset_phrase_trie();
+        non_repeated_phrases = 0;
+    }
+    
+    void set_level(int level) {
+        settings = COMPRESSION_LEVELS[level];
+    }
+    
+    void set_match_window(uint32_t window) {
+        settings.match_window = window;
+    }
+    
+    void set_split_streams(bool split) {
+        settings.split_streams = split;
+    }
+    
+    // Stream VByte needs the split-stream layout
+    void set_stream_vbyte(bool vbyte) {
+        settings.stream_vbyte = vbyte;
+        settings.split_streams = settings.split_streams || vbyte;
+    }
+    
+    // The backend runs on the split streams, so it needs their layout too;
+    // false if no codec of that name is built in
+    bool set_backend(const string& name) {
+        settings.backend = BackendCodec::find(name);
+        settings.split_streams = settings.split_streams || settings.backend != nullptr;
+        return settings.backend != nullptr;
+    }
+    
+    void set_lossless(bool lossless) {
+        settings.lossless = lossless;
+    }
+    
+    void set_dedup(bool dedup) {
+        settings.dedup = dedup;
+    }
+    
+    // The index lists split-stream blocks, so it needs their layout too
+    void set_block_index(bool index) {
+        settings.block_index = index;
+        settings.split_streams = settings.split_streams || index;
+    }
+    
+    const CompressionStats& get_stats() const {
+        return stats;
+    }
+    
+    // Print statistics about phrases
+    void print_phrase_stats() const {
+        cout << "\nPhrase Statistics:" << endl;
+        cout << "-----------------" << endl;
+        cout << "Total phrases found: " << phrase_decode_dict.size() << endl;
+        cout << "Non-repeated phrases: " << non_repeated_phrases << endl;
+        
+        uint32_t wildcard_phrases = 0;
+        uint32_t regular_phrases = 0;
+        
+        for (const auto& phrase : phrase_decode_dict) {
+            if (phrase.has_wildcard) {
+                wildcard_phrases++;
+            } else {
+                regular_phrases++;
+            }
+        }
+        
+        cout << "Regular phrases: " << regular_phrases << endl;
+        cout << "Wildcard phrases: " << wildcard_phrases << endl;
+        
+        // Print top phrases by frequency
+        cout << "\nTop 10 phrases by frequency:" << endl;
+        vector<pair<uint32_t, size_t>> sorted_phrases;
+        for (size_t i = 0; i < phrase_decode_dict.size(); ++i) {
+            sorted_phrases.push_back({phrase_decode_dict[i].frequency, i});
+        }
+        
+        sort(sorted_phrases.begin(), sorted_phrases.end(), 
+                 [](const auto& a, const auto& b) { return a.first > b.first; });
+        
+        size_t count = min(size_t(10), sorted_phrases.size());
+        for (size_t i = 0; i < count; ++i) {
+            const auto& phrase = phrase_decode_dict[sorted_phrases[i].second];
+            cout << setw(5) << phrase.frequency << " | " 
+                      << phrase.to_string(main_decode_dict) << endl;
+        }
+    }
+    
+    // Compression method
+    bool compress(const string& dict_file, 
+                  const string& input_file, 
+                  const string& output_file) {
+        // Reset phrase structures
+        reset_phrase_trie();
+        phrase_decode_dict.clear();
+        non_repeated_phrases = 0;
+        block_index.clear();
+        stats.reset();
+        
+        vector<string> raw_tokens;
+        bool trained = settings.use_trained_phrases && is_trained_dictionary(dict_file);
+        
+        if (trained) {
+            // Steps 1-7: Use the trained dictionary as is (it is shared, so it is
+            // not rewritten) and only tokenize the input
+            if (!load_dictionaries(dict_file)) {
+                cerr << "Failed to load dictionaries from file: " << dict_file << endl;
+                return false;
+            }
+            rebuild_phrase_trie();
+            
+            if (!read_input_tokens(input_file, raw_tokens)) {
+                return false;
+            }
+        } else {
+            // Steps 1-5: Read, tokenize and build the main dictionary
+            if (!prepare_input(dict_file, input_file, raw_tokens)) {
+                return false;
+            }
+            
+            // Steps 6-7: Find phrases
+            mine_phrases(raw_tokens);
+        }
+        
+        // Step 8: Find long-range repeats over word IDs
+        vector<TokenMatch> matches = find_long_range_matches(raw_tokens);
+        
+        // Step 9: Process tokens with phrase recognition
+        stats.timer.begin("parse");
+        vector<Token> processed_tokens;
+        if (trained || settings.use_trained_phrases) {
+            processed_tokens = process_with_phrases(raw_tokens, matches);
+        } else {
+            // Keep only the phrases that the parse actually uses
+            stats.phrases_mined = phrase_decode_dict.size();
+            processed_tokens = compact_phrase_dictionary(raw_tokens, matches);
+            
+            // Rank the fillers each wildcard phrase was actually used with
+            build_filler_tables(processed_tokens);
+            
+            // Print phrase statistics
+            print_phrase_stats();
+        }
+        stats.phrases_kept = phrase_decode_dict.size();
+        stats.timer.end();
+        
+        // Steps 10-11: Collect rare words and build the local dictionary of them
+        collect_local_dictionary(processed_tokens);
+        
+        // Step 12: Write dictionaries to file
+        if (!trained && !write_dictionaries("eng.dict")) {
+            cerr << "Failed to write dictionaries to file: eng.dict" << endl;
+            return false;
+        }
+        
+        // Step 13: Write compressed data
+        StageTimer::Scope stage(stats.timer, "encode");
+        BitWriter writer;
+        
+        // Write header: magic and format flags
+        for (size_t i = 0; i < 4; ++i) {
+            writer.write_bits(static_cast<uint8_t>(PHRASE_MAGIC[i]), 8);
+        }
+        uint8_t flags = settings.split_streams ? FLAG_SPLIT_STREAMS : settings.entropy_code ? FLAG_ENTROPY_CODED : 0;
+        flags |= FLAG_NUMBERS;
+        flags |= settings.backend != nullptr ? FLAG_BACKEND : 0;
+        flags |= settings.lossless ? FLAG_LOSSLESS : 0;
+        writer.write_bits(flags, 8);
+        if (settings.backend != nullptr) {
+            writer.write_bits(settings.backend->id(), 8);
+        }
+        
+        // Write the local dictionary, tokens, numbers and forms
+        segment_offset = 0;
+        if (!write_segment(writer, processed_tokens, raw_tokens)) {
+            return false;
+        }
+        stats.total_bits = writer.bit_count();
+        count_dictionary_probes();
+        
+        // Write compressed data to file
+        if (!writer.write_to_file(output_file)) {
+            cerr << "Error writing compressed data to file: " << output_file << endl;
+            return false;
+        }
+        
+        // The index is only read by search, so it goes in a file of its own;
+        // one left from an earlier archive of that name would be stale
+        if (settings.block_index) {
+            stats.index_bits = block_index.write(output_file + INDEX_SUFFIX, writer.get_buffer().size(), false);
+            if (stats.index_bits == 0) {
+                cerr << "Error writing block index to file: " << output_file << INDEX_SUFFIX << endl;
+                return false;
+            }
+        } else {
+            remove((output_file + INDEX_SUFFIX).c_str());
+        }
+        
+        return true;
+    }
+    
+    // Append mode: add the text of input_file to a phrase-mode archive as a
+    // new segment, coded against the dictionaries the archive was written
+    // with and in its format. Only the new text is read and coded, and only
+    // the segment table at the end of the archive is rewritten, with its
+    // block index if that is current.
+    bool append(const string& dict_file,
+                const string& input_file,
+                const string& archive_file) {
+        reset_phrase_trie();
+        phrase_decode_dict.clear();
+        non_repeated_phrases = 0;
+        block_index.clear();
+        stats.reset();
+        
+        // Step 1: Read the header and the segment table of the archive
+        vector<uint64_t> starts;
+        uint64_t table_start;
+        uint8_t flags;
+        bool indexed;
+        {
+            MappedFile archive;
+            if (!archive.open(archive_file)) {
+                cerr << "Error opening compressed file: " << archive_file << endl;
+                return false;
+            }
+            const char* data = archive.data();
+            size_t data_size = archive.size();
+            if (data_size < 5 || !equal(data, data + 4, PHRASE_MAGIC)) {
+                cerr << "Append needs a phrase-mode compressed file: " << archive_file << endl;
+                return false;
+            }
+            flags = static_cast<uint8_t>(data[4]);
+            if (!(flags & FLAG_NUMBERS)) {
+                cerr << "Compressed file is in a format too old to append to: " << archive_file << endl;
+                return false;
+            }
+            if (flags & FLAG_MEMBERS) {
+                cerr << "Cannot append to a member archive: " << archive_file << endl;
+                return false;
+            }
+            settings.backend = nullptr;
+            if (flags & FLAG_BACKEND) {
+                uint8_t backend_id = data_size > 5 ? static_cast<uint8_t>(data[5]) : 0;
+                settings.backend = BackendCodec::find(backend_id);
+                if (settings.backend == nullptr) {
+                    cerr << "Compressed file needs a backend codec that is not built in: "
+                         << static_cast<int>(backend_id) << endl;
+                    return false;
+                }
+            }
+            size_t body = 5 + ((flags & FLAG_BACKEND) != 0);
+            vector<pair<uint64_t, uint64_t>> segments;
+            if (!read_segments(data, data_size, body, flags, segments)) {
+                cerr << "Invalid segment table: " << archive_file << endl;
+                return false;
+            }
+            for (const auto& segment : segments) {
+                starts.push_back(segment.first);
+            }
+            table_start = segments.back().second;
+            
+            // The index is kept up to date only if it is now
+            vector<BlockIndex> sections;
+            indexed = (flags & FLAG_SPLIT_STREAMS) && BlockIndex::read(archive_file + INDEX_SUFFIX, sections) &&
+                      sections.size() == segments.size();
+            for (size_t s = 0; s < segments.size() && indexed; ++s) {
+                indexed = sections[s].segment_end() == segments[s].second;
+            }
+        }
+        
+        // The new segment is in the format of the archive
+        settings.split_streams = flags & FLAG_SPLIT_STREAMS;
+        settings.entropy_code = settings.split_streams ? settings.entropy_code : (flags & FLAG_ENTROPY_CODED) != 0;
+        settings.lossless = flags & FLAG_LOSSLESS;
+        settings.block_index = indexed;
+        
+        // Steps 2-3: Load the dictionaries and tokenize the input
+        if (!load_dictionaries(dict_file)) {
+            cerr << "Failed to load dictionaries from file: " << dict_file << endl;
+            return false;
+        }
+        rebuild_phrase_trie();
+        vector<string> raw_tokens;
+        if (!read_input_tokens(input_file, raw_tokens)) {
+            return false;
+        }
+        
+        // Steps 4-6: Find long-range repeats, parse into phrases and collect
+        // the rare words, as compress does with a trained dictionary
+        vector<TokenMatch> matches = find_long_range_matches(raw_tokens);
+        stats.timer.begin("parse");
+        vector<Token> processed_tokens = process_with_phrases(raw_tokens, matches);
+        stats.phrases_kept = phrase_decode_dict.size();
+        stats.timer.end();
+        collect_local_dictionary(processed_tokens);
+        
+        // Step 7: Code the segment where the segment table starts, and a new
+        // table after it
+        StageTimer::Scope stage(stats.timer, "encode");
+        BitWriter writer;
+        segment_offset = table_start;
+        if (!write_segment(writer, processed_tokens, raw_tokens)) {
+            return false;
+        }
+        writer.flush();
+        uint64_t segment_end = table_start + writer.get_buffer().size();
+        stats.total_bits = writer.bit_count();
+        starts.push_back(table_start);
+        for (uint64_t start : starts) {
+            writer.write_bits(static_cast<uint32_t>(start >> 32), 32);
+            writer.write_bits(static_cast<uint32_t>(start), 32);
+        }
+        writer.write_bits(static_cast<uint32_t>(starts.size()), 32);
+        for (size_t i = 0; i < 4; ++i) {
+            writer.write_bits(static_cast<uint8_t>(SEGMENT_MAGIC[i]), 8);
+        }
+        count_dictionary_probes();
+        
+        // Step 8: Write it over the old table, which it is longer than, and
+        // mark the archive as segmented
+        fstream archive(archive_file, ios::in | ios::out | ios::binary);
+        archive.seekp(table_start);
+        archive.write(reinterpret_cast<const char*>(writer.get_buffer().data()), writer.get_buffer().size());
+        char segmented = static_cast<char>(flags | FLAG_SEGMENTS);
+        archive.seekp(4);
+        archive.write(&segmented, 1);
+        if (!archive.good()) {
+            cerr << "Error writing compressed data to file: " << archive_file << endl;
+            return false;
+        }
+        archive.close();
+        
+        if (indexed) {
+            stats.index_bits = block_index.write(archive_file + INDEX_SUFFIX, segment_end, true);
+            if (stats.index_bits == 0) {
+                cerr << "Error writing block index to file: " << archive_file << INDEX_SUFFIX << endl;
+                return false;
+            }
+        }
+        
+        return true;
+    }
+    
+    // Member archive mode: compress several inputs into one archive, each as
+    // a member that can be extracted on its own. The dictionaries are built
+    // once, from all the inputs together, and written to eng.dict once, or a
+    // trained dictionary is used as is. The members are then coded in
+    // parallel, a compressor per core, each loading the dictionaries. With
+    // --dedup, text repeated across the inputs is found first, and only the
+    // text each member adds goes into the dictionaries and its segment.
+    bool compress_members(const string& dict_file,
+                          const vector<string>& input_files,
+                          const string& archive_file) {
+        reset_phrase_trie();
+        phrase_decode_dict.clear();
+        non_repeated_phrases = 0;
+        stats.reset();
+        
+        // Members are named by their file names, which must differ
+        vector<string> names;
+        for (const auto& input_file : input_files) {
+            names.push_back(input_file.substr(input_file.find_last_of('/') + 1));
+            if (names.back().empty() || names.back() == "." || names.back() == ".." || names.back().size() > UINT16_MAX) {
+                cerr << "Not a file name to store a member under: " << input_file << endl;
+                return false;
+            }
+            if (find(names.begin(), names.end() - 1, names.back()) != names.end() - 1) {
+                cerr << "Two members would have the same name: " << names.back() << endl;
+                return false;
+            }
+        }
+        
+        // The largest inputs are coded first, so the cores finish together
+        vector<uint64_t> text_bytes;
+        for (const auto& input_file : input_files) {
+            text_bytes.push_back(file_size(input_file));
+        }
+        vector<size_t> order(input_files.size());
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return text_bytes[a] > text_bytes[b];
+        });
+        
+        MemberChunks member_chunks;
+        if (settings.dedup) {
+            if (!deduplicate_members(input_files, order, member_chunks)) {
+                return false;
+            }
+            cout << "Dedup: " << stats.chunk_refs << " chunks, " << stats.chunks << " stored, "
+                 << stats.chunk_tokens << " -> " << stats.unique_chunk_tokens << " tokens (ratio "
+                 << fixed << setprecision(2)
+                 << (stats.unique_chunk_tokens > 0 ? static_cast<double>(stats.chunk_tokens) / stats.unique_chunk_tokens : 1.0)
+                 << ")" << endl;
+        }
+        
+        // Steps 1-7: The shared dictionaries, from the tokens of all inputs
+        bool trained = settings.use_trained_phrases && is_trained_dictionary(dict_file);
+        string shared_dict = trained ? dict_file : "eng.dict";
+        if (trained) {
+            if (!load_dictionaries(dict_file)) {
+                cerr << "Failed to load dictionaries from file: " << dict_file << endl;
+                return false;
+            }
+        } else {
+            vector<string> raw_tokens;
+            if (settings.dedup) {
+                for (const auto& tokens : member_chunks.tokens) {
+                    raw_tokens.insert(raw_tokens.end(), tokens.begin(), tokens.end());
+                }
+            } else if (!read_member_tokens(input_files, order, raw_tokens)) {
+                return false;
+            }
+            
+            if (!build_main_dictionary(dict_file, raw_tokens)) {
+                return false;
+            }
+            mine_phrases(raw_tokens);
+            
+            // Keep only the phrases that a parse of all inputs uses
+            if (!settings.use_trained_phrases) {
+                vector<TokenMatch> matches = find_long_range_matches(raw_tokens);
+                stats.timer.begin("parse");
+                stats.phrases_mined = phrase_decode_dict.size();
+                vector<Token> processed_tokens = compact_phrase_dictionary(raw_tokens, matches);
+                build_filler_tables(processed_tokens);
+                stats.timer.end();
+                print_phrase_stats();
+            }
+            if (!write_dictionaries(shared_dict)) {
+                cerr << "Failed to write dictionaries to file: " << shared_dict << endl;
+                return false;
+            }
+        }
+        stats.phrases_kept = phrase_decode_dict.size();
+        
+        // Steps 8-13: Code the members on all cores
+        StageTimer::Scope stage(stats.timer, "encode");
+        vector<unique_ptr<TwoTierTextCompressor>> workers(member_threads());
+        vector<vector<uint8_t>> member_bytes(input_files.size());
+        vector<char> coded(input_files.size(), 0);
+        for_each_member(order, [&](size_t thread_index, size_t member) {
+            if (!workers[thread_index]) {
+                workers[thread_index] = make_member_worker(shared_dict);
+            }
+            TwoTierTextCompressor* worker = workers[thread_index].get();
+            if (worker != nullptr && settings.dedup) {
+                worker->text_forms = move(member_chunks.forms[member]);
+                coded[member] = worker->compress_member_tokens(member_chunks.tokens[member], member_bytes[member]);
+            } else {
+                coded[member] = worker != nullptr && worker->compress_member(input_files[member], member_bytes[member]);
+            }
+        });
+        for (size_t member = 0; member < input_files.size(); ++member) {
+            if (!coded[member]) {
+                cerr << "Failed to compress member: " << input_files[member] << endl;
+                return false;
+            }
+        }
+        
+        // Step 14: Write the header, the members in the order given, and
+        // the member table
+        ofstream outfile(archive_file, ios::binary);
+        BitWriter header;
+        for (size_t i = 0; i < 4; ++i) {
+            header.write_bits(static_cast<uint8_t>(PHRASE_MAGIC[i]), 8);
+        }
+        uint8_t flags = settings.split_streams ? FLAG_SPLIT_STREAMS : settings.entropy_code ? FLAG_ENTROPY_CODED : 0;
+        flags |= FLAG_NUMBERS | FLAG_MEMBERS;
+        flags |= settings.dedup ? FLAG_DEDUP : 0;
+        flags |= settings.backend != nullptr ? FLAG_BACKEND : 0;
+        flags |= settings.lossless ? FLAG_LOSSLESS : 0;
+        header.write_bits(flags, 8);
+        if (settings.backend != nullptr) {
+            header.write_bits(settings.backend->id(), 8);
+        }
+        outfile.write(reinterpret_cast<const char*>(header.get_buffer().data()), header.get_buffer().size());
+        
+        BitWriter table;
+        auto write_64 = [&](uint64_t value) {
+            table.write_bits(static_cast<uint32_t>(value >> 32), 32);
+            table.write_bits(static_cast<uint32_t>(value), 32);
+        };
+        uint64_t offset = header.get_buffer().size();
+        for (size_t member = 0; member < input_files.size(); ++member) {
+            const vector<uint8_t>& bytes = member_bytes[member];
+            outfile.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+            write_64(offset);
+            write_64(bytes.size());
+            write_64(text_bytes[member]);
+            table.write_bits(static_cast<uint32_t>(names[member].size()), 16);
+            table.write_bytes(vector<uint8_t>(names[member].begin(), names[member].end()));
+            offset += bytes.size();
+        }
+        if (settings.dedup) {
+            write_chunk_table(table, member_chunks);
+        }
+        write_64(offset);
+        table.write_bits(static_cast<uint32_t>(input_files.size()), 32);
+        for (size_t i = 0; i < 4; ++i) {
+            table.write_bits(static_cast<uint8_t>(MEMBER_MAGIC[i]), 8);
+        }
+        outfile.write(reinterpret_cast<const char*>(table.get_buffer().data()), table.get_buffer().size());
+        if (!outfile.good()) {
+            cerr << "Error writing compressed data to file: " << archive_file << endl;
+            return false;
+        }
+        stats.total_bits = (offset + table.get_buffer().size()) * 8;
+        
+        // The index is not written for member archives
+        remove((archive_file + INDEX_SUFFIX).c_str());
+        
+        for (size_t member = 0; member < input_files.size(); ++member) {
+            cout << names[member] << ": " << text_bytes[member] << " -> " << member_bytes[member].size()
+                 << " bytes" << endl;
+        }
+        return true;
+    }
+    
+    // Extract members of a member archive to files of their names in
+    // output_dir, all of them or those named, in parallel. A member is
+    // found in the table and read from where it starts; the others are not
+    // read.
+    bool extract_members(const string& dict_file,
+                         const string& archive_file,
+                         const string& output_dir,
+                         const vector<string>& names) {
+        stats.reset();
+        stats.timer.begin("bit_decode");
+        MappedFile archive;
+        if (!archive.open(archive_file)) {
+            cerr << "Error opening compressed file: " << archive_file << endl;
+            return false;
+        }
+        const char* data = archive.data();
+        size_t data_size = archive.size();
+        stats.total_bits = data_size * 8;
+        if (data_size < 5 || !equal(data, data + 4, PHRASE_MAGIC) || !(data[4] & FLAG_MEMBERS)) {
+            cerr << "Not a member archive: " << archive_file << endl;
+            return false;
+        }
+        uint8_t flags = static_cast<uint8_t>(data[4]);
+        const BackendCodec* backend = nullptr;
+        if (flags & FLAG_BACKEND) {
+            uint8_t backend_id = data_size > 5 ? static_cast<uint8_t>(data[5]) : 0;
+            backend = BackendCodec::find(backend_id);
+            if (backend == nullptr) {
+                cerr << "Compressed file needs a backend codec that is not built in: "
+                     << static_cast<int>(backend_id) << endl;
+                return false;
+            }
+        }
+        vector<ArchiveMember> members;
+        vector<ArchiveChunk> chunks;
+        if (!read_members(data, data_size, 5 + ((flags & FLAG_BACKEND) != 0), flags, members, chunks)) {
+            cerr << "Invalid member table: " << archive_file << endl;
+            return false;
+        }
+        
+        vector<size_t> order;
+        for (const auto& name : names) {
+            auto it = find_if(members.begin(), members.end(), [&](const ArchiveMember& member) {
+                return member.name == name;
+            });
+            if (it == members.end()) {
+                cerr << "No member of that name: " << name << endl;
+                return false;
+            }
+            // A name given twice is written once, not by two threads at once
+            size_t member = it - members.begin();
+            if (find(order.begin(), order.end(), member) == order.end()) {
+                order.push_back(member);
+            }
+        }
+        if (names.empty()) {
+            order.resize(members.size());
+            iota(order.begin(), order.end(), 0);
+        }
+        stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return members[a].size > members[b].size;
+        });
+        if (mkdir(output_dir.c_str(), 0777) != 0 && errno != EEXIST) {
+            cerr << "Error creating output directory: " << output_dir << endl;
+            return false;
+        }
+        stats.timer.end();
+        
+        StageTimer::Scope stage(stats.timer, "text_emit");
+        vector<unique_ptr<TwoTierTextCompressor>> workers(member_threads());
+        vector<char> extracted(members.size(), 0);
+        for_each_member(order, [&](size_t thread_index, size_t member) {
+            if (!workers[thread_index]) {
+                workers[thread_index] = make_member_worker(dict_file);
+            }
+            TwoTierTextCompressor* worker = workers[thread_index].get();
+            ofstream outfile(output_dir + "/" + members[member].name);
+            if (worker == nullptr || !outfile) {
+                return;
+            }
+            if (flags & FLAG_DEDUP) {
+                extracted[member] = worker->extract_chunks(data, members, chunks, member, flags, backend, outfile);
+                return;
+            }
+            BitReader reader(reinterpret_cast<const uint8_t*>(data) + members[member].offset, members[member].size);
+            bool words_before = false;
+            extracted[member] = worker->decompress_segment(reader, flags, backend, words_before, outfile);
+        });
+        for (size_t member : order) {
+            if (!extracted[member]) {
+                cerr << "Failed to extract member: " << members[member].name << endl;
+                return false;
+            }
+        }
+        sort(order.begin(), order.end());
+        for (size_t member : order) {
+            cout << "Extracted " << members[member].name << endl;
+        }
+        return true;
+    }
+    
+    // Re-Pair mode: an alternative to the n-gram phrase dictionary. The token
+    // stream is turned into word IDs (main codes, then local codes after them)
+    // and Re-Pair builds a grammar whose rules and final sequence are Huffman coded.
+    bool compress_repair(const string& dict_file,
+                         const string& input_file,
+                         const string& output_file) {
+        // No phrase dictionary in this mode
+        reset_phrase_trie();
+        phrase_decode_dict.clear();
+        non_repeated_phrases = 0;
+        stats.reset();
+        
+        // Steps 1-5: Read, tokenize and build the main dictionary
+        vector<string> raw_tokens;
+        if (!prepare_input(dict_file, input_file, raw_tokens)) {
+            return false;
+        }
+        freeze_main_dictionary();
+        
+        // Step 6: Rare words go to the local dictionary
+        stats.timer.begin("encode");
+        vector<string> rare_words;
+        for (const auto& token : raw_tokens) {
+            uint32_t code;
+            if (!find_main_code(token, code)) {
+                rare_words.push_back(token);
+            }
+        }
+        build_local_dictionary(rare_words);
+        
+        // Step 7: Map tokens to word IDs
+        uint32_t main_size = main_decode_dict.size();
+        vector<uint32_t> word_ids;
+        word_ids.reserve(raw_tokens.size());
+        for (const auto& token : raw_tokens) {
+            uint32_t code;
+            if (find_main_code(token, code)) {
+                word_ids.push_back(code);
+            } else {
+                word_ids.push_back(main_size + local_encode_dict[token]);
+            }
+        }
+        
+        stats.timer.end();
+        
+        // Step 8: Build the grammar
+        stats.timer.begin("grammar");
+        RePair repair;
+        RePairGrammar grammar = repair.build(word_ids, main_size + local_decode_dict.size());
+        stats.timer.end();
+        
+        cout << "\nRe-Pair Statistics:" << endl;
+        cout << "-------------------" << endl;
+        cout << "Input tokens: " << word_ids.size() << endl;
+        cout << "Rules: " << grammar.rules.size() << endl;
+        cout << "Final sequence length: " << grammar.sequence.size() << endl;
+        
+        // Step 9: Write dictionaries to file
+        if (!write_dictionaries("eng.dict")) {
+            cerr << "Failed to write dictionaries to file: eng.dict" << endl;
+            return false;
+        }
+        
+        // Step 10: Write compressed data
+        StageTimer::Scope stage(stats.timer, "encode");
+        BitWriter writer;
+        for (size_t i = 0; i < 4; ++i) {
+            writer.write_bits(static_cast<uint8_t>(REPAIR_MAGIC[i]), 8);
+        }
+        if (!write_local_dictionary(writer)) {
+            cerr << "Cannot write local dictionary to: " << output_file << endl;
+            return false;
+        }
+        
+        // Rules share one code table for their left and right symbols
+        vector<uint32_t> rule_symbols;
+        rule_symbols.reserve(grammar.rules.size() * 2);
+        for (const auto& rule : grammar.rules) {
+            rule_symbols.push_back(rule.first);
+            rule_symbols.push_back(rule.second);
+        }
+        
+        HuffmanCoder rule_coder;
+        rule_coder.build(rule_symbols);
+        writer.write_bits(grammar.rules.size(), 32);
+        rule_coder.write_table(writer);
+        for (uint32_t symbol : rule_symbols) {
+            rule_coder.encode(writer, symbol);
+        }
+        
+        HuffmanCoder sequence_coder;
+        sequence_coder.build(grammar.sequence);
+        writer.write_bits(grammar.sequence.size(), 32);
+        sequence_coder.write_table(writer);
+        for (uint32_t symbol : grammar.sequence) {
+            sequence_coder.encode(writer, symbol);
+        }
+        
+        if (!writer.write_to_file(output_file)) {
+            cerr << "Error writing compressed data to file: " << output_file << endl;
+            return false;
+        }
+        
+        return true;
+    }
+    
+    // Adaptive mode: one pass over the input as it is read, with no
+    // dictionary file. The input is tokenized a piece at a time, cut after
+    // whitespace, and each step writes the longest phrase of the adaptive
+    // dictionary the text goes on with, or a word not seen before. Coded
+    // bytes go out after each piece.
+    bool compress_adaptive(const string& input_file, const string& output_file) {
+        stats.reset();
+        ifstream infile(input_file, ios::binary);
+        if (!infile) {
+            cerr << "Error opening input file: " << input_file << endl;
+            return false;
+        }
+        ofstream outfile(output_file, ios::binary);
+        if (!outfile) {
+            cerr << "Error opening output file: " << output_file << endl;
+            return false;
+        }
+        
+        BitWriter writer;
+        for (size_t i = 0; i < 4; ++i) {
+            writer.write_bits(static_cast<uint8_t>(ADAPTIVE_MAGIC[i]), 8);
+        }
+        writer.write_bits(ADAPTIVE_PHRASE_BITS, 5);
+        
+        const uint32_t NONE = AdaptiveDictionary::NONE;
+        AdaptiveDictionary dictionary(1u << ADAPTIVE_PHRASE_BITS);
+        FlatHashMap<string, uint32_t> word_numbers;
+        vector<uint32_t> word_codes;  // By word number
+        uint32_t previous = NONE;
+        uint64_t token_count = 0, code_count = 0;
+        
+        vector<char> buffer(ADAPTIVE_READ_BYTES);
+        string pending;         // Read, but the word it ends in may go on
+        vector<string> tokens;  // Tokenized, from next on not coded yet
+        size_t next = 0;
+        bool last_piece = false;
+        while (!last_piece) {
+            stats.timer.begin("tokenize");
+            infile.read(buffer.data(), buffer.size());
+            last_piece = static_cast<size_t>(infile.gcount()) < buffer.size();
+            if (infile.bad()) {
+                cerr << "Error reading input file: " << input_file << endl;
+                return false;
+            }
+            pending.append(buffer.data(), infile.gcount());
+            size_t cut = last_piece ? pending.size() : pending.find_last_of(" \t\n\v\f\r") + 1;
+            vector<string> piece_tokens = tokenize_raw(pending.substr(0, cut));
+            pending.erase(0, cut);
+            tokens.erase(tokens.begin(), tokens.begin() + next);
+            tokens.insert(tokens.end(), make_move_iterator(piece_tokens.begin()), make_move_iterator(piece_tokens.end()));
+            next = 0;
+            stats.timer.end();
+            
+            // Code steps until one may go on into text not read yet. The
+            // word after a phrase is looked up once, for both steps.
+            StageTimer::Scope stage(stats.timer, "encode");
+            bool looked_up = false;
+            uint32_t lookahead = NONE;
+            while (next < tokens.size()) {
+                uint32_t word = lookahead;
+                if (!looked_up) {
+                    auto it = word_numbers.find(tokens[next]);
+                    word = it != word_numbers.end() ? it->second : NONE;
                 }
-            } else if (token.type == PHRASE) {
-                // Phrase reference
-                writer.write_bits(2, 2);  // Type bits: 10 = phrase reference
-                writer.write_bits(token.phrase_id, phrase_max_bit_length);
-            } else if (token.type == WILDCARD) {
-                // Wildcard word in phrase
-                writer.write_bits(3, 2);  // Type bits: 11 = wildcard word
-                
-                // Check if wildcard word is in main dictionary
-                auto it = main_encode_dict.find(token.word);
-                if (it != main_encode_dict.end()) {
-                    // Word in main dictionary
-                    writer.write_bits(0, 1);  // Word type bit: 0 = main dictionary word
-                    writer.write_bits(it->second, main_max_bit_length);
+                uint8_t code_bits = adaptive_code_bits(dictionary);
+                uint32_t code;
+                size_t length = 1;
+                if (word == NONE) {
+                    const string& token = tokens[next];
+                    writer.write_bits(ADAPTIVE_NEW_WORD, code_bits);
+                    writer.write_gamma(static_cast<uint32_t>(token.size()));
+                    for (char c : token) {
+                        writer.write_bits(static_cast<uint8_t>(c), 8);
+                    }
+                    word_numbers.emplace(token, dictionary.word_count());
+                    code = dictionary.add_word();
+                    word_codes.push_back(code);
+                    lookahead = NONE;
+                    looked_up = false;
+                    stats.count_token(STATS_LOCAL_WORD, code_bits + 2 * bits_needed(token.size() + 1) - 1 + 8 * token.size());
                 } else {
-                    // Word in local dictionary
-                    auto local_it = local_encode_dict.find(token.word);
-                    if (local_it != local_encode_dict.end()) {
-                        writer.write_bits(1, 1);  // Word type bit: 1 = local dictionary word
-                        writer.write_bits(local_it->second, local_max_bit_length);
-                    } else {
-                        cerr << "Error: Wildcard word not found in either dictionary: " << token.word << endl;
-                        return false;
+                    code = word_codes[word];
+                    looked_up = false;
+                    while (next + length < tokens.size()) {
+                        auto it = word_numbers.find(tokens[next + length]);
+                        lookahead = it != word_numbers.end() ? it->second : NONE;
+                        uint32_t longer = lookahead != NONE ? dictionary.child(code, lookahead) : NONE;
+                        if (longer == NONE) {
+                            looked_up = true;
+                            break;
+                        }
+                        code = longer;
+                        length++;
                     }
+                    if (!looked_up && !last_piece) {
+                        break;
+                    }
+                    writer.write_bits(code + ADAPTIVE_CODE_BASE, code_bits);
+                    stats.count_token(length > 1 ? STATS_PHRASE : STATS_MAIN_WORD, code_bits);
                 }
+                dictionary.touch(code);
+                dictionary.extend(previous, dictionary[code].first);
+                previous = code;
+                next += length;
+                token_count += length;
+                code_count++;
             }
+            writer.drain(outfile);
         }
-        
-        // Write compressed data to file
-        if (!writer.write_to_file(output_file)) {
+        writer.write_bits(ADAPTIVE_END, adaptive_code_bits(dictionary));
+        writer.flush();
+        writer.drain(outfile);
+        if (!outfile.good()) {
             cerr << "Error writing compressed data to file: " << output_file << endl;
             return false;
         }
+        stats.total_bits = static_cast<uint64_t>(outfile.tellp()) * 8;
         
+        cout << "\nAdaptive Statistics:" << endl;
+        cout << "-------------------" << endl;
+        cout << "Input tokens: " << token_count << endl;
+        cout << "Codes: " << code_count << endl;
+        cout << "Words: " << dictionary.word_count() << endl;
+        cout << "Phrases: " << dictionary.size() - dictionary.word_count() << " (" << dictionary.evicted()
+             << " evicted)" << endl;
         return true;
     }
-
+    
     bool decompress(const string& dict_file, 
                     const string& input_file, 
                     const string& output_file) {
-        // Step 1: Load dictionaries
-        if (!load_dictionaries(dict_file)) {
-            cerr << "Failed to load dictionaries from file: " << dict_file << endl;
+        stats.reset();
+        
+        // Map the file and read it in place
+        MappedFile compressed;
+        if (!compressed.open(input_file)) {
+            cerr << "Error opening compressed file: " << input_file << endl;
             return false;
         }
+        const char* data = compressed.data();
+        size_t data_size = compressed.size();
         
-        // Step 2: Read compressed data
-        ifstream infile(input_file, ios::binary);
-        if (!infile) {
-            cerr << "Error opening compressed file: " << input_file << endl;
+        // Files are tagged with a magic number per format
+        bool is_phrase_file = data_size >= 5 && equal(data, data + 4, PHRASE_MAGIC);
+        bool is_repair_file = data_size >= 4 && equal(data, data + 4, REPAIR_MAGIC);
+        bool is_adaptive_file = data_size >= 4 && equal(data, data + 4, ADAPTIVE_MAGIC);
+        if (!is_phrase_file && !is_repair_file && !is_adaptive_file) {
+            cerr << "Unknown compressed file format: " << input_file << endl;
             return false;
         }
         
-        // Read file into buffer
-        vector<uint8_t> buffer((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
-        infile.close();
+        // Step 1: Load dictionaries; adaptive files need none
+        if (!is_adaptive_file && !load_dictionaries(dict_file)) {
+            cerr << "Failed to load dictionaries from file: " << dict_file << endl;
+            return false;
+        }
         
-        BitReader reader(buffer);
+        // Step 2: Read compressed data
+        stats.timer.begin("bit_decode");
+        BitReader reader(reinterpret_cast<const uint8_t*>(data), data_size);
+        stats.total_bits = data_size * 8;
+        reader.read_bits(32);
         
-        // Step 3: Read local dictionary
-        uint32_t local_dict_size = reader.read_bits(16);
+        if (is_adaptive_file) {
+            stats.timer.end();
+            ofstream outfile(output_file);
+            if (!outfile) {
+                cerr << "Error opening output file: " << output_file << endl;
+                return false;
+            }
+            return decompress_adaptive(reader, outfile);
+        }
+        if (is_repair_file) {
+            stats.timer.end();
+            ofstream outfile(output_file);
+            if (!outfile) {
+                cerr << "Error opening output file: " << output_file << endl;
+                return false;
+            }
+            return decompress_repair(reader, outfile);
+        }
         
-        vector<string> local_decode_dict;
-        for (uint32_t i = 0; i < local_dict_size; ++i) {
-            uint8_t word_len = reader.read_bits(8);
-            string word;
-            for (uint8_t j = 0; j < word_len; ++j) {
-                char c = static_cast<char>(reader.read_bits(8));
-                word += c;
+        // Step 3: Read header and local dictionary
+        uint8_t flags = reader.read_bits(8);
+        const BackendCodec* backend = nullptr;
+        if (flags & FLAG_BACKEND) {
+            uint8_t backend_id = reader.read_bits(8);
+            backend = BackendCodec::find(backend_id);
+            if (backend == nullptr) {
+                cerr << "Compressed file needs a backend codec that is not built in: "
+                     << static_cast<int>(backend_id) << endl;
+                return false;
             }
-            local_decode_dict.push_back(word);
+        }
+        if (flags & FLAG_MEMBERS) {
+            cerr << "Member archives are extracted with x: " << input_file << endl;
+            return false;
         }
         
-        // Calculate bits needed for local dictionary
-        uint8_t local_max_bit_length = 0;
-        while ((1ULL << local_max_bit_length) < local_decode_dict.size()) {
-            local_max_bit_length++;
+        // Step 4: Decode and write the segments, one after another
+        size_t body = 5 + ((flags & FLAG_BACKEND) != 0);
+        vector<pair<uint64_t, uint64_t>> segments;
+        if (!read_segments(data, data_size, body, flags, segments)) {
+            cerr << "Invalid segment table: " << input_file << endl;
+            return false;
         }
+        stats.timer.end();
         
-        // Step 4: Decompress data and write to output file
         ofstream outfile(output_file);
         if (!outfile) {
             cerr << "Error opening output file: " << output_file << endl;
             return false;
         }
+        bool words_before = false;
+        for (const auto& segment : segments) {
+            BitReader segment_reader(reinterpret_cast<const uint8_t*>(data) + segment.first,
+                                     segment.second - segment.first);
+            if (!decompress_segment(segment_reader, flags, backend, words_before, outfile)) {
+                return false;
+            }
+        }
+        return outfile.good();
+    }
+    
+    // Find a query of one or more words in phrase-mode archives compressed
+    // with the same dictionary, without writing out their text. The query
+    // is tokenized like the input was, so it matches in lower case.
+    bool search(const string& dict_file, const string& query, const vector<string>& input_files,
+                vector<SearchHit>& hits) {
+        stats.reset();
+        if (!load_dictionaries(dict_file)) {
+            cerr << "Failed to load dictionaries from file: " << dict_file << endl;
+            return false;
+        }
+        vector<string> query_tokens = tokenize_raw(query);
+        if (query_tokens.empty()) {
+            cerr << "Empty search query" << endl;
+            return false;
+        }
+        for (size_t file = 0; file < input_files.size(); ++file) {
+            if (!search_archive(input_files[file], file, query_tokens, hits)) {
+                cerr << "Search failed in: " << input_files[file] << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // Benchmark mode: compress and decompress one input, check the round trip
+    // and print one JSON object (a single line) with the per-stage timings,
+    // ratio, bits per word and peak RSS. Stage throughput is measured against
+    // the input size so stages can be compared with each other.
+    bool benchmark(const string& dict_file, const string& input_file, int level, ostream& out) {
+        const string compressed_file = "bench.ttc";
+        const string restored_file = "bench.out";
         
-        while (reader.has_more()) {
-            // Read token type
-            uint8_t type_bits = reader.read_bits(1);
-            
-            if (type_bits == 0) {
-                // Main dictionary word
-                uint32_t word_code = reader.read_bits(main_max_bit_length);
-                if (word_code < main_decode_dict.size()) {
-                    outfile << main_decode_dict[word_code];
-                } else {
-                    cerr << "Invalid word code in main dictionary: " << word_code << endl;
-                    return false;
+        ifstream infile(input_file);
+        if (!infile) {
+            cerr << "Error opening input file: " << input_file << endl;
+            return false;
+        }
+        string text((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+        infile.close();
+        
+        // The decompressor restores the tokens separated by single spaces,
+        // or in lossless mode the text itself
+        vector<string> tokens = tokenize_raw(text);
+        string expected;
+        for (size_t i = 0; i < tokens.size() && !settings.lossless; ++i) {
+            if (i > 0) expected += ' ';
+            expected += tokens[i];
+        }
+        if (settings.lossless) {
+            expected = text;
+        }
+        
+        // Keep the progress output of compress and decompress out of the report
+        streambuf* saved_cout = cout.rdbuf(nullptr);
+        bool ok = compress(dict_file, input_file, compressed_file);
+        StageTimer compress_timer = stats.timer;
+        
+        // Levels that reuse a trained dictionary do not write eng.dict
+        bool trained = settings.use_trained_phrases && is_trained_dictionary(dict_file);
+        string decode_dict = trained ? dict_file : "eng.dict";
+        ok = ok && decompress(decode_dict, compressed_file, restored_file);
+        StageTimer decompress_timer = stats.timer;
+        cout.rdbuf(saved_cout);
+        if (!ok) {
+            return false;
+        }
+        
+        ifstream restored_stream(restored_file);
+        string restored((istreambuf_iterator<char>(restored_stream)), istreambuf_iterator<char>());
+        restored_stream.close();
+        
+        uint64_t compressed_bytes = file_size(compressed_file);
+        uint64_t dictionary_bytes = file_size(decode_dict);
+        remove(compressed_file.c_str());
+        remove(restored_file.c_str());
+        
+        double input_mb = text.size() / 1e6;
+        out << fixed << setprecision(6);
+        out << "{\"input\":" << json_string(input_file)
+            << ",\"level\":" << level
+            << ",\"input_bytes\":" << text.size()
+            << ",\"words\":" << tokens.size()
+            << ",\"compressed_bytes\":" << compressed_bytes
+            << ",\"dictionary_bytes\":" << dictionary_bytes
+            << ",\"ratio\":" << (text.empty() ? 0.0 : static_cast<double>(compressed_bytes) / text.size())
+            << ",\"bits_per_word\":" << (tokens.empty() ? 0.0 : compressed_bytes * 8.0 / tokens.size())
+            << ",\"main_code_bits\":" << static_cast<int>(main_max_bit_length)
+            << ",\"unpack_kernel\":" << json_string(LanePacker::kernel_name())
+            << ",\"vbyte_kernel\":" << json_string(StreamVByte::kernel_name())
+            << ",\"backend\":" << json_string(settings.backend != nullptr ? settings.backend->name() : "")
+            << ",\"lossless\":" << (settings.lossless ? "true" : "false")
+            << ",\"roundtrip\":" << (restored == expected ? "true" : "false")
+            << ",\"peak_rss_kb\":" << peak_rss_kb()
+            << ",\"compress\":";
+        write_stage_json(out, compress_timer, input_mb);
+        out << ",\"decompress\":";
+        write_stage_json(out, decompress_timer, input_mb);
+        out << "}" << endl;
+        
+        return restored == expected;
+    }
+    
+    // Map microbenchmark: FlatHashMap against std::unordered_map on the
+    // distinct words and 2-5 word n-grams of one input, best of
+    // MICROBENCH_RUNS runs of each operation. Prints one JSON line per map;
+    // the string_view map keys the text of the key list, as the miners do.
+    bool microbenchmark(const string& input_file, ostream& out) {
+        ifstream infile(input_file);
+        if (!infile) {
+            cerr << "Error opening input file: " << input_file << endl;
+            return false;
+        }
+        string text((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+        vector<string> tokens = tokenize_raw(text);
+        
+        vector<string> ngrams;
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            string ngram = tokens[i];
+            for (size_t n = 2; n <= 5 && i + n <= tokens.size(); ++n) {
+                ngram += ' ';
+                ngram += tokens[i + n - 1];
+                ngrams.push_back(ngram);
+            }
+        }
+        
+        // Distinct keys in a fixed random order, and as many absent ones
+        vector<string> keys(tokens);
+        keys.insert(keys.end(), ngrams.begin(), ngrams.end());
+        sort(keys.begin(), keys.end());
+        keys.erase(unique(keys.begin(), keys.end()), keys.end());
+        shuffle(keys.begin(), keys.end(), mt19937(1));
+        vector<string> absent;
+        for (const auto& key : keys) {
+            absent.push_back(key + "#");
+        }
+        
+        auto report = [&](const char* name, const MapTimings& timings) {
+            out << fixed << setprecision(3);
+            out << "{\"input\":" << json_string(input_file)
+                << ",\"map\":" << json_string(name)
+                << ",\"keys\":" << keys.size()
+                << ",\"words\":" << tokens.size()
+                << ",\"ngrams\":" << ngrams.size()
+                << ",\"insert_ms\":" << timings.insert_ms
+                << ",\"find_ms\":" << timings.find_ms
+                << ",\"find_absent_ms\":" << timings.find_absent_ms
+                << ",\"count_ngrams_ms\":" << timings.count_ngrams_ms
+                << ",\"count_words_ms\":" << timings.count_words_ms
+                << "}" << endl;
+        };
+        report("unordered_map", time_map<unordered_map<string, uint32_t>, string>(keys, absent, tokens, ngrams));
+        report("FlatHashMap", time_map<FlatHashMap<string, uint32_t>, string>(keys, absent, tokens, ngrams));
+        report("FlatHashMap<string_view>",
+               time_map<FlatHashMap<string_view, uint32_t>, string_view>(keys, absent, tokens, ngrams));
+        return true;
+    }
+    
+private:
+    static constexpr int MICROBENCH_RUNS = 5;
+    
+    // Best times of the microbenchmark operations, in milliseconds
+    struct MapTimings {
+        double insert_ms = 1e300;
+        double find_ms = 1e300;         // Every key, 5 times
+        double find_absent_ms = 1e300;  // Every absent key, 5 times
+        double count_ngrams_ms = 1e300;
+        double count_words_ms = 1e300;
+    };
+    
+    template <typename Map, typename Key>
+    static MapTimings time_map(const vector<string>& keys, const vector<string>& absent,
+                               const vector<string>& words, const vector<string>& ngrams) {
+        // Keys are passed by reference, not copied, unless Key is a view
+        typedef conditional_t<is_same<Key, string>::value, const string&, Key> KeyRef;
+        MapTimings timings;
+        uint64_t checksum = 0;
+        auto best = [](double& best_ms, auto&& operation) {
+            auto start = chrono::steady_clock::now();
+            operation();
+            best_ms = min(best_ms, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        };
+        auto count = [&](double& best_ms, const vector<string>& stream) {
+            Map counts;
+            best(best_ms, [&]() {
+                for (const auto& item : stream) {
+                    counts[KeyRef(item)]++;
                 }
-            } else {
-                // Additional type bit needed
-                uint8_t additional_type_bit = reader.read_bits(1);
-                
-                if (additional_type_bit == 0) {
-                    // Local dictionary word
-                    uint32_t word_code = reader.read_bits(local_max_bit_length);
-                    if (word_code < local_decode_dict.size()) {
-                        outfile << local_decode_dict[word_code];
-                    } else {
-                        cerr << "Invalid word code in local dictionary: " << word_code << endl;
-                        return false;
+            });
+            checksum += counts.size();
+        };
+        
+        for (int run = 0; run < MICROBENCH_RUNS; ++run) {
+            Map map;
+            best(timings.insert_ms, [&]() {
+                for (uint32_t i = 0; i < keys.size(); ++i) {
+                    map[KeyRef(keys[i])] = i;
+                }
+            });
+            best(timings.find_ms, [&]() {
+                for (int pass = 0; pass < 5; ++pass) {
+                    for (const auto& key : keys) {
+                        checksum += map.find(KeyRef(key))->second;
                     }
-                } else if (additional_type_bit == 1) {
-                    // Phrase reference
-                    uint32_t phrase_id = reader.read_bits(phrase_max_bit_length);
-                    if (phrase_id < phrase_decode_dict.size()) {
-                        const auto& phrase = phrase_decode_dict[phrase_id];
-                        
-                        // Handle phrases differently based on whether they have a wildcard
-                        if (phrase.has_wildcard) {
-                            // For phrases with wildcards, we need the next token to be the wildcard word
-                            if (!reader.has_more()) {
-                                cerr << "Error: Expected wildcard word after wildcard phrase" << endl;
-                                return false;
-                            }
-                            
-                            // Read wildcard word type
-                            uint8_t wildcard_type = reader.read_bits(2);
-                            if (wildcard_type != 3) {
-                                cerr << "Error: Expected wildcard token after wildcard phrase" << endl;
-                                return false;
-                            }
-                            
-                            // Read wildcard word
-                            uint8_t word_dict_type = reader.read_bits(1);
-                            uint32_t word_code;
-                            string wildcard_word;
-                            
-                            if (word_dict_type == 0) {
-                                // Main dictionary word
-                                word_code = reader.read_bits(main_max_bit_length);
-                                if (word_code < main_decode_dict.size()) {
-                                    cout << "word: " << main_decode_dict[word_code] << endl;
-                                    wildcard_word = main_decode_dict[word_code];
-                                } else {
-                                    cerr << "Invalid wildcard word code in main dictionary: " << word_code << endl;
-                                    return false;
-                                }
-                            } else {
-                                // Local dictionary word
-                                word_code = reader.read_bits(local_max_bit_length);
-                                if (word_code < local_decode_dict.size()) {
-                                    wildcard_word = local_decode_dict[word_code];
-                                } else {
-                                    cerr << "Invalid wildcard word code in local dictionary: " << word_code << endl;
-                                    return false;
-                                }
-                            }
-                            
-                            // Output phrase with wildcard word inserted
-                            for (size_t i = 0; i < phrase.word_codes.size(); ++i) {
-                                if (i > 0) outfile << " ";
-                                
-                                if (i == phrase.wildcard_pos) {
-                                    outfile << wildcard_word;
-                                } else {
-                                    uint32_t code = phrase.word_codes[i];
-                                    if (code < main_decode_dict.size()) {
-                                        outfile << main_decode_dict[code];
-                                        cout << "word: " << main_decode_dict[code] << endl;
-                                    } else {
-                                        cerr << "Invalid word code in phrase: " << code << endl;
-                                        return false;
-                                    }
-                                }
-                            }
-                        } else {
-                            // Regular phrase
-                            for (size_t i = 0; i < phrase.word_codes.size(); ++i) {
-                                if (i > 0) outfile << " ";
-                                
-                                uint32_t code = phrase.word_codes[i];
-                                if (code < main_decode_dict.size()) {
-                                    outfile << main_decode_dict[code];
-                                } else {
-                                    cerr << "Invalid word code in phrase: " << code << endl;
-                                    return false;
-                                }
-                            }
-                        }
-                    } else {
-                        cerr << "Invalid phrase ID: " << phrase_id << endl;
-                        return false;
+                }
+            });
+            best(timings.find_absent_ms, [&]() {
+                for (int pass = 0; pass < 5; ++pass) {
+                    for (const auto& key : absent) {
+                        checksum += map.find(KeyRef(key)) == map.end();
                     }
                 }
-            }
-            
-            // Add space after each token (except certain punctuation)
-            if (reader.has_more()) {
-                outfile << " ";
-            }
+            });
+            count(timings.count_ngrams_ms, ngrams);
+            count(timings.count_words_ms, words);
         }
         
-        return true;
+        // Keep the lookups from being optimized away
+        if (checksum == 0) {
+            cerr << "Empty microbenchmark input" << endl;
+        }
+        return timings;
     }
 };
 
+// Options of the corpus generator and of synthetic benchmark inputs
+static bool is_corpus_option(const string& option) {
+    for (const char* prefix : {"--synthetic=", "--size=", "--zipf=", "--rare-rate=", "--phrase-rate=", "--seed="}) {
+        if (option.rfind(prefix, 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Byte count with an optional K, M or G suffix (powers of 1000, like MB/s)
+static uint64_t parse_size(const string& value) {
+    size_t end = 0;
+    uint64_t size = stoull(value, &end);
+    if (end < value.size()) {
+        switch (toupper(static_cast<unsigned char>(value[end]))) {
+            case 'K': size *= 1000ULL; break;
+            case 'M': size *= 1000000ULL; break;
+            case 'G': size *= 1000000000ULL; break;
+        }
+    }
+    return size;
+}
+
+// Learn the generator model from sample texts, then apply option overrides
+static bool build_corpus_generator(CorpusGenerator& generator, const vector<string>& sample_files,
+                                   const vector<string>& options) {
+    for (const auto& sample_file : sample_files) {
+        ifstream infile(sample_file);
+        if (!infile) {
+            cerr << "Error opening sample file: " << sample_file << endl;
+            return false;
+        }
+        string text((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+        generator.learn(text);
+    }
+    
+    if (!generator.finalize()) {
+        cerr << "No words in the sample text" << endl;
+        return false;
+    }
+    
+    for (const auto& option : options) {
+        if (option.rfind("--zipf=", 0) == 0) {
+            generator.set_zipf_exponent(stod(option.substr(7)));
+        } else if (option.rfind("--rare-rate=", 0) == 0) {
+            generator.set_rare_word_rate(stod(option.substr(12)));
+        } else if (option.rfind("--phrase-rate=", 0) == 0) {
+            generator.set_phrase_rate(stod(option.substr(14)));
+        }
+    }
+    return true;
+}
+
+static uint64_t corpus_seed(const vector<string>& options) {
+    uint64_t seed = 12345;
+    for (const auto& option : options) {
+        if (option.rfind("--seed=", 0) == 0) {
+            seed = stoull(option.substr(7));
+        }
+    }
+    return seed;
+}
+
+// Options override the settings of the compression level
+static bool apply_options(TwoTierTextCompressor& compressor, const vector<string>& options) {
+    for (const auto& option : options) {
+        if (option.rfind("--window=", 0) == 0) {
+            compressor.set_match_window(stoul(option.substr(9)));
+        } else if (option == "--split-streams") {
+            compressor.set_split_streams(true);
+        } else if (option == "--stream-vbyte") {
+            compressor.set_stream_vbyte(true);
+        } else if (option == "--lossless") {
+            compressor.set_lossless(true);
+        } else if (option == "--index") {
+            compressor.set_block_index(true);
+        } else if (option == "--dedup") {
+            compressor.set_dedup(true);
+        } else if (option.rfind("--backend=", 0) == 0) {
+            if (!compressor.set_backend(option.substr(10))) {
+                cerr << "Unknown backend: " << option.substr(10) << " (built in: " << BackendCodec::names() << ")" << endl;
+                return false;
+            }
+        } else if (option != "--stats" && option.rfind("--stats=", 0) != 0 && !is_corpus_option(option)) {
+            cerr << "Unknown option: " << option << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Benchmark mode: each input, level and backend runs in a child process, so
+// peak RSS is measured per run, and prints one JSON line to stdout. A comma
+// list of backends benchmarks each in turn.
+static bool run_benchmarks(const vector<int>& levels, const vector<string>& options,
+                           const string& dict_file, const vector<string>& input_files) {
+    vector<string> backends;
+    vector<string> run_options;
+    for (const auto& option : options) {
+        if (option.rfind("--backend=", 0) == 0) {
+            stringstream names(option.substr(10));
+            string name;
+            while (getline(names, name, ',')) {
+                backends.push_back("--backend=" + name);
+            }
+        } else {
+            run_options.push_back(option);
+        }
+    }
+    if (backends.empty()) {
+        backends.push_back("");
+    }
+    
+    bool success = true;
+    for (const auto& input_file : input_files) {
+        for (int level : levels) {
+            for (const auto& backend : backends) {
+                cout.flush();
+                pid_t pid = fork();
+                if (pid < 0) {
+                    cerr << "Failed to start benchmark process" << endl;
+                    return false;
+                }
+                
+                if (pid == 0) {
+                    TwoTierTextCompressor compressor;
+                    compressor.set_level(level);
+                    vector<string> backend_options = run_options;
+                    if (!backend.empty()) {
+                        backend_options.push_back(backend);
+                    }
+                    bool ok = apply_options(compressor, backend_options) &&
+                              compressor.benchmark(dict_file, input_file, level, cout);
+                    cout.flush();
+                    _exit(ok ? 0 : 1);
+                }
+                
+                int status = 0;
+                waitpid(pid, &status, 0);
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    cerr << "Benchmark failed: " << input_file << " at level " << level
+                         << (backend.empty() ? "" : " with " + backend) << endl;
+                    success = false;
+                }
+            }
+        }
+    }
+    return success;
+}
+
 // Main function
 int main(int argc, char* argv[]) {
-    if (argc < 4) {
-        cout << "Usage for compression: " << argv[0] << " c dictionary_file input_file output_file" << endl;
+    // Options start with "--" and may appear anywhere after the mode
+    vector<string> args;
+    vector<string> options;
+    vector<string> level_args;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.size() == 2 && arg[0] == '-' && arg[1] >= '1' && arg[1] <= '9') {
+            level_args.push_back(arg);
+        } else if (arg.rfind("--", 0) == 0) {
+            options.push_back(arg);
+        } else {
+            args.push_back(arg);
+        }
+    }
+    
+    string mode = args.empty() ? "" : args[0];
+    bool microbench = mode == "b" && find(options.begin(), options.end(), "--microbench") != options.end();
+    size_t required_args = microbench ? 2 : (mode == "b" || mode == "g" || mode == "l" || mode == "d") ? 3 : 4;
+    
+    if (args.size() < required_args) {
+        cout << "Usage for compression: " << argv[0] << " c [options] dictionary_file input_file output_file" << endl;
+        cout << "Usage for Re-Pair compression: " << argv[0] << " r dictionary_file input_file output_file" << endl;
+        cout << "Usage for adaptive compression: " << argv[0] << " l input_file output_file" << endl;
         cout << "Usage for decompression: " << argv[0] << " d dictionary_file input_file output_file" << endl;
+        cout << "               Adaptive files leave out dictionary_file" << endl;
+        cout << "Usage for append: " << argv[0] << " a [options] dictionary_file input_file archive_file" << endl;
+        cout << "Usage for member archives: " << argv[0] << " m [options] dictionary_file archive_file input_file..." << endl;
+        cout << "Usage for extraction: " << argv[0] << " x dictionary_file archive_file output_directory [member...]" << endl;
+        cout << "Usage for search: " << argv[0] << " s [options] dictionary_file query input_file..." << endl;
+        cout << "Usage for benchmark: " << argv[0] << " b [options] dictionary_file input_file..." << endl;
+        cout << "Usage for map microbenchmark: " << argv[0] << " b --microbench input_file..." << endl;
+        cout << "Usage for synthetic text: " << argv[0] << " g [options] sample_file... output_file" << endl;
+        cout << "Options:" << endl;
+        cout << "  -1 ... -9    Compression level (default -" << DEFAULT_LEVEL << "); -1 to -3 need a trained dictionary" << endl;
+        cout << "               The benchmark runs every level given" << endl;
+        cout << "  --window=N   Long-range match window in tokens (0 disables)" << endl;
+        cout << "  --split-streams  Write token classes, codes, fillers and matches as" << endl;
+        cout << "               separate streams per block, each coded on its own" << endl;
+        cout << "  --stream-vbyte  Split streams in byte-aligned Stream VByte: a file about 25%" << endl;
+        cout << "               larger. It only decodes faster on large inputs (123 vs 100 MB/s" << endl;
+        cout << "               on 30 MB of synthetic text); on a book it is slightly slower" << endl;
+        cout << "  --lossless   Keep case and whitespace, so the text restores byte for byte" << endl;
+        cout << "  --index      Write the blocks each word is in to output_file" << INDEX_SUFFIX << ", which search" << endl;
+        cout << "               reads to skip blocks and archives (implies --split-streams)" << endl;
+        cout << "  --dedup      Store text repeated across the members of an archive once" << endl;
+        cout << "  --backend=NAME  Run split streams through a second-stage codec: " << BackendCodec::names() << endl;
+        cout << "               (build with -DBACKEND_CODEC_LZMA or -DBACKEND_CODEC_ZSTD for more)." << endl;
+        cout << "               The benchmark takes a comma list and runs each" << endl;
+        cout << "  --stats[=FILE]  Write run statistics as JSON to stdout or FILE" << endl;
+        cout << "  --synthetic=SIZE[,SIZE...]  Also benchmark synthetic text of these sizes," << endl;
+        cout << "               modelled on the benchmark inputs (sizes take K, M or G)" << endl;
+        cout << "  --size=SIZE  Synthetic text size (default 1M)" << endl;
+        cout << "  --zipf=S, --rare-rate=R, --phrase-rate=R  Override the learned model" << endl;
+        cout << "  --seed=N     Random seed of the synthetic text" << endl;
         return 1;
     }
     
-    string mode = argv[1];
-    string dict_file = argv[2];
-    string input_file = argv[3];
-    string output_file = argv[4];
+    if (mode == "g") {
+        // Synthetic text modelled on the sample files
+        uint64_t size = 1000000;
+        for (const auto& option : options) {
+            if (option.rfind("--size=", 0) == 0) {
+                size = parse_size(option.substr(7));
+            }
+        }
+        
+        CorpusGenerator generator;
+        vector<string> sample_files(args.begin() + 1, args.end() - 1);
+        if (!build_corpus_generator(generator, sample_files, options)) {
+            return 1;
+        }
+        
+        cout << "Vocabulary " << generator.vocabulary_size() << " words, " << generator.phrase_count()
+             << " phrases, Zipf exponent " << generator.get_zipf_exponent()
+             << ", rare word rate " << generator.get_rare_word_rate()
+             << ", phrase rate " << generator.get_phrase_rate() << endl;
+        
+        ofstream outfile(args.back(), ios::binary);
+        if (!outfile || !generator.generate(outfile, size, corpus_seed(options))) {
+            cerr << "Error writing synthetic text: " << args.back() << endl;
+            return 1;
+        }
+        return 0;
+    }
+    
+    if (microbench) {
+        // FlatHashMap against std::unordered_map, as JSON lines on stdout
+        bool success = true;
+        for (size_t i = 1; i < args.size(); ++i) {
+            TwoTierTextCompressor compressor;
+            success = compressor.microbenchmark(args[i], cout) && success;
+        }
+        return success ? 0 : 1;
+    }
+    
+    if (mode == "b") {
+        // Benchmark results are JSON lines on stdout; compressed and restored
+        // files are written to the working directory and removed again
+        vector<int> levels;
+        for (const auto& arg : level_args) {
+            levels.push_back(arg[1] - '0');
+        }
+        if (levels.empty()) {
+            levels.push_back(DEFAULT_LEVEL);
+        }
+        
+        vector<string> input_files(args.begin() + 2, args.end());
+        bool success = run_benchmarks(levels, options, args[1], input_files);
+        
+        // Synthetic inputs are modelled on the real ones and benchmarked one
+        // size at a time, so only one of them is on disk at once
+        vector<uint64_t> synthetic_sizes;
+        for (const auto& option : options) {
+            if (option.rfind("--synthetic=", 0) == 0) {
+                stringstream sizes(option.substr(12));
+                string size;
+                while (getline(sizes, size, ',')) {
+                    synthetic_sizes.push_back(parse_size(size));
+                }
+            }
+        }
+        
+        if (!synthetic_sizes.empty()) {
+            CorpusGenerator generator;
+            if (!build_corpus_generator(generator, input_files, options)) {
+                return 1;
+            }
+            
+            for (uint64_t size : synthetic_sizes) {
+                const string synthetic_file = "bench_synthetic_" + to_string(size) + ".txt";
+                ofstream outfile(synthetic_file, ios::binary);
+                if (!outfile || !generator.generate(outfile, size, corpus_seed(options))) {
+                    cerr << "Error writing synthetic text: " << synthetic_file << endl;
+                    return 1;
+                }
+                outfile.close();
+                
+                success = run_benchmarks(levels, options, args[1], {synthetic_file}) && success;
+                remove(synthetic_file.c_str());
+            }
+        }
+        
+        return success ? 0 : 1;
+    }
+    
+    // Adaptive files need no dictionary, so it is left out of the arguments
+    bool no_dictionary = mode == "l" || (mode == "d" && args.size() == 3);
+    string dict_file = no_dictionary ? "" : args[1];
+    string input_file = args[no_dictionary ? 1 : 2];
+    string output_file = args[no_dictionary ? 2 : 3];
     
     TwoTierTextCompressor compressor;
     bool success = false;
     
+    // Level first so that explicit options override its settings
+    for (const auto& arg : level_args) {
+        compressor.set_level(arg[1] - '0');
+    }
+    
+    if (!apply_options(compressor, options)) {
+        return 1;
+    }
+    
     if (mode == "c") {
         cout << "Compressing " << input_file << " to " << output_file << " using dictionary " << dict_file << endl;
         success = compressor.compress(dict_file, input_file, output_file);
+    } else if (mode == "r") {
+        cout << "Compressing " << input_file << " to " << output_file << " with Re-Pair using dictionary " << dict_file << endl;
+        success = compressor.compress_repair(dict_file, input_file, output_file);
+    } else if (mode == "l") {
+        cout << "Compressing " << input_file << " to " << output_file << " adaptively" << endl;
+        success = compressor.compress_adaptive(input_file, output_file);
+    } else if (mode == "m") {
+        // Members are stored under the file names of the inputs
+        vector<string> input_files(args.begin() + 3, args.end());
+        cout << "Compressing " << input_files.size() << " files to " << input_file << " using dictionary " << dict_file << endl;
+        success = compressor.compress_members(dict_file, input_files, input_file);
+    } else if (mode == "x") {
+        vector<string> members(args.begin() + 4, args.end());
+        cout << "Extracting " << input_file << " to " << output_file << " using dictionary " << dict_file << endl;
+        success = compressor.extract_members(dict_file, input_file, output_file, members);
+    } else if (mode == "a") {
+        cout << "Appending " << input_file << " to " << output_file << " using dictionary " << dict_file << endl;
+        success = compressor.append(dict_file, input_file, output_file);
+    } else if (mode == "d" && no_dictionary) {
+        cout << "Decompressing " << input_file << " to " << output_file << endl;
+        success = compressor.decompress(dict_file, input_file, output_file);
     } else if (mode == "d") {
         cout << "Decompressing " << input_file << " to " << output_file << " using dictionary " << dict_file << endl;
         success = compressor.decompress(dict_file, input_file, output_file);
+    } else if (mode == "s") {
+        // Hits go to stdout, one per line, as file:position: context, where
+        // the position counts words from the start of the file
+        vector<string> input_files(args.begin() + 3, args.end());
+        vector<SearchHit> hits;
+        success = compressor.search(dict_file, args[2], input_files, hits);
+        for (const auto& hit : hits) {
+            cout << input_files[hit.file] << ":" << hit.position << ": " << hit.context << endl;
+        }
+        cout << hits.size() << " matches" << endl;
     } else {
-        cerr << "Invalid mode. Use 'c' for compression or 'd' for decompression." << endl;
+        cerr << "Invalid mode. Use 'c', 'r' or 'l' for compression, 'a' to append, 'm' and 'x' for member archives, 'd' for decompression, 's' for search or 'b' for benchmarks." << endl;
         return 1;
     }
     
@@ -1093,5 +6239,21 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
+    // Statistics go to stdout as the last line, or to the named file
+    string operation = mode == "d" || mode == "x" ? "decompress" : mode == "s" ? "search" :
+                       mode == "a" ? "append" : "compress";
+    for (const auto& option : options) {
+        if (option == "--stats") {
+            compressor.get_stats().write_json(cout, operation);
+        } else if (option.rfind("--stats=", 0) == 0) {
+            ofstream stats_file(option.substr(8));
+            if (!stats_file) {
+                cerr << "Error opening statistics file: " << option.substr(8) << endl;
+                return 1;
+            }
+            compressor.get_stats().write_json(stats_file, operation);
+        }
+    }
+    
     return 0;
 }
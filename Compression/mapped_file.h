@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+private:
+    void* address = MAP_FAILED;
+    size_t length = 0;
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    // Map path, replacing any earlier mapping; false if the file is missing,
+    // empty or cannot be mapped
+    bool open(const std::string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            length = static_cast<size_t>(info.st_size);
+            address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (address == MAP_FAILED) {
+            length = 0;
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (address != MAP_FAILED) {
+            munmap(address, length);
+        }
+        address = MAP_FAILED;
+        length = 0;
+    }
+
+    const char* data() const {
+        return address != MAP_FAILED ? static_cast<const char*>(address) : nullptr;
+    }
+
+    size_t size() const {
+        return length;
+    }
+};
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Minimal perfect hash over a fixed word list, in the PTHash style: keys are
+// hashed into buckets of about four, and each bucket stores a pilot that
+// moves its keys to slots no earlier bucket took. n distinct keys fill
+// exactly n slots. Each slot holds the key's code, its length and its first
+// INLINE_BYTES bytes, so a lookup is one hash, one pilot read and one 16-byte
+// slot read, and for keys that short the slot alone decides the answer.
+//
+// The function itself is just the seed and the pilots; the slots are filled
+// again from the key list, which is also how a stored function is checked.
+// A hit on a longer key is only a candidate: the caller confirms it by
+// comparing the word with key[code].
+class PerfectHash {
+public:
+    static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+    static constexpr size_t KEYS_PER_BUCKET = 4;
+    static constexpr size_t INLINE_BYTES = 8;
+
+private:
+    static constexpr uint32_t MAX_PILOT = 1u << 24;  // Tries per bucket before a new seed
+
+    struct Slot {
+        uint32_t code = NOT_FOUND;
+        uint32_t length = 0;
+        uint64_t prefix = 0;  // First INLINE_BYTES bytes, zero padded
+    };
+
+    uint64_t seed = 0;
+    std::vector<uint32_t> pilots;
+    std::vector<Slot> slots;
+
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 32;
+        h *= 0xD6E8FEB86659FD93ULL;
+        h ^= h >> 32;
+        return h;
+    }
+
+    // Up to 8 bytes as a little-endian number, zero padded. A loop, since a
+    // memcpy of variable length is a library call.
+    static uint64_t load_bytes(const char* data, size_t size) {
+        if (size >= 8) {
+            uint64_t value;
+            memcpy(&value, data, 8);
+            return value;
+        }
+        uint64_t value = 0;
+        for (size_t i = 0; i < size; ++i) {
+            value |= static_cast<uint64_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+        }
+        return value;
+    }
+
+    static uint64_t prefix_of(std::string_view key) {
+        return load_bytes(key.data(), key.size());
+    }
+
+    // Stored functions must hash the same way in every build, so no std::hash.
+    // One multiply per 8 bytes; words are short.
+    static uint64_t hash_key(std::string_view key, uint64_t seed) {
+        uint64_t h = seed ^ (key.size() * 0x9E3779B97F4A7C15ULL);
+        size_t i = 0;
+        for (; i + 8 <= key.size(); i += 8) {
+            uint64_t word;
+            memcpy(&word, key.data() + i, 8);
+            h = (h ^ word) * 0xFF51AFD7ED558CCDULL;
+        }
+        h = (h ^ load_bytes(key.data() + i, key.size() - i)) * 0xFF51AFD7ED558CCDULL;
+        return mix(h ^ (h >> 29));
+    }
+
+    // Map h onto [0, n) by its high bits
+    static size_t reduce(uint64_t h, size_t n) {
+        return static_cast<size_t>((static_cast<unsigned __int128>(h) * n) >> 64);
+    }
+
+    size_t bucket_of(uint64_t h) const {
+        return reduce(h, pilots.size());
+    }
+
+    size_t position(uint64_t h, uint32_t pilot) const {
+        return reduce(mix(h ^ (pilot * 0x9E3779B97F4A7C15ULL)), slots.size());
+    }
+
+    // Hashes of the distinct keys with their codes. A repeated key keeps its
+    // last code, as assigning codes into a map would.
+    template <typename Keys>
+    static std::vector<std::pair<uint64_t, uint32_t>> distinct_keys(const Keys& keys, uint64_t seed) {
+        std::vector<std::pair<uint64_t, uint32_t>> hashed;
+        hashed.reserve(keys.size());
+        for (uint32_t code = 0; code < keys.size(); ++code) {
+            hashed.push_back({hash_key(keys[code], seed), code});
+        }
+        std::sort(hashed.begin(), hashed.end());
+
+        std::vector<std::pair<uint64_t, uint32_t>> distinct;
+        distinct.reserve(hashed.size());
+        for (size_t i = 0; i < hashed.size(); ++i) {
+            // Equal hashes sort by code, so the last equal key wins
+            size_t j = i + 1;
+            while (j < hashed.size() && hashed[j].first == hashed[i].first &&
+                   keys[hashed[j].second] == keys[hashed[i].second]) {
+                ++j;
+            }
+            distinct.push_back(hashed[j - 1]);
+            i = j - 1;
+        }
+        return distinct;
+    }
+
+    // Fill the slots from the pilots; false if two keys collide
+    template <typename Keys>
+    bool fill_slots(const Keys& keys, const std::vector<std::pair<uint64_t, uint32_t>>& distinct) {
+        slots.assign(distinct.size(), Slot());
+        for (const auto& key : distinct) {
+            Slot& slot = slots[position(key.first, pilots[bucket_of(key.first)])];
+            if (slot.code != NOT_FOUND) {
+                return false;
+            }
+            slot.code = key.second;
+            std::string_view word = keys[key.second];
+            slot.length = word.size();
+            slot.prefix = prefix_of(word);
+        }
+        return true;
+    }
+
+    // Search a pilot for every bucket, largest buckets first while the table
+    // is still empty; false if some bucket found no free slots
+    bool search_pilots(const std::vector<std::pair<uint64_t, uint32_t>>& distinct) {
+        std::vector<std::vector<uint64_t>> buckets(pilots.size());
+        for (const auto& key : distinct) {
+            buckets[bucket_of(key.first)].push_back(key.first);
+        }
+        std::vector<uint32_t> order(buckets.size());
+        for (uint32_t b = 0; b < order.size(); ++b) {
+            order[b] = b;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return buckets[a].size() > buckets[b].size();
+        });
+
+        std::vector<bool> taken(slots.size(), false);
+        std::vector<size_t> placed;
+        for (uint32_t b : order) {
+            if (buckets[b].empty()) {
+                break;
+            }
+            uint32_t pilot = 0;
+            for (; pilot < MAX_PILOT; ++pilot) {
+                placed.clear();
+                for (uint64_t h : buckets[b]) {
+                    size_t p = position(h, pilot);
+                    if (taken[p] || std::find(placed.begin(), placed.end(), p) != placed.end()) {
+                        break;
+                    }
+                    placed.push_back(p);
+                }
+                if (placed.size() == buckets[b].size()) {
+                    break;
+                }
+            }
+            if (pilot == MAX_PILOT) {
+                return false;
+            }
+            pilots[b] = pilot;
+            for (size_t p : placed) {
+                taken[p] = true;
+            }
+        }
+        return true;
+    }
+
+public:
+    // Build a function for keys, any list of strings; key i gets code i
+    template <typename Keys>
+    void build(const Keys& keys) {
+        for (seed = 0;; ++seed) {
+            auto distinct = distinct_keys(keys, seed);
+            pilots.assign(std::max<size_t>(1, (distinct.size() + KEYS_PER_BUCKET - 1) / KEYS_PER_BUCKET), 0);
+            slots.assign(distinct.size(), Slot());
+            if (search_pilots(distinct) && fill_slots(keys, distinct)) {
+                return;
+            }
+        }
+    }
+
+    // Use a stored function for keys; false if it is not perfect for them
+    template <typename Keys>
+    bool assign(const Keys& keys, uint64_t stored_seed, std::vector<uint32_t> stored_pilots) {
+        auto distinct = distinct_keys(keys, stored_seed);
+        if (stored_pilots.size() != std::max<size_t>(1, (distinct.size() + KEYS_PER_BUCKET - 1) / KEYS_PER_BUCKET)) {
+            return false;
+        }
+        seed = stored_seed;
+        pilots = std::move(stored_pilots);
+        return fill_slots(keys, distinct);
+    }
+
+    // Code of key, or NOT_FOUND if it is not one of the keys. For keys
+    // longer than INLINE_BYTES the code is a candidate the caller must check.
+    uint32_t find(std::string_view key) const {
+        if (slots.empty()) {
+            return NOT_FOUND;
+        }
+        uint64_t h = hash_key(key, seed);
+        const Slot& slot = slots[position(h, pilots[bucket_of(h)])];
+        return slot.length == key.size() && slot.prefix == prefix_of(key) ? slot.code : NOT_FOUND;
+    }
+
+    uint64_t get_seed() const {
+        return seed;
+    }
+
+    const std::vector<uint32_t>& get_pilots() const {
+        return pilots;
+    }
+
+    size_t size() const {
+        return slots.size();
+    }
+
+    size_t memory_bytes() const {
+        return pilots.size() * sizeof(uint32_t) + slots.size() * sizeof(Slot);
+    }
+};
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Grammar produced by Re-Pair. Symbols below terminal_count are terminals,
+// symbol terminal_count + i expands to rules[i].first followed by rules[i].second.
+struct RePairGrammar {
+    uint32_t terminal_count = 0;
+    std::vector<std::pair<uint32_t, uint32_t>> rules;
+    std::vector<uint32_t> sequence;
+};
+
+// Re-Pair (Larsson & Moffat): repeatedly replace the most frequent adjacent
+// pair with a new nonterminal until no pair occurs twice.
+//
+// The sequence is a doubly linked list of live positions; every pair keeps a
+// doubly linked list of its occurrences threaded through the same positions.
+// Pairs sit in frequency buckets. The highest frequency never increases (a new
+// pair can only appear where the replaced pair was), so the bucket cursor only
+// moves down and the whole run stays linear in the input length.
+class RePair {
+private:
+    static constexpr int32_t NONE = -1;
+    static constexpr int32_t NOT_LINKED = -2;
+    static constexpr uint32_t DELETED = UINT32_MAX;
+
+    struct PairRecord {
+        uint32_t left;
+        uint32_t right;
+        uint32_t frequency;
+        int32_t first_occurrence;
+        int32_t bucket_prev;
+        int32_t bucket_next;
+    };
+
+    std::vector<uint32_t> symbols;
+    std::vector<int32_t> live_prev, live_next;
+    std::vector<int32_t> occ_prev, occ_next;
+
+    std::vector<PairRecord> records;
+    std::unordered_map<uint64_t, int32_t> pair_index;
+    std::vector<int32_t> buckets;
+    size_t top_frequency = 0;
+
+    static uint64_t pair_key(uint32_t left, uint32_t right) {
+        return (static_cast<uint64_t>(left) << 32) | right;
+    }
+
+    void bucket_unlink(int32_t r) {
+        PairRecord& rec = records[r];
+        if (rec.bucket_prev != NONE) {
+            records[rec.bucket_prev].bucket_next = rec.bucket_next;
+        } else {
+            buckets[rec.frequency] = rec.bucket_next;
+        }
+        if (rec.bucket_next != NONE) {
+            records[rec.bucket_next].bucket_prev = rec.bucket_prev;
+        }
+    }
+
+    void bucket_link(int32_t r) {
+        PairRecord& rec = records[r];
+        if (rec.frequency >= buckets.size()) {
+            buckets.resize(rec.frequency + 1, NONE);
+        }
+        rec.bucket_prev = NONE;
+        rec.bucket_next = buckets[rec.frequency];
+        if (rec.bucket_next != NONE) {
+            records[rec.bucket_next].bucket_prev = r;
+        }
+        buckets[rec.frequency] = r;
+        top_frequency = std::max<size_t>(top_frequency, rec.frequency);
+    }
+
+    // Register the pair starting at pos in its pair's occurrence list
+    void add_occurrence(int32_t pos) {
+        uint32_t left = symbols[pos];
+        uint32_t right = symbols[live_next[pos]];
+        uint64_t key = pair_key(left, right);
+
+        int32_t r;
+        auto it = pair_index.find(key);
+        if (it == pair_index.end()) {
+            r = records.size();
+            records.push_back({left, right, 0, NONE, NONE, NONE});
+            pair_index[key] = r;
+        } else {
+            r = it->second;
+            bucket_unlink(r);
+        }
+
+        PairRecord& rec = records[r];
+        occ_prev[pos] = NONE;
+        occ_next[pos] = rec.first_occurrence;
+        if (rec.first_occurrence != NONE) {
+            occ_prev[rec.first_occurrence] = pos;
+        }
+        rec.first_occurrence = pos;
+        rec.frequency++;
+        bucket_link(r);
+    }
+
+    // Drop the pair starting at pos; must run before either symbol changes
+    void remove_occurrence(int32_t pos) {
+        if (occ_prev[pos] == NOT_LINKED || live_next[pos] == NONE) {
+            return;
+        }
+
+        auto it = pair_index.find(pair_key(symbols[pos], symbols[live_next[pos]]));
+        if (it == pair_index.end()) {
+            occ_prev[pos] = NOT_LINKED;
+            return;
+        }
+        int32_t r = it->second;
+        PairRecord& rec = records[r];
+
+        if (occ_prev[pos] != NONE) {
+            occ_next[occ_prev[pos]] = occ_next[pos];
+        } else {
+            rec.first_occurrence = occ_next[pos];
+        }
+        if (occ_next[pos] != NONE) {
+            occ_prev[occ_next[pos]] = occ_prev[pos];
+        }
+        occ_prev[pos] = NOT_LINKED;
+        occ_next[pos] = NONE;
+
+        bucket_unlink(r);
+        rec.frequency--;
+        if (rec.frequency == 0) {
+            pair_index.erase(it);
+        } else {
+            bucket_link(r);
+        }
+    }
+
+    // In runs like "aaa" only non-overlapping pairs count: the pair at pos
+    // overlaps the one before it if both are the same symbol twice and that
+    // one is counted. Otherwise "aaa" would count (a,a) twice though it can
+    // be replaced only once.
+    bool overlaps_counted_pair(int32_t pos) const {
+        int32_t prev = live_prev[pos];
+        int32_t next = live_next[pos];
+        return prev != NONE && next != NONE && occ_prev[prev] != NOT_LINKED &&
+               symbols[prev] == symbols[pos] && symbols[pos] == symbols[next];
+    }
+
+    void initialize(const std::vector<uint32_t>& input) {
+        size_t n = input.size();
+        symbols = input;
+        live_prev.resize(n);
+        live_next.resize(n);
+        occ_prev.assign(n, NOT_LINKED);
+        occ_next.assign(n, NONE);
+        buckets.assign(2, NONE);
+        top_frequency = 0;
+
+        for (size_t i = 0; i < n; ++i) {
+            live_prev[i] = static_cast<int32_t>(i) - 1;
+            live_next[i] = i + 1 < n ? static_cast<int32_t>(i + 1) : NONE;
+        }
+
+        for (size_t i = 0; i + 1 < n; ++i) {
+            if (!overlaps_counted_pair(i)) {
+                add_occurrence(i);
+            }
+        }
+    }
+
+    void replace_pair(int32_t r, uint32_t nonterminal) {
+        PairRecord rec = records[r];
+
+        // Detach the whole occurrence list first so overlapping occurrences
+        // of the same pair never touch a record that is being consumed
+        std::vector<int32_t> positions;
+        for (int32_t pos = rec.first_occurrence; pos != NONE; pos = occ_next[pos]) {
+            positions.push_back(pos);
+        }
+        for (int32_t pos : positions) {
+            occ_prev[pos] = NOT_LINKED;
+            occ_next[pos] = NONE;
+        }
+        bucket_unlink(r);
+        pair_index.erase(pair_key(rec.left, rec.right));
+        records[r].frequency = 0;
+        records[r].first_occurrence = NONE;
+
+        for (int32_t pos : positions) {
+            int32_t next = live_next[pos];
+            if (symbols[pos] != rec.left || next == NONE || symbols[next] != rec.right) {
+                continue;
+            }
+
+            int32_t prev = live_prev[pos];
+            int32_t after = live_next[next];
+
+            if (prev != NONE) remove_occurrence(prev);
+            remove_occurrence(next);
+
+            symbols[pos] = nonterminal;
+            symbols[next] = DELETED;
+            live_next[pos] = after;
+            if (after != NONE) live_prev[after] = pos;
+
+            // A run of the new symbol, as "ab ab ab" makes, counts like any other
+            if (prev != NONE && !overlaps_counted_pair(prev)) add_occurrence(prev);
+            if (after != NONE && !overlaps_counted_pair(pos)) add_occurrence(pos);
+        }
+    }
+
+public:
+    RePairGrammar build(const std::vector<uint32_t>& input, uint32_t terminal_count) {
+        RePairGrammar grammar;
+        grammar.terminal_count = terminal_count;
+
+        records.clear();
+        pair_index.clear();
+        initialize(input);
+
+        while (true) {
+            while (top_frequency >= 2 && buckets[top_frequency] == NONE) {
+                top_frequency--;
+            }
+            if (top_frequency < 2) {
+                break;
+            }
+
+            int32_t r = buckets[top_frequency];
+            uint32_t nonterminal = terminal_count + grammar.rules.size();
+            grammar.rules.push_back({records[r].left, records[r].right});
+            replace_pair(r, nonterminal);
+        }
+
+        for (int32_t pos = input.empty() ? NONE : 0; pos != NONE; pos = live_next[pos]) {
+            grammar.sequence.push_back(symbols[pos]);
+        }
+
+        symbols.clear();
+        live_prev.clear();
+        live_next.clear();
+        occ_prev.clear();
+        occ_next.clear();
+        records.clear();
+        pair_index.clear();
+        buckets.clear();
+
+        return grammar;
+    }
+};
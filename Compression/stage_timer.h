@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+// Heap allocations of the process so far. The program counts them in its
+// replacement operator new; without one they stay zero. Worker threads
+// allocate too, so the counts are atomic.
+struct HeapCounters {
+    static inline std::atomic<uint64_t> allocations{0};
+    static inline std::atomic<uint64_t> bytes{0};
+
+    // Relaxed: the counts order nothing, and this runs on every allocation
+    static void count(size_t size) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+};
+
+// Wall-clock time and heap allocations per named pipeline stage. Stages
+// nest: while an inner stage runs the enclosing one is paused, so each stage
+// reports only its own share and the stages of a run add up to the whole run.
+class StageTimer {
+public:
+    struct Stage {
+        std::string name;
+        uint64_t nanoseconds = 0;
+        uint64_t allocations = 0;
+        uint64_t allocated_bytes = 0;
+    };
+
+    // Times one stage for the lifetime of the object
+    class Scope {
+    private:
+        StageTimer& timer;
+
+    public:
+        Scope(StageTimer& timer, const char* name) : timer(timer) {
+            timer.begin(name);
+        }
+        ~Scope() {
+            timer.end();
+        }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    std::vector<Stage> stages;   // In order of first use
+    std::vector<size_t> active;  // Running stages, innermost last
+    Clock::time_point last_switch;
+    uint64_t last_allocations = 0;
+    uint64_t last_allocated_bytes = 0;
+
+    // Charge everything since the last switch to the innermost running stage
+    void charge(Clock::time_point now) {
+        if (!active.empty()) {
+            Stage& stage = stages[active.back()];
+            stage.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_switch).count();
+            stage.allocations += HeapCounters::allocations - last_allocations;
+            stage.allocated_bytes += HeapCounters::bytes - last_allocated_bytes;
+        }
+        last_switch = now;
+        last_allocations = HeapCounters::allocations;
+        last_allocated_bytes = HeapCounters::bytes;
+    }
+
+    size_t stage_index(const char* name) {
+        for (size_t i = 0; i < stages.size(); ++i) {
+            if (stages[i].name == name) {
+                return i;
+            }
+        }
+        stages.push_back({name, 0, 0, 0});
+        return stages.size() - 1;
+    }
+
+public:
+    void begin(const char* name) {
+        charge(Clock::now());
+        active.push_back(stage_index(name));
+    }
+
+    void end() {
+        charge(Clock::now());
+        active.pop_back();
+    }
+
+    void reset() {
+        stages.clear();
+        active.clear();
+    }
+
+    const std::vector<Stage>& get_stages() const {
+        return stages;
+    }
+
+    uint64_t total_nanoseconds() const {
+        uint64_t total = 0;
+        for (const auto& stage : stages) {
+            total += stage.nanoseconds;
+        }
+        return total;
+    }
+
+    // The named stage, or an empty one if it never ran
+    Stage find(const std::string& name) const {
+        for (const auto& stage : stages) {
+            if (stage.name == name) {
+                return stage;
+            }
+        }
+        return Stage{name, 0, 0, 0};
+    }
+};
+
+// Peak resident set size of this process in kilobytes
+inline long peak_rss_kb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return usage.ru_maxrss;
+}
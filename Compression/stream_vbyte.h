@@ -0,0 +1,141 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STREAM_VBYTE_X86 1
+#endif
+
+// Stream VByte: each value takes 1 to 4 little-endian data bytes, and its
+// byte count goes to a separate control stream, 2 bits per value, four
+// values per control byte with the first value in the low bits. All control
+// bytes come first, then the data bytes. A decoder reads one control byte,
+// gathers the four values' bytes with one SSSE3 shuffle from a 256-entry
+// table, and moves on by the table's length, with no branch per value.
+class StreamVByte {
+public:
+    static size_t control_bytes(size_t count) {
+        return (count + 3) / 4;
+    }
+
+    static std::vector<uint8_t> encode(const std::vector<uint32_t>& values) {
+        std::vector<uint8_t> encoded(control_bytes(values.size()), 0);
+        for (size_t i = 0; i < values.size(); ++i) {
+            uint32_t value = values[i];
+            uint8_t length = value < (1u << 8) ? 1 : value < (1u << 16) ? 2 : value < (1u << 24) ? 3 : 4;
+            encoded[i / 4] |= (length - 1) << (2 * (i % 4));
+            for (uint8_t k = 0; k < length; ++k) {
+                encoded.push_back(static_cast<uint8_t>(value >> (8 * k)));
+            }
+        }
+        return encoded;
+    }
+
+    // Decode count values from size bytes into out; false if the bytes do
+    // not hold exactly count values
+    static bool decode(const uint8_t* encoded, size_t size, size_t count, uint32_t* out) {
+        static const DecodeKernel kernel = select_kernel().decode;
+        size_t controls = control_bytes(count);
+        if (size < controls) {
+            return false;
+        }
+        return kernel(encoded, encoded + controls, encoded + size, count, out);
+    }
+
+    // Name of the decoder decode runs on this CPU
+    static const char* kernel_name() {
+        return select_kernel().name;
+    }
+
+private:
+    typedef bool (*DecodeKernel)(const uint8_t* control, const uint8_t* data, const uint8_t* end,
+                                 size_t count, uint32_t* out);
+
+    struct Kernel {
+        const char* name;
+        DecodeKernel decode;
+    };
+
+    // Data bytes of the four values of each control byte
+    static constexpr std::array<uint8_t, 256> make_lengths() {
+        std::array<uint8_t, 256> lengths = {};
+        for (uint32_t control = 0; control < 256; ++control) {
+            for (uint32_t k = 0; k < 4; ++k) {
+                lengths[control] += ((control >> (2 * k)) & 3) + 1;
+            }
+        }
+        return lengths;
+    }
+
+    // Shuffle that moves the data bytes of each control byte's four values
+    // into four 32-bit lanes; 0xFF clears a byte
+    static constexpr std::array<std::array<uint8_t, 16>, 256> make_shuffles() {
+        std::array<std::array<uint8_t, 16>, 256> shuffles = {};
+        for (uint32_t control = 0; control < 256; ++control) {
+            uint8_t source = 0;
+            for (uint32_t k = 0; k < 4; ++k) {
+                uint32_t length = ((control >> (2 * k)) & 3) + 1;
+                for (uint32_t b = 0; b < 4; ++b) {
+                    shuffles[control][4 * k + b] = b < length ? source++ : 0xFF;
+                }
+            }
+        }
+        return shuffles;
+    }
+
+    // Decode values [first, count) one at a time
+    static bool decode_tail(const uint8_t* control, const uint8_t* data, const uint8_t* end,
+                            size_t first, size_t count, uint32_t* out) {
+        for (size_t i = first; i < count; ++i) {
+            uint8_t length = ((control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+            if (static_cast<size_t>(end - data) < length) {
+                return false;
+            }
+            uint32_t value = 0;
+            for (uint8_t k = 0; k < length; ++k) {
+                value |= static_cast<uint32_t>(data[k]) << (8 * k);
+            }
+            out[i] = value;
+            data += length;
+        }
+        return data == end;
+    }
+
+    static bool decode_scalar(const uint8_t* control, const uint8_t* data, const uint8_t* end,
+                              size_t count, uint32_t* out) {
+        return decode_tail(control, data, end, 0, count, out);
+    }
+
+#ifdef STREAM_VBYTE_X86
+    // Four values per control byte while 16 data bytes can be loaded
+    __attribute__((target("ssse3"))) static bool decode_ssse3(const uint8_t* control, const uint8_t* data,
+                                                             const uint8_t* end, size_t count, uint32_t* out) {
+        static constexpr std::array<uint8_t, 256> lengths = make_lengths();
+        static constexpr std::array<std::array<uint8_t, 16>, 256> shuffles = make_shuffles();
+        size_t i = 0;
+        for (; i + 4 <= count && end - data >= 16; i += 4) {
+            uint8_t bits = control[i / 4];
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+            __m128i shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i*>(shuffles[bits].data()));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_shuffle_epi8(bytes, shuffle));
+            data += lengths[bits];
+        }
+        return decode_tail(control, data, end, i, count, out);
+    }
+#endif
+
+    static Kernel select_kernel() {
+#ifdef STREAM_VBYTE_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("ssse3")) {
+            return {"ssse3", &decode_ssse3};
+        }
+#endif
+        return {"scalar", &decode_scalar};
+    }
+};
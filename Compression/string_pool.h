@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+// Word list stored as one block of text plus a 32-bit offset per word. The
+// layout is that of a dictionary file's word section: every word is followed
+// by one '\n'. So a pool either owns its text, when words are added one by
+// one, or views the word lines of a mapped dictionary file in place, with no
+// copy and no allocation per word.
+class StringPool {
+public:
+    // Words are copied out in chunks of this many bytes
+    static constexpr size_t COPY_WIDTH = 16;
+
+private:
+    std::vector<char> storage;     // Owned text
+    const char* mapped = nullptr;  // Viewed text instead, if set
+    size_t mapped_size = 0;
+
+    // Word i spans [offsets[i], offsets[i + 1] - 1); no entries for no words
+    std::vector<uint32_t> offsets;
+
+    const char* text() const {
+        return mapped != nullptr ? mapped : storage.data();
+    }
+
+    size_t text_size() const {
+        return mapped != nullptr ? mapped_size : storage.size();
+    }
+
+public:
+    size_t size() const {
+        return offsets.empty() ? 0 : offsets.size() - 1;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    std::string_view operator[](size_t i) const {
+        return std::string_view(text() + offsets[i], offsets[i + 1] - offsets[i] - 1);
+    }
+
+    size_t length(size_t i) const {
+        return offsets[i + 1] - offsets[i] - 1;
+    }
+
+    // Drop every word, and any view of outside text
+    void clear() {
+        storage.clear();
+        offsets.clear();
+        mapped = nullptr;
+        mapped_size = 0;
+    }
+
+    void push_back(std::string_view word) {
+        if (mapped != nullptr) {
+            // Stop viewing: copy the viewed words into owned text first
+            uint32_t base = offsets.front();
+            storage.assign(mapped + base, mapped + offsets.back());
+            for (auto& offset : offsets) {
+                offset -= base;
+            }
+            mapped = nullptr;
+            mapped_size = 0;
+        }
+        if (offsets.empty()) {
+            offsets.push_back(storage.size());
+        }
+        storage.insert(storage.end(), word.begin(), word.end());
+        storage.push_back('\n');
+        offsets.push_back(storage.size());
+    }
+
+    // View count lines of data from offset start on as the words, without
+    // copying, and set end to the offset after the last line. False if data
+    // ends early or holds an empty line; the pool is then left empty. data
+    // must outlive the pool or its next clear().
+    bool view_lines(const char* data, size_t size, size_t start, uint32_t count, size_t& end) {
+        clear();
+        offsets.reserve(static_cast<size_t>(count) + 1);
+        offsets.push_back(start);
+        size_t position = start;
+        for (uint32_t i = 0; i < count; ++i) {
+            const char* line_end = static_cast<const char*>(memchr(data + position, '\n', size - position));
+            if (line_end == nullptr || line_end == data + position) {
+                clear();
+                return false;
+            }
+            position = line_end - data + 1;
+            offsets.push_back(position);
+        }
+        mapped = data;
+        mapped_size = size;
+        end = position;
+        return true;
+    }
+
+    // Copy word i to out and return its length. Whole COPY_WIDTH chunks are
+    // copied, so out needs COPY_WIDTH bytes of room past the word; the bytes
+    // written there are garbage for the next word to overwrite. Fixed-size
+    // copies compile to plain vector moves, where a copy of the exact length
+    // would be a library call.
+    size_t copy_word(size_t i, char* out) const {
+        const char* source = text() + offsets[i];
+        size_t word_length = length(i);
+        size_t chunked = (word_length + COPY_WIDTH - 1) & ~(COPY_WIDTH - 1);
+        if (offsets[i] + chunked <= text_size()) {
+            for (size_t k = 0; k < word_length; k += COPY_WIDTH) {
+                memcpy(out + k, source + k, COPY_WIDTH);
+            }
+        } else {
+            // Too close to the end of the text to read whole chunks
+            memcpy(out, source, word_length);
+        }
+        return word_length;
+    }
+
+    // Iteration over the words as string_views
+    class const_iterator {
+    private:
+        const StringPool* pool;
+        size_t index;
+
+    public:
+        const_iterator(const StringPool* pool, size_t index) : pool(pool), index(index) {}
+
+        std::string_view operator*() const {
+            return (*pool)[index];
+        }
+
+        const_iterator& operator++() {
+            index++;
+            return *this;
+        }
+
+        bool operator!=(const const_iterator& other) const {
+            return index != other.index;
+        }
+    };
+
+    const_iterator begin() const {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, size());
+    }
+};
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// What the tokenizer drops and lossless mode keeps: the capitalization of
+// each token and the whitespace before it, as a small class per token. A
+// class that is not one of the common few is spelled out in full.
+struct TextForms {
+    enum CaseClass : uint8_t {
+        CASE_LOWER,      // Also tokens without letters
+        CASE_TITLE,      // First letter upper case, the rest lower case
+        CASE_UPPER,
+        CASE_EXCEPTION,  // Written out in exceptions
+        CASE_COUNT
+    };
+
+    enum SpacingClass : uint8_t {
+        SPACING_SPACE,
+        SPACING_NONE,
+        SPACING_NEWLINE,
+        SPACING_OTHER,   // Written out in separators
+        SPACING_COUNT
+    };
+
+    std::vector<uint8_t> cases;           // CaseClass per token
+    std::vector<uint8_t> spacings;        // SpacingClass of the whitespace before each token
+    std::vector<std::string> exceptions;  // Token as written, per CASE_EXCEPTION
+    std::vector<std::string> separators;  // Whitespace, per SPACING_OTHER
+    std::string trailing;                 // Whitespace after the last token
+
+    void clear() {
+        *this = TextForms();
+    }
+
+    // Record a token as written and the whitespace before it
+    void add(const char* token, size_t length, const char* separator, size_t separator_length) {
+        uint8_t case_class = case_of(token, length);
+        cases.push_back(case_class);
+        if (case_class == CASE_EXCEPTION) {
+            exceptions.emplace_back(token, length);
+        }
+        uint8_t spacing = spacing_of(separator, separator_length);
+        spacings.push_back(spacing);
+        if (spacing == SPACING_OTHER) {
+            separators.emplace_back(separator, separator_length);
+        }
+    }
+
+    // Case class of a token as written, checked against the same rewrites
+    // apply_case makes of its lower-case form, so the two always agree
+    static uint8_t case_of(const char* token, size_t length) {
+        std::string word(token, length);
+        for (char& c : word) {
+            c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        }
+        for (uint8_t case_class = CASE_LOWER; case_class < CASE_EXCEPTION; ++case_class) {
+            std::string rewritten = word;
+            apply_case(&rewritten[0], length, case_class);
+            if (rewritten.compare(0, length, token, length) == 0) {
+                return case_class;
+            }
+        }
+        return CASE_EXCEPTION;
+    }
+
+    // Rewrite a lower-case word in place; exceptions are copied instead
+    static void apply_case(char* word, size_t length, uint8_t case_class) {
+        if (case_class == CASE_UPPER) {
+            for (size_t i = 0; i < length; ++i) {
+                word[i] = static_cast<char>(toupper(static_cast<unsigned char>(word[i])));
+            }
+        } else if (case_class == CASE_TITLE) {
+            for (size_t i = 0; i < length; ++i) {
+                if (isalpha(static_cast<unsigned char>(word[i]))) {
+                    word[i] = static_cast<char>(toupper(static_cast<unsigned char>(word[i])));
+                    break;
+                }
+            }
+        }
+    }
+
+    static uint8_t spacing_of(const char* separator, size_t length) {
+        if (length == 0) {
+            return SPACING_NONE;
+        }
+        if (length == 1 && separator[0] == ' ') {
+            return SPACING_SPACE;
+        }
+        if (length == 1 && separator[0] == '\n') {
+            return SPACING_NEWLINE;
+        }
+        return SPACING_OTHER;
+    }
+
+    // Guesses the forms of each token from the ones before it, the same way
+    // on both sides, so only the misses need to be stored. Spacing follows
+    // from the punctuation around the gap: none before a comma, a space
+    // after it. Where that says space or newline, text wrapped at a fixed
+    // width breaks the line when the token and the punctuation after it
+    // would not fit. Case follows from the token before, Title after a full
+    // stop, and otherwise from how the same word was last written
+    // mid-sentence, which catches names. Each context predicts its most
+    // frequent class so far. Counts start over with reset(), once per block.
+    class Predictor {
+    public:
+        // A word is one context key; each punctuation byte is a key of its own
+        static constexpr uint32_t KEY_COUNT = 257;
+        static constexpr uint32_t START_KEY = KEY_COUNT;  // Before the first token of a block
+        
+        // Widths of wrapped text go up to this; 0 means not wrapped
+        static constexpr uint32_t MAX_WRAP_WIDTH = 255;
+
+        static uint16_t key_of(char first) {
+            unsigned char c = static_cast<unsigned char>(first);
+            return isalnum(c) || c == '\'' ? 0 : 1 + c;
+        }
+
+        // word_count is the number of word IDs, main and local dictionary together
+        explicit Predictor(size_t word_count)
+            : case_contexts(KEY_COUNT + 1), spacing_contexts((KEY_COUNT + 1) * KEY_COUNT),
+              last_cases(word_count, CASE_LOWER) {}
+
+        void reset(uint32_t block_wrap_width) {
+            std::fill(case_contexts.begin(), case_contexts.end(), Context());
+            std::fill(spacing_contexts.begin(), spacing_contexts.end(), Context());
+            std::fill(last_cases.begin(), last_cases.end(), CASE_LOWER);
+            previous_key = START_KEY;
+            wrap_width = block_wrap_width;
+            column = 0;
+        }
+
+        uint8_t guess_case(uint32_t word_id) const {
+            uint8_t mode = case_contexts[previous_key].mode;
+            return mode == CASE_LOWER ? last_cases[word_id] : mode;
+        }
+
+        // chunk_length is the length of the token and the punctuation after it
+        uint8_t guess_spacing(uint16_t key, size_t chunk_length) const {
+            uint8_t mode = spacing_contexts[previous_key * KEY_COUNT + key].mode;
+            if (wrap_width > 0 && (mode == SPACING_SPACE || mode == SPACING_NEWLINE)) {
+                return wrap_column(chunk_length) > wrap_width ? SPACING_NEWLINE : SPACING_SPACE;
+            }
+            return mode;
+        }
+
+        // Column the chunk would end at after a space, at most MAX_WRAP_WIDTH;
+        // the encoder picks the wrap width of a block from these
+        uint32_t wrap_column(size_t chunk_length) const {
+            return static_cast<uint32_t>(std::min<size_t>(column + 1 + chunk_length, MAX_WRAP_WIDTH));
+        }
+
+        // Learn the actual forms of the token, its separator text and its
+        // length, and move past it
+        void update(uint32_t word_id, uint16_t key, uint8_t case_class, uint8_t spacing,
+                    const std::string& separator, size_t length) {
+            Context& case_context = case_contexts[previous_key];
+            if (case_context.mode == CASE_LOWER) {
+                last_cases[word_id] = case_class;
+            }
+            case_context.count(case_class);
+            spacing_contexts[previous_key * KEY_COUNT + key].count(spacing);
+            previous_key = key;
+            
+            size_t newline = separator.rfind('\n');
+            if (spacing == SPACING_NEWLINE) {
+                column = 0;
+            } else if (spacing == SPACING_SPACE) {
+                column++;
+            } else if (newline != std::string::npos) {
+                column = separator.size() - newline - 1;
+            } else {
+                column += separator.size();
+            }
+            column += length;
+        }
+
+    private:
+        struct Context {
+            std::array<uint32_t, 4> counts = {};
+            uint8_t mode = 0;
+
+            void count(uint8_t value) {
+                if (++counts[value] > counts[mode]) {
+                    mode = value;
+                }
+            }
+        };
+
+        std::vector<Context> case_contexts;
+        std::vector<Context> spacing_contexts;
+        std::vector<uint8_t> last_cases;
+        uint32_t previous_key = START_KEY;
+        uint32_t wrap_width = 0;
+        size_t column = 0;
+    };
+};